@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "VoxelMaterial.h"
+#include "VoxelValue.h"
 #include "VoxelBox.h"
 #include "VoxelAsset.h"
 #include "BufferArchive.h"
@@ -19,7 +20,7 @@ struct VOXEL_API FDecompressedVoxelDataAsset : FDecompressedVoxelAsset
 	int32 HalfSizeY;
 	int32 HalfSizeZ;
 
-	TArray<float> Values;
+	TArray<FVoxelValue> Values;
 	TArray<FVoxelMaterial> Materials;
 
 	TArray<uint8> VoxelTypes;
@@ -62,6 +63,10 @@ public:
 
 	bool GetDecompressedAsset(FDecompressedVoxelAsset*& Asset, const float VoxelSize) override;
 
+	// VOXEL_VALUE_BITS of the build that created this asset. Assets made before it was added are 32. Converted when loaded
+	UPROPERTY(VisibleAnywhere)
+		int ValueBits;
+
 protected:
 	void AddAssetToArchive(FBufferArchive& ToBinary, FDecompressedVoxelAsset* Asset) override;
 	void GetAssetFromArchive(FMemoryReader& FromBinary, FDecompressedVoxelAsset* Asset) override;
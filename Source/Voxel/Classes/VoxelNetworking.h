@@ -3,17 +3,127 @@
 #include "CoreMinimal.h"
 #include "Networking.h"
 #include "Engine.h"
-
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter64.h"
+#include "Containers/Queue.h"
+
+/**
+ * Messages announcing a larger size are treated as a corrupted stream
+ */
+#define VOXEL_MAX_MESSAGE_SIZE (256 * 1024 * 1024)
+
+/**
+ * Connections with more bytes waiting to be sent are too slow, and are closed
+ */
+#define VOXEL_MAX_QUEUED_SIZE (2 * VOXEL_MAX_MESSAGE_SIZE)
+
+/**
+ * Message payload. Shared between all the connections it's sent to
+ */
+typedef TSharedPtr<TArray<uint8>, ESPMode::ThreadSafe> FVoxelMessagePtr;
+
+/**
+ * TCP connection exchanging messages framed by their length: uint32 little endian size, then the payload
+ * The socket is only used by the network thread. Other threads exchange whole messages through queues
+ */
 class FVoxelTcpConnection
 {
 public:
-	FSocket* const Socket;
-
 	FVoxelTcpConnection(FSocket* const Socket);
 	~FVoxelTcpConnection();
 
-	bool SendData(TArray<uint8> Data);
-	void ReceiveData(TArray<uint8>& OutData);
+	/**
+	 * Queue a message. Closes the connection if the remote doesn't read them fast enough. Game thread
+	 * @param	Message		At most VOXEL_MAX_MESSAGE_SIZE bytes
+	 */
+	void SendMessage(const FVoxelMessagePtr& Message);
+
+	/**
+	 * Pop the oldest complete message received. Game thread
+	 * @return	false if there is none
+	 */
+	bool ReceiveMessage(TArray<uint8>& OutMessage);
+
+	/**
+	 * False once the socket failed, the remote closed it or sent an invalid frame
+	 */
+	FORCEINLINE bool IsConnected() const;
+
+	/**
+	 * Send the queued messages and reassemble the received ones, without blocking. Network thread
+	 * @return	Whether any byte was sent or received
+	 */
+	bool Tick();
+
+private:
+	FSocket* const Socket;
+	FThreadSafeBool bConnected;
+
+	TQueue<FVoxelMessagePtr> OutgoingMessages;
+	TQueue<FVoxelMessagePtr> IncomingMessages;
+	// Bytes of the messages queued and not fully sent yet
+	FThreadSafeCounter64 QueuedSize;
+
+	// Message being sent, and bytes of its header and payload already sent
+	FVoxelMessagePtr SendingMessage;
+	uint8 SendingHeader[4];
+	int32 SendingOffset;
+
+	// Bytes received that are not part of a complete message yet start at ReceiveOffset
+	TArray<uint8> ReceiveBuffer;
+	int32 ReceiveOffset;
+
+	double NextStateCheckTime;
+
+	bool SendPendingData();
+	bool ReceivePendingData();
+	void ExtractMessages();
+
+	/**
+	 * Is the last socket error a non blocking call that would have blocked?
+	 */
+	bool WouldBlock() const;
+};
+
+/**
+ * Thread doing all the socket I/O of a client or server
+ */
+class FVoxelNetworkThread : public FRunnable
+{
+public:
+	FVoxelNetworkThread();
+	virtual ~FVoxelNetworkThread();
+
+	/**
+	 * Thread safe: the server adds the connections from its listener thread
+	 */
+	void AddConnection(const TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>& Connection);
+
+	/**
+	 * Connections still connected. Thread safe
+	 */
+	void GetConnections(TArray<TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>>& OutConnections) const;
+
+	/**
+	 * Wake the thread up after queuing messages, instead of waiting for its next poll
+	 */
+	void WakeUp();
+
+	//~ Begin FRunnable Interface
+	virtual uint32 Run() override;
+	virtual void Stop() override;
+	//~ End FRunnable Interface
+
+private:
+	FThreadSafeBool bStopping;
+	FEvent* WakeUpEvent;
+
+	mutable FCriticalSection Section;
+	TArray<TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>> Connections;
+
+	// Last member: the thread starts in the constructor
+	FRunnableThread* Thread;
 };
 
 class FVoxelTcpClient
@@ -24,13 +134,17 @@ public:
 
 	void ConnectTcpClient(const FString& Ip, const int32 Port);
 
-	void ReceiveData(TArray<uint8>& OutData);
+	/**
+	 * Pop the oldest complete message received from the server
+	 * @return	false if there is none
+	 */
+	bool ReceiveMessage(TArray<uint8>& OutMessage);
 
 	bool IsValid();
 
 private:
-	FVoxelTcpConnection* Connection;
-
+	TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe> Connection;
+	TUniquePtr<FVoxelNetworkThread> NetworkThread;
 };
 
 class FVoxelTcpServer
@@ -41,13 +155,29 @@ public:
 
 	void StartTcpServer(const FString& Ip, const int32 Port);
 
+	/**
+	 * Called on the listener thread
+	 */
 	bool Accept(FSocket* NewSocket, const FIPv4Endpoint& Endpoint);
 
-	bool SendData(TArray<uint8> Data);
-
+	/**
+	 * Queue Message for all the clients. Sent by the network thread
+	 * @param	Message		Rejected if larger than VOXEL_MAX_MESSAGE_SIZE: the clients would close the connection
+	 * @return	false if no client is connected or the message is too large
+	 */
+	bool SendMessage(TArray<uint8>&& Message);
+
+	/**
+	 * Is at least one client connected?
+	 */
+	bool HasConnectedClients();
+
+	/**
+	 * Same as HasConnectedClients
+	 */
 	bool IsValid();
 
 private:
 	FTcpListener* TcpListener;
-	TArray<FVoxelTcpConnection*> Connections;
-};
\ No newline at end of file
+	TUniquePtr<FVoxelNetworkThread> NetworkThread;
+};
@@ -5,112 +5,268 @@
 #include "CoreMinimal.h"
 #include "GameFramework/SaveGame.h"
 #include "VoxelMaterial.h"
+#include "VoxelValue.h"
 #include "VoxelProceduralMeshTypes.h"
-#include <list>
+#include "VoxelBox.h"
 #include <forward_list>
 #include "VoxelSave.generated.h"
 
 
+namespace EVoxelSaveVersion
+{
+	enum Type
+	{
+		// Chunk Ids are base 9 encoded
+		Base9Ids = 0,
+		// Chunk Ids are Morton keys
+		MortonIds = 1,
+		// Chunks identical to a previous one only store its Id
+		SharedChunks = 2,
+		// Chunks are compressed independently, with an index
+		IndexedChunks = 3,
+		// Chunks are compressed with ZSTD instead of zlib
+		ZSTDChunks = 4,
+		// Chunks can store only the voxels different from the world generator
+		GeneratorResiduals = 5,
+
+		Latest = GeneratorResiduals
+	};
+}
+
+/**
+ * Move only: the values and materials of a chunk are never copied between containers
+ */
 struct FVoxelChunkSave
 {
 	uint64 Id;
 
-	TArray<float, TFixedAllocator<16 * 16 * 16>> Values;
+	// Id of a previous chunk of the save with the same values and materials, which are then not saved. 0 if none
+	uint64 SourceId;
+
+	// Only the voxels different from the world generator are stored. Never referenced by other chunks, as they depend on the chunk position
+	bool bResidual;
 
-	TArray<FVoxelMaterial, TFixedAllocator<16 * 16 * 16>> Materials;
+	// All the voxels, or if bResidual only the ones set in the masks, by increasing index
+	TArray<FVoxelValue> Values;
+
+	TArray<FVoxelMaterial> Materials;
+
+	// 128 words, one bit per voxel, set if its value/material is stored. Empty if not bResidual
+	TArray<uint32> ValueMask;
+	TArray<uint32> MaterialMask;
 
 	FVoxelChunkSave();
 
+	FVoxelChunkSave(FVoxelChunkSave&&) = default;
+	FVoxelChunkSave& operator=(FVoxelChunkSave&&) = default;
+
+	FVoxelChunkSave(const FVoxelChunkSave&) = delete;
+	FVoxelChunkSave& operator=(const FVoxelChunkSave&) = delete;
+
 	FVoxelChunkSave(uint64 Id, FIntVector Position, float Values[16 * 16 * 16], FVoxelMaterial Materials[16 * 16 * 16]);
+
+	/**
+	 * Chunk identical to the previous chunk SourceId
+	 */
+	FVoxelChunkSave(uint64 Id, uint64 SourceId);
+
+	/**
+	 * Residual chunk: the voxels not in the masks are the world generator ones
+	 * @param	Values		Values of the voxels set in InValueMask, by increasing index
+	 * @param	Materials	Materials of the voxels set in InMaterialMask, by increasing index
+	 */
+	FVoxelChunkSave(uint64 Id, const uint32 InValueMask[128], const uint32 InMaterialMask[128], TArray<FVoxelValue>&& Values, TArray<FVoxelMaterial>&& Materials);
+
+	/**
+	 * Do Values and Materials have one element per voxel, or if bResidual per bit set in the masks? False for a corrupt save
+	 */
+	bool HasValidCounts() const;
+
+	/**
+	 * Is the value/material at Index stored? Always true if not residual
+	 */
+	FORCEINLINE bool HasValue(int Index) const
+	{
+		return !bResidual || (ValueMask[Index / 32] & (1u << (Index % 32)));
+	}
+	FORCEINLINE bool HasMaterial(int Index) const
+	{
+		return !bResidual || (MaterialMask[Index / 32] & (1u << (Index % 32)));
+	}
 };
 
-FORCEINLINE FArchive& operator<<(FArchive &Ar, FVoxelChunkSave& Save)
+/**
+ * @param	Version		EVoxelSaveVersion of the save
+ */
+FORCEINLINE void SerializeVoxelChunk(FArchive& Ar, FVoxelChunkSave& Save, int Version)
 {
 	Ar << Save.Id;
-	Ar << Save.Values;
-	Ar << Save.Materials;
-
-	return Ar;
+	if (Version >= EVoxelSaveVersion::SharedChunks)
+	{
+		Ar << Save.SourceId;
+	}
+	if (Version >= EVoxelSaveVersion::GeneratorResiduals)
+	{
+		uint8 bResidual = Save.bResidual;
+		Ar << bResidual;
+		Save.bResidual = bResidual != 0;
+	}
+	if (Save.bResidual)
+	{
+		check(Version >= EVoxelSaveVersion::GeneratorResiduals);
+		Save.ValueMask.SetNumZeroed(128);
+		Save.MaterialMask.SetNumZeroed(128);
+		Ar.Serialize(Save.ValueMask.GetData(), 128 * sizeof(uint32));
+		Ar.Serialize(Save.MaterialMask.GetData(), 128 * sizeof(uint32));
+	}
+	if (Save.SourceId == 0)
+	{
+		Ar << Save.Values;
+		Ar << Save.Materials;
+	}
 }
 
-USTRUCT(BlueprintType, Category = Voxel)
-struct VOXEL_API FVoxelWorldSave
+/**
+ * Position of a compressed chunk in FVoxelWorldSave::Data
+ */
+USTRUCT()
+struct FVoxelChunkRecord
 {
 	GENERATED_BODY()
 
 public:
-	UPROPERTY(VisibleAnywhere)
-		int Depth;
-
 	UPROPERTY()
-		TArray<uint8> Data;
-
+		uint64 Id;
 
-	FVoxelWorldSave();
+	UPROPERTY()
+		int32 Offset;
 
-	void Init(int NewDepth, std::list<TSharedRef<FVoxelChunkSave>> ChunksList);
+	UPROPERTY()
+		int32 CompressedSize;
 
-	std::list<FVoxelChunkSave> GetChunksList() const;
+	UPROPERTY()
+		int32 UncompressedSize;
 };
 
-
-USTRUCT()
-struct FVoxelValueDiff
+USTRUCT(BlueprintType, Category = Voxel)
+struct VOXEL_API FVoxelWorldSave
 {
 	GENERATED_BODY()
 
 public:
-	UPROPERTY(EditAnywhere)
-		uint64 Id;
+	UPROPERTY(VisibleAnywhere)
+		int Depth;
 
-	UPROPERTY(EditAnywhere)
-		int Index;
+	// VOXEL_VALUE_BITS of the build that created this save. Saves made before it was added are 32
+	UPROPERTY(VisibleAnywhere)
+		int ValueBits;
 
-	UPROPERTY(EditAnywhere)
-		float Value;
+	// EVoxelSaveVersion of the build that created this save. Saves made before it was added are Base9Ids
+	UPROPERTY(VisibleAnywhere)
+		int Version;
 
-	FVoxelValueDiff();
+	// One compressed stream of all the chunks before IndexedChunks
+	UPROPERTY()
+		TArray<uint8> Data;
+
+	// Chunks in Data, sorted by Id. Empty before IndexedChunks
+	UPROPERTY()
+		TArray<FVoxelChunkRecord> Records;
+
+
+	FVoxelWorldSave();
 
-	FVoxelValueDiff(uint64 Id, int Index, float Value);
+	/**
+	 * @param	Chunks	Chunks to save. Only read
+	 */
+	void Init(int NewDepth, TArray<FVoxelChunkSave>& Chunks);
+
+	TArray<FVoxelChunkSave> GetChunksList() const;
+
+	/**
+	 * Serialize and compress Chunk at the end of OutData, like the chunks of the saves. Thread safe
+	 * @param	Version		EVoxelSaveVersion to serialize and compress with. IndexedChunks or more
+	 * @return	OutRecord	Position of the chunk in OutData
+	 */
+	static void CompressChunk(FVoxelChunkSave& Chunk, int Version, TArray<uint8>& OutData, FVoxelChunkRecord& OutRecord);
+
+	/**
+	 * Get the chunks overlapping Box. Only decompresses them, and the chunks they reference
+	 * @param	Box		Box in voxel space
+	 */
+	TArray<FVoxelChunkSave> GetChunksListInBox(const FVoxelBox& Box) const;
+
+private:
+	/**
+	 * Decompress the whole stream of a save made before IndexedChunks
+	 */
+	TArray<FVoxelChunkSave> GetChunksListFromStream() const;
+
+	/**
+	 * Decompress a chunk. Its values and materials are not read if it's a reference. Thread safe
+	 */
+	bool ReadChunk(const FVoxelChunkRecord& Record, FVoxelChunkSave& OutChunk) const;
+
+	/**
+	 * Binary search in Records
+	 * @return	nullptr if not found
+	 */
+	const FVoxelChunkRecord* FindRecord(uint64 Id) const;
+
+	/**
+	 * Copy the values and materials of the chunk referenced by Chunk, if any
+	 * @param	LoadedChunks	Chunks already read. The others are read from the records
+	 * @param	LoadedIndices	Index in LoadedChunks of each chunk already read, by Id
+	 */
+	bool ResolveChunk(FVoxelChunkSave& Chunk, const TArray<FVoxelChunkSave>& LoadedChunks, const TMap<uint64, int32>& LoadedIndices) const;
 };
 
-FORCEINLINE FArchive& operator<<(FArchive &Ar, FVoxelValueDiff& ValueDiff)
+
+/**
+ * Voxels of a leaf modified since the last network sync. Move only
+ */
+struct FVoxelLeafDiff
 {
-	Ar << ValueDiff.Id;
-	Ar << ValueDiff.Index;
-	Ar << ValueDiff.Value;
+	uint64 Id;
 
-	return Ar;
-}
+	// 128 words, one bit per voxel, set if its value/material changed
+	TArray<uint32> ValueMask;
+	TArray<uint32> MaterialMask;
 
-USTRUCT()
-struct FVoxelMaterialDiff
-{
-	GENERATED_BODY()
+	// Values/materials of the voxels set in the masks, by increasing index
+	TArray<FVoxelValue> Values;
+	TArray<FVoxelMaterial> Materials;
 
-public:
-	UPROPERTY(EditAnywhere)
-		uint64 Id;
+	FVoxelLeafDiff();
 
-	UPROPERTY(EditAnywhere)
-		int Index;
+	FVoxelLeafDiff(FVoxelLeafDiff&&) = default;
+	FVoxelLeafDiff& operator=(FVoxelLeafDiff&&) = default;
 
-	UPROPERTY(EditAnywhere)
-		FVoxelMaterial Material;
+	FVoxelLeafDiff(const FVoxelLeafDiff&) = delete;
+	FVoxelLeafDiff& operator=(const FVoxelLeafDiff&) = delete;
 
-	FVoxelMaterialDiff();
+	/**
+	 * Empty diff: the masks are cleared
+	 */
+	FVoxelLeafDiff(uint64 Id);
 
-	FVoxelMaterialDiff(uint64 Id, int Index, FVoxelMaterial Material);
+	FORCEINLINE bool HasValue(int Index) const
+	{
+		return (ValueMask[Index / 32] & (1u << (Index % 32))) != 0;
+	}
+	FORCEINLINE bool HasMaterial(int Index) const
+	{
+		return (MaterialMask[Index / 32] & (1u << (Index % 32))) != 0;
+	}
 };
 
-FORCEINLINE FArchive& operator<<(FArchive &Ar, FVoxelMaterialDiff& MaterialDiff)
-{
-	Ar << MaterialDiff.Id;
-	Ar << MaterialDiff.Index;
-	Ar << MaterialDiff.Material;
+/**
+ * Bit-packed network encoding of a leaf diff: Id delta, run-length coded masks, and run-length coded values and materials
+ * Values are sent in the FVoxelValue storage format: quantized if VOXEL_VALUE_BITS is 16 or 8. Sets the archive error on invalid data
+ * @param	PreviousId	Id of the previous diff of the packet, 0 for the first one. Diffs of a packet are sorted by increasing Id
+ */
+void SerializeVoxelLeafDiff(FArchive& Ar, FVoxelLeafDiff& Diff, uint64 PreviousId);
 
-	return Ar;
-}
 
 UCLASS(Blueprintable, BlueprintType, Category = Voxel)
 class VOXEL_API UVoxelMeshSave : public USaveGame
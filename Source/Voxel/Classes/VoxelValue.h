@@ -0,0 +1,93 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Number of bits used to store the densities of the modified voxels, in leaves, saves and data assets
+ * 32: float. 16 or 8: fixed point in [-1, 1]; values are converted only when read or written
+ */
+#ifndef VOXEL_VALUE_BITS
+#define VOXEL_VALUE_BITS 32
+#endif
+
+/**
+ * Convert a density to a fixed point value. Values are clamped to [-1, 1]
+ * The sign is always kept: non zero values never become 0, as 0 is full and > 0 is empty
+ */
+template<typename T>
+FORCEINLINE T QuantizeVoxelValue(float Value)
+{
+	const float Scaled = FMath::Clamp(Value, -1.f, 1.f) * TNumericLimits<T>::Max();
+	if (Value > 0)
+	{
+		return (T)FMath::Max(FMath::RoundToInt(Scaled), 1);
+	}
+	else if (Value < 0)
+	{
+		return (T)FMath::Min(FMath::RoundToInt(Scaled), -1);
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+template<>
+FORCEINLINE float QuantizeVoxelValue<float>(float Value)
+{
+	return Value;
+}
+
+template<typename T>
+FORCEINLINE float DequantizeVoxelValue(T Value)
+{
+	return Value / (float)TNumericLimits<T>::Max();
+}
+
+template<>
+FORCEINLINE float DequantizeVoxelValue<float>(float Value)
+{
+	return Value;
+}
+
+/**
+ * Stored density of a voxel
+ */
+struct FVoxelValue
+{
+#if VOXEL_VALUE_BITS == 32
+	typedef float StorageType;
+#elif VOXEL_VALUE_BITS == 16
+	typedef int16 StorageType;
+#elif VOXEL_VALUE_BITS == 8
+	typedef int8 StorageType;
+#else
+#error "VOXEL_VALUE_BITS must be 32, 16 or 8"
+#endif
+
+	StorageType Value;
+
+	FVoxelValue()
+		: Value(0)
+	{
+	}
+
+	explicit FVoxelValue(float InValue)
+		: Value(QuantizeVoxelValue<StorageType>(InValue))
+	{
+	}
+
+	FORCEINLINE float ToFloat() const
+	{
+		return DequantizeVoxelValue<StorageType>(Value);
+	}
+};
+
+FORCEINLINE FArchive& operator<<(FArchive &Ar, FVoxelValue& Value)
+{
+	Ar << Value.Value;
+
+	return Ar;
+}
@@ -10,6 +10,7 @@
 #include "VoxelBox.h"
 #include "VoxelFoliage/VoxelGrassType.h"
 #include "VoxelNetworking.h"
+#include "Async/Future.h"
 #include "VoxelWorld.generated.h"
 
 using namespace UP;
@@ -19,8 +20,14 @@ using namespace UC;
 
 class FVoxelRender;
 class FVoxelData;
+class FVoxelSaveJournal;
+class FVoxelEditLog;
+struct FVoxelToolOperation;
 class UVoxelInvokerComponent;
 
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnVoxelWorldSaved, const FVoxelWorldSave&, Save);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE(FOnVoxelWorldLoaded);
+
 /**
  * Voxel World actor class
  */
@@ -213,6 +220,43 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Voxel")
 		void LoadFromSave(FVoxelWorldSave& Save, bool bReset = true);
 
+	/**
+	 * Create a save on a worker thread. OnSaveCompleted is broadcast once done
+	 * @return	false if a save is already running
+	 */
+	UFUNCTION(BlueprintCallable, Category = "Voxel")
+		bool GetSaveAsync();
+
+	/**
+	 * Decompress and load a save on a worker thread. The chunks are updated and OnLoadCompleted is broadcast once done
+	 * @param	Save	Save to load from. Copied
+	 * @param	bReset	Reset existing world? Set to false only if current world is unmodified. The reset is done immediately, on the game thread
+	 * @return	false if a load is already running or if the save is invalid
+	 */
+	UFUNCTION(BlueprintCallable, Category = "Voxel")
+		bool LoadFromSaveAsync(const FVoxelWorldSave& Save, bool bReset = true);
+
+	UPROPERTY(BlueprintAssignable, Category = "Voxel")
+		FOnVoxelWorldSaved OnSaveCompleted;
+
+	UPROPERTY(BlueprintAssignable, Category = "Voxel")
+		FOnVoxelWorldLoaded OnLoadCompleted;
+
+	/**
+	 * Load the chunks of the save overlapping Box. Only they are decompressed: faster than LoadFromSave for large saves
+	 * @param	Save	Save to load from
+	 * @param	Box		Box in voxel space
+	 */
+	UFUNCTION(BlueprintCallable, Category = "Voxel")
+		void LoadBoxFromSave(FVoxelWorldSave& Save, const FVoxelBox& Box);
+
+	/**
+	 * Append the chunks modified since the last call to the save journal, and compact it if needed, on a worker thread. Much cheaper than GetSave on large worlds
+	 * @return	false if the journal is disabled or a journal save is already running
+	 */
+	UFUNCTION(BlueprintCallable, Category = "Voxel")
+		bool SaveToJournal();
+
 
 	UFUNCTION(BlueprintCallable, Category = "Voxel")
 		void StartServer(const FString& Ip, const int32 Port);
@@ -220,6 +264,13 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "Voxel")
 		void ConnectClient(const FString& Ip, const int32 Port);
 
+	/**
+	 * Apply a tool edit and update the chunks it modifies. On a multiplayer server with clients, the operation is sent instead of the voxels it edits
+	 * @param	Operation	Edit in voxel space
+	 * @param	bAsync		Async chunks update?
+	 */
+	void ApplyToolOperation(const FVoxelToolOperation& Operation, bool bAsync);
+
 
 protected:
 	// Called when the game starts or when spawned
@@ -311,6 +362,28 @@ private:
 		TArray<float> LODScreenSize;
 
 
+	// Page the modified voxels not used for PagingIdleTime to a file in Saved/VoxelPages, to support large edited areas. They are read back when used
+	UPROPERTY(EditAnywhere, Category = "Paging")
+		bool bEnablePaging;
+
+	// In seconds
+	UPROPERTY(EditAnywhere, Category = "Paging", meta = (ClampMin = "1", UIMin = "1", EditCondition = "bEnablePaging"))
+		float PagingIdleTime;
+
+
+	// Save the modified chunks incrementally to SaveJournalFilename, and load it when creating the world
+	UPROPERTY(EditAnywhere, Category = "Save Journal")
+		bool bEnableSaveJournal;
+
+	// Relative to the Saved directory
+	UPROPERTY(EditAnywhere, Category = "Save Journal", meta = (EditCondition = "bEnableSaveJournal"))
+		FString SaveJournalFilename;
+
+	// In seconds. 0 to only save with SaveToJournal
+	UPROPERTY(EditAnywhere, Category = "Save Journal", meta = (ClampMin = "0", UIMin = "0", EditCondition = "bEnableSaveJournal"))
+		float SaveJournalInterval;
+
+
 	UPROPERTY(EditAnywhere, Category = "Multiplayer")
 		bool bMultiplayer;
 
@@ -327,6 +400,17 @@ private:
 
 	TSharedPtr<FVoxelData> Data;
 	TSharedPtr<FVoxelRender> Render;
+	TSharedPtr<FVoxelSaveJournal> SaveJournal;
+	// Edits to send at next sync, when server
+	TSharedPtr<FVoxelEditLog> EditLog;
+
+	// Running GetSaveAsync/LoadFromSaveAsync, polled in Tick
+	TFuture<TSharedPtr<FVoxelWorldSave, ESPMode::ThreadSafe>> SaveFuture;
+	TFuture<TSharedPtr<std::forward_list<FVoxelBox>, ESPMode::ThreadSafe>> LoadFuture;
+	// Running pass on the idle leaves, polled in Tick
+	TFuture<void> IdleLeavesFuture;
+	// Running SaveToJournal, polled in Tick. SaveJournal is only used by it while valid
+	TFuture<bool> JournalFuture;
 
 	bool bIsCreated;
 
@@ -339,9 +423,23 @@ private:
 	bool bCastShadowAsTwoSided;
 
 	float TimeSinceSync;
+	float TimeSincePaging;
+	float TimeSinceSharing;
+	float TimeSinceJournalSave;
 
 	void CreateWorld();
 	void DestroyWorld();
 
+	/**
+	 * Wait for the async save, load, idle leaves pass and journal save, without broadcasting their completion
+	 */
+	void WaitForAsyncTasks();
+
+	/**
+	 * Append the modified chunks to Journal and compact it if needed. Any thread
+	 * @return	false if the write failed
+	 */
+	static bool WriteToJournal(FVoxelData& VoxelData, FVoxelSaveJournal& Journal);
+
 	void Sync();
 };
@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "VoxelMaterial.h"
+#include "VoxelBox.h"
 #include "VoxelWorldGenerator.generated.h"
 
 class AVoxelWorld;
@@ -79,6 +80,16 @@ public:
 		}
 	}
 
+	/**
+	 * Conservative bounds of the values in Box: all the values must be in [OutMin, OutMax]. Used to skip chunks without surface
+	 * @param	Box		Box in voxel space
+	 * @return	false if the bounds are unknown
+	 */
+	virtual bool GetValueRange(const FVoxelBox& Box, float& OutMin, float& OutMax) const
+	{
+		return false;
+	}
+
 	/**
 	 * If you need a reference to Voxel World
 	 */
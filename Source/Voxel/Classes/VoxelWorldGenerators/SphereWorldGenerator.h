@@ -19,6 +19,7 @@ public:
 	USphereWorldGenerator();
 
 	virtual void GetValuesAndMaterials(float Values[], FVoxelMaterial Materials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const override;
+	virtual bool GetValueRange(const FVoxelBox& Box, float& OutMin, float& OutMax) const override;
 
 	virtual void SetVoxelWorld(AVoxelWorld* VoxelWorld) override;
 	virtual FVector GetUpVector(int X, int Y, int Z) const override;
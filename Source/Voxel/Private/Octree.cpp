@@ -5,7 +5,7 @@
 FOctree::FOctree(FIntVector Position, uint8 Depth, uint64 Id /*= -1*/) : Position(Position), Depth(Depth), Id(Id), bHasChilds(false)
 {
 	// Max for Id
-	check(Depth <= 19);
+	check(Depth <= MaxDepth);
 }
 
 bool FOctree::operator==(const FOctree& Other) const
@@ -67,33 +67,61 @@ void FOctree::GlobalToLocal(int X, int Y, int Z, int& OutX, int& OutY, int& OutZ
 
 uint64 FOctree::GetTopIdFromDepth(int8 Depth)
 {
-	return IntPow9(Depth);
+	check(Depth <= MaxDepth);
+	// The root key is the same whatever the depth: the depth only changes the number of bits of the leaves keys
+	return 1;
 }
 
-void FOctree::GetIDsAt(uint64 ID, uint8 LOD, uint64 IDs[8])
+uint64 FOctree::GetChildId(uint64 ID, int ChildIndex)
 {
-	const uint64 Pow = IntPow9(LOD);
-    IDs[0] = ID+1*Pow;
-    IDs[1] = ID+2*Pow;
-    IDs[2] = ID+3*Pow;
-    IDs[3] = ID+4*Pow;
-    IDs[4] = ID+5*Pow;
-    IDs[5] = ID+6*Pow;
-    IDs[6] = ID+7*Pow;
-    IDs[7] = ID+8*Pow;
+	check(0 <= ChildIndex && ChildIndex < 8);
+	return (ID << 3) | ChildIndex;
 }
 
-void FOctree::GetIDsAt(uint64 ID, uint8 LOD, TArray<uint64>& IDs)
+bool FOctree::IsInSubtree(uint64 ID, uint64 DescendantID, int Levels)
 {
-	const uint64 Pow = IntPow9(LOD);
-    IDs.Emplace(ID+1*Pow);
-    IDs.Emplace(ID+2*Pow);
-    IDs.Emplace(ID+3*Pow);
-    IDs.Emplace(ID+4*Pow);
-    IDs.Emplace(ID+5*Pow);
-    IDs.Emplace(ID+6*Pow);
-    IDs.Emplace(ID+7*Pow);
-    IDs.Emplace(ID+8*Pow);
+	check(Levels >= 0);
+	return (DescendantID >> (3 * Levels)) == ID;
+}
+
+void FOctree::GetLeafIdsRange(uint64 ID, uint8 Depth, uint64& OutFirst, uint64& OutEnd)
+{
+	OutFirst = ID << (3 * Depth);
+	OutEnd = (ID + 1) << (3 * Depth);
+}
+
+FIntVector FOctree::GetLeafMinimalCornerFromId(uint64 ID, uint8 WorldDepth)
+{
+	check((ID >> (3 * WorldDepth)) == GetTopIdFromDepth(WorldDepth));
+
+	const int HalfWorldSize = (16 << WorldDepth) / 2;
+	FIntVector Min(-HalfWorldSize, -HalfWorldSize, -HalfWorldSize);
+	for (int Level = WorldDepth - 1; Level >= 0; Level--)
+	{
+		// Child of a node of depth Level + 1
+		const int ChildIndex = (ID >> (3 * Level)) & 7;
+		const int ChildSize = 16 << Level;
+		Min.X += (ChildIndex & 1) ? ChildSize : 0;
+		Min.Y += (ChildIndex & 2) ? ChildSize : 0;
+		Min.Z += (ChildIndex & 4) ? ChildSize : 0;
+	}
+	return Min;
+}
+
+void FOctree::GetIDsAt(uint64 ID, uint64 IDs[8])
+{
+	for (int ChildIndex = 0; ChildIndex < 8; ChildIndex++)
+	{
+		IDs[ChildIndex] = GetChildId(ID, ChildIndex);
+	}
+}
+
+void FOctree::GetIDsAt(uint64 ID, TArray<uint64>& IDs)
+{
+	for (int ChildIndex = 0; ChildIndex < 8; ChildIndex++)
+	{
+		IDs.Emplace(GetChildId(ID, ChildIndex));
+	}
 }
 
 void FOctree::GetIDsAt(uint64 ID, uint8 Depth, uint8 EndDepth, TArray<uint64>& OutIDs)
@@ -106,13 +134,13 @@ void FOctree::GetIDsAt(uint64 ID, uint8 Depth, uint8 EndDepth, TArray<uint64>& O
         if (LOD == EndDepth)
         {
             // At the specified depth, write result ids
-            GetIDsAt(ID, LOD, OutIDs);
+            GetIDsAt(ID, OutIDs);
         }
         else
         {
             // Get child ids
             uint64 IDs[8];
-            FOctree::GetIDsAt(ID, LOD, IDs);
+            FOctree::GetIDsAt(ID, IDs);
             // Recursively gather ids
             GetIDsAt(IDs[0], LOD, EndDepth, OutIDs);
             GetIDsAt(IDs[1], LOD, EndDepth, OutIDs);
@@ -3,17 +3,6 @@
 #pragma once
 #include "CoreMinimal.h"
 
-FORCEINLINE uint64 IntPow9(int Power)
-{
-	check(Power <= 19);
-	uint64 Pow = 1;
-	for (int i = 0; i < Power; i++)
-	{
-		Pow *= 9;
-	}
-	return Pow;
-}
-
 /**
  * Base Octree class
  */
@@ -39,9 +28,12 @@ public:
 	// Distance to the highest resolution
 	const uint8 Depth;
 
-	// Id of the Octree (position in the octree)
+	// Id of the Octree (position in the octree): Morton key. 1 for the root, then 3 bits per level: (ParentId << 3) | ChildIndex
 	const uint64 Id;
 
+	// Max depth so that the Ids and their subtree ranges fit in 64 bits
+	static const int MaxDepth = 20;
+
 	/**
 	 * Get the width at this level
 	 * @return	Width of this chunk
@@ -79,8 +71,33 @@ public:
 	FORCEINLINE void GlobalToLocal(int X, int Y, int Z, int& OutX, int& OutY, int& OutZ) const;
 
 	FORCEINLINE static uint64 GetTopIdFromDepth(int8 Depth);
-	FORCEINLINE static void GetIDsAt(uint64 ID, uint8 LOD, uint64 IDs[8]);
-	FORCEINLINE static void GetIDsAt(uint64 ID, uint8 LOD, TArray<uint64>& IDs);
+
+	/**
+	 * Get the Id of a child
+	 * @param	ChildIndex	Octant: bit 0 for +X, bit 1 for +Y, bit 2 for +Z
+	 */
+	FORCEINLINE static uint64 GetChildId(uint64 ID, int ChildIndex);
+
+	/**
+	 * Is DescendantID in the subtree of ID?
+	 * @param	Levels		Depth of ID - depth of DescendantID
+	 */
+	FORCEINLINE static bool IsInSubtree(uint64 ID, uint64 DescendantID, int Levels);
+
+	/**
+	 * Get the Ids of the depth 0 nodes of the subtree of ID: they are the Ids in [OutFirst, OutEnd)
+	 * @param	Depth	Depth of ID
+	 */
+	FORCEINLINE static void GetLeafIdsRange(uint64 ID, uint8 Depth, uint64& OutFirst, uint64& OutEnd);
+
+	/**
+	 * Get the minimal corner of a depth 0 node from its Id
+	 * @param	WorldDepth	Depth of the root
+	 */
+	static FIntVector GetLeafMinimalCornerFromId(uint64 ID, uint8 WorldDepth);
+
+	FORCEINLINE static void GetIDsAt(uint64 ID, uint64 IDs[8]);
+	FORCEINLINE static void GetIDsAt(uint64 ID, TArray<uint64>& IDs);
 	static void GetIDsAt(uint64 ID, uint8 Depth, uint8 EndDepth, TArray<uint64>& OutIDs);
 
 protected:
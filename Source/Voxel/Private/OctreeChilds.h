@@ -0,0 +1,159 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Pool of blocks of 8 octree nodes, so that the 8 childs of a node are one allocation and are contiguous in memory.
+ * Blocks are allocated by slabs and recycled; slabs are freed with the pool.
+ * Not thread safe: the owner of the pool must serialize the calls (eg with a lock per pool)
+ */
+template<typename T>
+class TOctreeBlockPool
+{
+public:
+	TOctreeBlockPool()
+		: NumAllocatedBlocks(0)
+	{
+	}
+
+	TOctreeBlockPool(const TOctreeBlockPool&) = delete;
+	TOctreeBlockPool& operator=(const TOctreeBlockPool&) = delete;
+
+	~TOctreeBlockPool()
+	{
+		// The nodes using this pool must be destroyed before it
+		check(NumAllocatedBlocks == 0);
+		for (FBlock* Slab : Slabs)
+		{
+			FMemory::Free(Slab);
+		}
+	}
+
+	/**
+	 * Get uninitialized memory for 8 nodes
+	 */
+	T* Allocate()
+	{
+		if (FreeBlocks.Num() == 0)
+		{
+			FBlock* Slab = (FBlock*)FMemory::Malloc(BlocksPerSlab * sizeof(FBlock), alignof(FBlock));
+			Slabs.Add(Slab);
+			for (int Index = BlocksPerSlab - 1; Index >= 0; Index--)
+			{
+				FreeBlocks.Add(&Slab[Index]);
+			}
+		}
+
+		FBlock* Block = FreeBlocks.Pop(false);
+		Block->Pool = this;
+		NumAllocatedBlocks++;
+		return (T*)Block->Nodes;
+	}
+
+	/**
+	 * Give back a block to the pool it was allocated from. The nodes must already be destroyed
+	 */
+	static void Free(T* Nodes)
+	{
+		FBlock* Block = (FBlock*)Nodes;
+		TOctreeBlockPool* Pool = Block->Pool;
+		check(Pool && Pool->NumAllocatedBlocks > 0);
+
+		Pool->NumAllocatedBlocks--;
+		Pool->FreeBlocks.Add(Block);
+	}
+
+private:
+	static const int BlocksPerSlab = 64;
+
+	struct FBlock
+	{
+		// Must be first: the nodes pointer is the block pointer
+		TTypeCompatibleBytes<T> Nodes[8];
+		// Pool owning the block, so that childs can be freed without knowing it
+		TOctreeBlockPool* Pool;
+	};
+
+	TArray<FBlock*> Slabs;
+	TArray<FBlock*> FreeBlocks;
+	int NumAllocatedBlocks;
+};
+
+/**
+ * Childs of an octree node: either none or 8, allocated with TOctreeBlockPool
+ * Can be iterated and indexed like an array of pointers
+ */
+template<typename T>
+class TOctreeChilds
+{
+public:
+	TOctreeChilds()
+		: Block(nullptr)
+	{
+	}
+
+	TOctreeChilds(const TOctreeChilds&) = delete;
+	TOctreeChilds& operator=(const TOctreeChilds&) = delete;
+
+	~TOctreeChilds()
+	{
+		Reset();
+	}
+
+	/**
+	 * Allocate the 8 childs. They must then be constructed with placement new
+	 * @param	Pool	Pool to allocate from. Must outlive the childs, and the caller must hold its lock
+	 * @return	First child
+	 */
+	T* Allocate(TOctreeBlockPool<T>& Pool)
+	{
+		check(!Block);
+		Block = Pool.Allocate();
+		return Block;
+	}
+
+	/**
+	 * Destroy the childs, if any, and give their block back to its pool. The caller must hold the pool lock
+	 */
+	void Reset()
+	{
+		if (Block)
+		{
+			for (int Index = 0; Index < 8; Index++)
+			{
+				Block[Index].~T();
+			}
+			TOctreeBlockPool<T>::Free(Block);
+			Block = nullptr;
+		}
+	}
+
+	FORCEINLINE int Num() const
+	{
+		return Block ? 8 : 0;
+	}
+
+	FORCEINLINE T* operator[](int Index) const
+	{
+		check(Block);
+		check(0 <= Index && Index < 8);
+		return &Block[Index];
+	}
+
+	struct FIterator
+	{
+		T* Ptr;
+
+		FORCEINLINE T* operator*() const { return Ptr; }
+		FORCEINLINE FIterator& operator++() { ++Ptr; return *this; }
+		FORCEINLINE bool operator!=(const FIterator& Other) const { return Ptr != Other.Ptr; }
+	};
+
+	FORCEINLINE FIterator begin() const { return FIterator{ Block }; }
+	FORCEINLINE FIterator end() const { return FIterator{ Block ? Block + 8 : nullptr }; }
+
+private:
+	T* Block;
+};
@@ -1,27 +1,80 @@
 // Copyright 2017 Phyronnaz
 
+#include "VoxelPrivate.h"
 #include "VoxelDataAsset.h"
 
+/**
+ * Read values stored with another VOXEL_VALUE_BITS
+ */
+template<typename T>
+void SerializeConvertedValues(FArchive& Ar, TArray<FVoxelValue>& Values)
+{
+	TArray<T> StoredValues;
+	Ar << StoredValues;
+
+	Values.SetNumUninitialized(StoredValues.Num());
+	for (int Index = 0; Index < StoredValues.Num(); Index++)
+	{
+		Values[Index] = FVoxelValue(DequantizeVoxelValue<T>(StoredValues[Index]));
+	}
+}
+
 
 UVoxelDataAsset::UVoxelDataAsset(const FObjectInitializer& ObjectInitializer)
 	: Super(ObjectInitializer)
+	, ValueBits(32)
 {
 };
 
 bool UVoxelDataAsset::GetDecompressedAsset(FDecompressedVoxelAsset*& Asset, const float VoxelSize)
 {
+	if (ValueBits != 32 && ValueBits != 16 && ValueBits != 8)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Invalid VOXEL_VALUE_BITS %d in data asset %s"), ValueBits, *GetName());
+		return false;
+	}
+
 	Asset = new FDecompressedVoxelDataAsset();
 	return Super::GetDecompressedAsset(Asset, VoxelSize);
 }
 
 void UVoxelDataAsset::AddAssetToArchive(FBufferArchive& ToBinary, FDecompressedVoxelAsset* Asset)
 {
+	ValueBits = VOXEL_VALUE_BITS;
 	ToBinary << *((FDecompressedVoxelDataAsset*)Asset);
 }
 
 void UVoxelDataAsset::GetAssetFromArchive(FMemoryReader& FromBinary, FDecompressedVoxelAsset* Asset)
 {
-	FromBinary << *((FDecompressedVoxelDataAsset*)Asset);
+	FDecompressedVoxelDataAsset& DataAsset = *((FDecompressedVoxelDataAsset*)Asset);
+
+	if (ValueBits == VOXEL_VALUE_BITS)
+	{
+		FromBinary << DataAsset;
+		return;
+	}
+
+	// Same layout as operator<<, with the values of the asset build
+	FromBinary << DataAsset.HalfSizeX;
+	FromBinary << DataAsset.HalfSizeY;
+	FromBinary << DataAsset.HalfSizeZ;
+
+	if (ValueBits == 32)
+	{
+		SerializeConvertedValues<float>(FromBinary, DataAsset.Values);
+	}
+	else if (ValueBits == 16)
+	{
+		SerializeConvertedValues<int16>(FromBinary, DataAsset.Values);
+	}
+	else
+	{
+		check(ValueBits == 8);
+		SerializeConvertedValues<int8>(FromBinary, DataAsset.Values);
+	}
+
+	FromBinary << DataAsset.Materials;
+	FromBinary << DataAsset.VoxelTypes;
 }
 
 void FDecompressedVoxelDataAsset::SetHalfSize(int32 NewHalfSizeX, int32 NewHalfSizeY, int32 NewHalfSizeZ)
@@ -42,7 +95,7 @@ float FDecompressedVoxelDataAsset::GetValue(const int X, const int Y, const int
 	check(-HalfSizeX <= X && X < HalfSizeX);
 	check(-HalfSizeY <= Y && Y < HalfSizeY);
 	check(-HalfSizeZ <= Z && Z < HalfSizeZ);
-	return Values[(X + HalfSizeX) + 2 * HalfSizeX * (Y + HalfSizeY) + 2 * HalfSizeX * 2 * HalfSizeY * (Z + HalfSizeZ)];
+	return Values[(X + HalfSizeX) + 2 * HalfSizeX * (Y + HalfSizeY) + 2 * HalfSizeX * 2 * HalfSizeY * (Z + HalfSizeZ)].ToFloat();
 }
 
 FVoxelMaterial FDecompressedVoxelDataAsset::GetMaterial(const int X, const int Y, const int Z)
@@ -76,7 +129,7 @@ void FDecompressedVoxelDataAsset::SetValue(const int X, const int Y, const int Z
 	check(-HalfSizeX <= X && X < HalfSizeX);
 	check(-HalfSizeY <= Y && Y < HalfSizeY);
 	check(-HalfSizeZ <= Z && Z < HalfSizeZ);
-	Values[(X + HalfSizeX) + 2 * HalfSizeX * (Y + HalfSizeY) + 2 * HalfSizeX * 2 * HalfSizeY * (Z + HalfSizeZ)] = NewValue;
+	Values[(X + HalfSizeX) + 2 * HalfSizeX * (Y + HalfSizeY) + 2 * HalfSizeX * 2 * HalfSizeY * (Z + HalfSizeZ)] = FVoxelValue(NewValue);
 }
 
 void FDecompressedVoxelDataAsset::SetMaterial(const int X, const int Y, const int Z, const FVoxelMaterial NewMaterial)
@@ -0,0 +1,410 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelPrivate.h"
+#include "VoxelValue.h"
+#include "VoxelMaterial.h"
+#include "VoxelSave.h"
+#include "VoxelData.h"
+#include "VoxelEditBatch.h"
+#include "VoxelEditLog.h"
+#include "VoxelToolOperation.h"
+#include "FlatWorldGenerator.h"
+#include "HAL/IConsoleManager.h"
+#include "BufferArchive.h"
+#include "MemoryReader.h"
+#include "ArchiveSaveCompressedProxy.h"
+#include "ArchiveLoadCompressedProxy.h"
+#include "FastNoise/FastNoise.h"
+
+/**
+ * Compare a storage type of the densities against float
+ * @param	Values		Densities, by leaves of 16 * 16 * 16 voxels along X
+ * @param	LeafCount	Number of leaves
+ * @param	Name		Name of the storage
+ */
+template<typename T>
+void BenchmarkValueStorage(const TArray<float>& Values, int LeafCount, const TCHAR* Name)
+{
+	const int SizeX = 16 * LeafCount;
+
+	TArray<T> Quantized;
+	Quantized.SetNumUninitialized(Values.Num());
+	for (int Index = 0; Index < Values.Num(); Index++)
+	{
+		Quantized[Index] = QuantizeVoxelValue<T>(Values[Index]);
+	}
+
+	// Save size: same compression as FVoxelWorldSave
+	FBufferArchive ToBinary;
+	ToBinary << Quantized;
+
+	TArray<uint8> Compressed;
+	FArchiveSaveCompressedProxy Compressor = FArchiveSaveCompressedProxy(Compressed, ECompressionFlags::COMPRESS_ZLIB);
+	Compressor << ToBinary;
+	Compressor.Flush();
+
+	// Mesh deviation: position of the surface along the edges crossing it, in voxels
+	int EdgeCount = 0;
+	int SignErrors = 0;
+	double TotalDeviation = 0;
+	float MaxDeviation = 0;
+
+	for (int Z = 0; Z < 16; Z++)
+	{
+		for (int Y = 0; Y < 16; Y++)
+		{
+			for (int X = 0; X < SizeX; X++)
+			{
+				const int Index = X + SizeX * Y + SizeX * 16 * Z;
+				const int Neighbors[3] = {
+					X + 1 < SizeX ? Index + 1 : -1,
+					Y + 1 < 16 ? Index + SizeX : -1,
+					Z + 1 < 16 ? Index + SizeX * 16 : -1
+				};
+
+				for (int Neighbor : Neighbors)
+				{
+					if (Neighbor < 0)
+					{
+						continue;
+					}
+
+					const float A = Values[Index];
+					const float B = Values[Neighbor];
+					const float QA = DequantizeVoxelValue<T>(Quantized[Index]);
+					const float QB = DequantizeVoxelValue<T>(Quantized[Neighbor]);
+
+					if ((A > 0) != (QA > 0) || (B > 0) != (QB > 0))
+					{
+						SignErrors++;
+					}
+					if ((A > 0) != (B > 0) && (QA > 0) != (QB > 0))
+					{
+						const float Deviation = FMath::Abs(A / (A - B) - QA / (QA - QB));
+						TotalDeviation += Deviation;
+						MaxDeviation = FMath::Max(MaxDeviation, Deviation);
+						EdgeCount++;
+					}
+				}
+			}
+		}
+	}
+
+	UE_LOG(LogVoxel, Log, TEXT("%s: dense leaf %d bytes; save %d bytes for %d leaves; surface deviation mean %f max %f voxels over %d edges; %d sign errors"),
+		Name,
+		(int)(16 * 16 * 16 * (sizeof(T) + sizeof(FVoxelMaterial))),
+		Compressed.Num(),
+		LeafCount,
+		EdgeCount > 0 ? (float)(TotalDeviation / EdgeCount) : 0.f,
+		MaxDeviation,
+		EdgeCount,
+		SignErrors);
+}
+
+static FAutoConsoleCommand BenchmarkValueStorageCommand(
+	TEXT("voxel.BenchmarkValueStorage"),
+	TEXT("Compare float, int16 and int8 density storage: memory, save size and surface deviation. Argument: number of leaves (default 64)"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		const int LeafCount = Args.Num() > 0 ? FMath::Max(1, FCString::Atoi(*Args[0])) : 64;
+		const int SizeX = 16 * LeafCount;
+
+		FastNoise Noise;
+
+		// Terrain like densities, clamped to [-1, 1] like the generators
+		TArray<float> Values;
+		Values.SetNumUninitialized(SizeX * 16 * 16);
+		for (int Z = 0; Z < 16; Z++)
+		{
+			for (int Y = 0; Y < 16; Y++)
+			{
+				for (int X = 0; X < SizeX; X++)
+				{
+					const float Height = 8 + 6 * Noise.GetValueFractal(X * 2.f, Y * 2.f);
+					Values[X + SizeX * Y + SizeX * 16 * Z] = FMath::Clamp((Z - Height) / 4, -1.f, 1.f);
+				}
+			}
+		}
+
+		UE_LOG(LogVoxel, Log, TEXT("Value storage benchmark. Current VOXEL_VALUE_BITS: %d"), VOXEL_VALUE_BITS);
+		BenchmarkValueStorage<float>(Values, LeafCount, TEXT("float"));
+		BenchmarkValueStorage<int16>(Values, LeafCount, TEXT("int16"));
+		BenchmarkValueStorage<int8>(Values, LeafCount, TEXT("int8"));
+	})
+);
+
+/**
+ * Log the times of a save compression round trip, and the compressed size
+ */
+static void LogSaveCompressionBenchmark(const TCHAR* Name, double CompressTime, double DecompressTime, int CompressedSize, int UncompressedSize)
+{
+	UE_LOG(LogVoxel, Log, TEXT("%s: compress %fms, decompress %fms, %d bytes (%.1f%% of %d)"),
+		Name,
+		CompressTime * 1000,
+		DecompressTime * 1000,
+		CompressedSize,
+		100.f * CompressedSize / FMath::Max(UncompressedSize, 1),
+		UncompressedSize);
+}
+
+static FAutoConsoleCommand BenchmarkSaveCompressionCommand(
+	TEXT("voxel.BenchmarkSaveCompression"),
+	TEXT("Round trip of world saves: single zlib stream, zlib by chunk and parallel ZSTD by chunk. Argument: number of leaves (default 4096)"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		const int LeafCount = Args.Num() > 0 ? FMath::Max(1, FCString::Atoi(*Args[0])) : 4096;
+
+		FastNoise Noise;
+
+		// Terrain like leaves along X
+		TArray<FVoxelChunkSave> ChunksList;
+		ChunksList.Reserve(LeafCount);
+		float Values[16 * 16 * 16];
+		FVoxelMaterial Materials[16 * 16 * 16];
+		for (int Leaf = 0; Leaf < LeafCount; Leaf++)
+		{
+			for (int Z = 0; Z < 16; Z++)
+			{
+				for (int Y = 0; Y < 16; Y++)
+				{
+					for (int X = 0; X < 16; X++)
+					{
+						const float Height = 8 + 6 * Noise.GetValueFractal((16 * Leaf + X) * 2.f, Y * 2.f);
+						const int Index = X + 16 * Y + 16 * 16 * Z;
+						Values[Index] = FMath::Clamp((Z - Height) / 4, -1.f, 1.f);
+						Materials[Index] = FVoxelMaterial(Z < Height ? 1 : 0, 0, 0);
+					}
+				}
+			}
+			ChunksList.Emplace(Leaf + 1, FIntVector(16 * Leaf, 0, 0), Values, Materials);
+		}
+
+		UE_LOG(LogVoxel, Log, TEXT("Save compression benchmark: %d leaves"), LeafCount);
+
+		// Single zlib stream, as saves before IndexedChunks
+		{
+			double StartTime = FPlatformTime::Seconds();
+
+			FBufferArchive ToBinary;
+			for (auto& Chunk : ChunksList)
+			{
+				SerializeVoxelChunk(ToBinary, Chunk, EVoxelSaveVersion::SharedChunks);
+			}
+			TArray<uint8> Compressed;
+			FArchiveSaveCompressedProxy Compressor = FArchiveSaveCompressedProxy(Compressed, ECompressionFlags::COMPRESS_ZLIB);
+			Compressor << ToBinary;
+			Compressor.Flush();
+
+			const double CompressTime = FPlatformTime::Seconds() - StartTime;
+			StartTime = FPlatformTime::Seconds();
+
+			FArchiveLoadCompressedProxy Decompressor = FArchiveLoadCompressedProxy(Compressed, ECompressionFlags::COMPRESS_ZLIB);
+			FBufferArchive DecompressedBinaryArray;
+			Decompressor << DecompressedBinaryArray;
+			FMemoryReader FromBinary = FMemoryReader(DecompressedBinaryArray);
+			for (int Leaf = 0; Leaf < LeafCount; Leaf++)
+			{
+				FVoxelChunkSave Chunk;
+				SerializeVoxelChunk(FromBinary, Chunk, EVoxelSaveVersion::SharedChunks);
+			}
+
+			const double DecompressTime = FPlatformTime::Seconds() - StartTime;
+			LogSaveCompressionBenchmark(TEXT("zlib stream"), CompressTime, DecompressTime, Compressed.Num(), ToBinary.Num());
+		}
+
+		// zlib by chunk, as IndexedChunks saves
+		{
+			double StartTime = FPlatformTime::Seconds();
+
+			FVoxelWorldSave Save;
+			Save.Version = EVoxelSaveVersion::IndexedChunks;
+			int UncompressedSize = 0;
+			for (auto& Chunk : ChunksList)
+			{
+				FVoxelChunkRecord Record;
+				FVoxelWorldSave::CompressChunk(Chunk, Save.Version, Save.Data, Record);
+				Save.Records.Add(Record);
+				UncompressedSize += Record.UncompressedSize;
+			}
+
+			const double CompressTime = FPlatformTime::Seconds() - StartTime;
+			StartTime = FPlatformTime::Seconds();
+
+			Save.GetChunksList();
+
+			const double DecompressTime = FPlatformTime::Seconds() - StartTime;
+			LogSaveCompressionBenchmark(TEXT("zlib by chunk"), CompressTime, DecompressTime, Save.Data.Num(), UncompressedSize);
+		}
+
+		// Current path
+		{
+			double StartTime = FPlatformTime::Seconds();
+
+			FVoxelWorldSave Save;
+			Save.Init(0, ChunksList);
+
+			const double CompressTime = FPlatformTime::Seconds() - StartTime;
+			StartTime = FPlatformTime::Seconds();
+
+			TArray<FVoxelChunkSave> LoadedChunks = Save.GetChunksList();
+
+			const double DecompressTime = FPlatformTime::Seconds() - StartTime;
+
+			int UncompressedSize = 0;
+			for (auto& Record : Save.Records)
+			{
+				UncompressedSize += Record.UncompressedSize;
+			}
+			LogSaveCompressionBenchmark(TEXT("parallel ZSTD by chunk"), CompressTime, DecompressTime, Save.Data.Num(), UncompressedSize);
+
+			// Round trip check
+			bool bIdentical = LoadedChunks.Num() == ChunksList.Num();
+			for (int Index = 0; bIdentical && Index < ChunksList.Num(); Index++)
+			{
+				const FVoxelChunkSave& Chunk = ChunksList[Index];
+				const FVoxelChunkSave& LoadedChunk = LoadedChunks[Index];
+				bIdentical = LoadedChunk.Id == Chunk.Id
+					&& FMemory::Memcmp(LoadedChunk.Values.GetData(), Chunk.Values.GetData(), Chunk.Values.Num() * sizeof(FVoxelValue)) == 0
+					&& FMemory::Memcmp(LoadedChunk.Materials.GetData(), Chunk.Materials.GetData(), Chunk.Materials.Num() * sizeof(FVoxelMaterial)) == 0;
+			}
+			if (!bIdentical)
+			{
+				UE_LOG(LogVoxel, Error, TEXT("parallel ZSTD by chunk: round trip doesn't match"));
+			}
+		}
+	})
+);
+
+/**
+ * Count the voxels of B different from A
+ * @return	Number of different values, and of different materials
+ */
+static void CompareVoxelData(FVoxelData* A, FVoxelData* B, int& OutValueErrors, int& OutMaterialErrors)
+{
+	OutValueErrors = 0;
+	OutMaterialErrors = 0;
+
+	const FIntVector Min = A->GetMinimalCornerPosition();
+	const FIntVector Max = A->GetMaximalCornerPosition();
+
+	A->BeginGet();
+	B->BeginGet();
+	for (int X = Min.X; X < Max.X; X++)
+	{
+		for (int Y = Min.Y; Y < Max.Y; Y++)
+		{
+			for (int Z = Min.Z; Z < Max.Z; Z++)
+			{
+				if (A->GetValue(X, Y, Z) != B->GetValue(X, Y, Z))
+				{
+					OutValueErrors++;
+				}
+				if (!(A->GetMaterial(X, Y, Z) == B->GetMaterial(X, Y, Z)))
+				{
+					OutMaterialErrors++;
+				}
+			}
+		}
+	}
+	B->EndGet();
+	A->EndGet();
+}
+
+static FAutoConsoleCommand TestEditReplicationCommand(
+	TEXT("voxel.TestEditReplication"),
+	TEXT("Replay random tool operations and raw edits of a server on a client through the edit log, and compare the two worlds. Argument: number of syncs (default 20)"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		const int SyncCount = Args.Num() > 0 ? FMath::Max(1, FCString::Atoi(*Args[0])) : 20;
+		const int Depth = 3;
+
+		UVoxelWorldGenerator* WorldGenerator = NewObject<UFlatWorldGenerator>();
+		FVoxelData Server(Depth, WorldGenerator, true);
+		FVoxelData Client(Depth, WorldGenerator, true);
+		FVoxelEditLog EditLog;
+
+		const FIntVector Min = Server.GetMinimalCornerPosition();
+		const FIntVector Max = Server.GetMaximalCornerPosition() - FIntVector(1, 1, 1);
+		FRandomStream Random(1337);
+		auto RandomPosition = [&]() { return FIntVector(Random.RandRange(Min.X, Max.X), Random.RandRange(Min.Y, Max.Y), Random.RandRange(Min.Z / 4, Max.Z / 4)); };
+
+		int64 SentBytes = 0;
+		int OperationCount = 0;
+		int RawEditCount = 0;
+
+		for (int Sync = 0; Sync < SyncCount; Sync++)
+		{
+			for (int Edit = 0; Edit < 8; Edit++)
+			{
+				if (Random.FRand() < 0.25f)
+				{
+					// Non deterministic edit: sent as diffs
+					const FIntVector Position = RandomPosition();
+					FVoxelEditBatch Batch(&Server);
+					for (int i = 0; i < 64; i++)
+					{
+						const FIntVector Offset(Random.RandRange(-4, 4), Random.RandRange(-4, 4), Random.RandRange(-4, 4));
+						const FIntVector P = Position + Offset;
+						if (Server.IsInWorld(P.X, P.Y, P.Z))
+						{
+							Batch.SetValueAndMaterial(P.X, P.Y, P.Z, Random.FRandRange(-1, 1), FVoxelMaterial(Random.RandRange(0, 7), Random.RandRange(0, 7), Random.RandRange(0, 255)));
+						}
+					}
+					TArray<FVoxelBox> ModifiedBoxes;
+					Batch.Apply(ModifiedBoxes);
+					RawEditCount++;
+				}
+				else
+				{
+					const FIntVector Position = RandomPosition();
+					const float Radius = Random.FRandRange(2, 12);
+					FVoxelToolOperation Operation;
+					switch (Random.RandRange(0, 2))
+					{
+					case 0:
+						Operation = FVoxelToolOperation::ValueSphere(Position, Radius, Random.FRand() < 0.5f, Random.FRandRange(0.5f, 1));
+						break;
+					case 1:
+						Operation = FVoxelToolOperation::Crater(Position, Radius, Random.FRandRange(0, 4), Random.FRandRange(0.5f, 1));
+						break;
+					default:
+						Operation = FVoxelToolOperation::MaterialSphere(Position, Radius, Random.RandRange(0, 7), Random.FRand() < 0.5f, Random.FRandRange(1, 4));
+						break;
+					}
+					EditLog.ApplyAndLogOperation(&Server, Operation);
+					OperationCount++;
+				}
+			}
+
+			// Small messages: the log is split
+			TArray<TArray<uint8>> Messages;
+			EditLog.Flush(&Server, Messages, 64 * 1024);
+
+			for (auto& Message : Messages)
+			{
+				SentBytes += Message.Num();
+
+				FMemoryReader FromBinary(Message);
+				std::forward_list<FVoxelBox> ModifiedBoxes;
+				if (!FVoxelEditLog::Replay(&Client, FromBinary, ModifiedBoxes))
+				{
+					UE_LOG(LogVoxel, Error, TEXT("Edit replication: sync %d failed to replay"), Sync);
+				}
+			}
+		}
+
+		int ValueErrors;
+		int MaterialErrors;
+		CompareVoxelData(&Server, &Client, ValueErrors, MaterialErrors);
+
+		UE_LOG(LogVoxel, Log, TEXT("Edit replication: %d operations and %d raw edits over %d syncs, %lld bytes sent"), OperationCount, RawEditCount, SyncCount, SentBytes);
+		if (ValueErrors > 0 || MaterialErrors > 0)
+		{
+			UE_LOG(LogVoxel, Error, TEXT("Edit replication: client differs from server: %d values, %d materials"), ValueErrors, MaterialErrors);
+		}
+		else
+		{
+			UE_LOG(LogVoxel, Log, TEXT("Edit replication: client matches server"));
+		}
+	})
+);
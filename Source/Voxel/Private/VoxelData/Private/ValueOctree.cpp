@@ -1,11 +1,47 @@
+#include "VoxelPrivate.h"
 #include "ValueOctree.h"
 #include "VoxelWorldGenerator.h"
+#include "VoxelDataSnapshot.h"
+#include "VoxelLeafPager.h"
+
+FORCEINLINE uint64 GetSortId(const FVoxelChunkSave* Chunk) { return Chunk->Id; }
+FORCEINLINE uint64 GetSortId(const FVoxelLeafDiff& Diff) { return Diff.Id; }
+
+/**
+ * Binary search in Items sorted by increasing Id
+ * @return	First index in [Begin, End) with an Id >= Id, End if none
+ */
+template<typename T>
+FORCEINLINE int LowerBoundById(const TArray<T>& Items, int Begin, int End, uint64 Id)
+{
+	while (Begin < End)
+	{
+		const int Middle = Begin + (End - Begin) / 2;
+		if (GetSortId(Items[Middle]) < Id)
+		{
+			Begin = Middle + 1;
+		}
+		else
+		{
+			End = Middle;
+		}
+	}
+	return Begin;
+}
 
-FValueOctree::FValueOctree(UVoxelWorldGenerator* WorldGenerator, FIntVector Position, uint8 Depth, uint64 Id, bool bMultiplayer)
+FValueOctree::FValueOctree(UVoxelWorldGenerator* WorldGenerator, FIntVector Position, uint8 Depth, uint64 Id, bool bMultiplayer, FVoxelLeafPager* Pager, TOctreeBlockPool<FValueOctree>* BlockPool)
 	: FOctree(Position, Depth, Id)
 	, WorldGenerator(WorldGenerator)
 	, bIsDirty(false)
-	, bIsNetworkDirty(false)
+	, bDataModified(false)
+	, bEdited(false)
+	, LastEditTime(0)
+	, bMipOutdated(false)
+	, Pager(Pager)
+	, BlockPool(BlockPool)
+	, bPagedOut(0)
+	, LastAccessTime(0)
+	, NetworkData(nullptr)
 	, bMultiplayer(bMultiplayer)
 {
 
@@ -13,12 +49,11 @@ FValueOctree::FValueOctree(UVoxelWorldGenerator* WorldGenerator, FIntVector Posi
 
 FValueOctree::~FValueOctree()
 {
-	if (bHasChilds)
+	// Childs are destroyed by TOctreeChilds
+	delete NetworkData;
+	if (bPagedOut)
 	{
-		for (auto Child : Childs)
-		{
-			delete Child;
-		}
+		Pager->Free(this);
 	}
 }
 
@@ -41,40 +76,20 @@ void FValueOctree::GetValuesAndMaterials(float InValues[], FVoxelMaterial InMate
 	{
 		if (UNLIKELY(IsDirty()))
 		{
-			for (int I = 0; I < Size.X; I++)
+			const FVoxelLeafData& LeafData = *GetDataForRead();
+			if (!LeafData.IsDense())
 			{
-				for (int J = 0; J < Size.Y; J++)
-				{
-					for (int K = 0; K < Size.Z; K++)
-					{
-						const int X = Start.X + I * Step;
-						const int Y = Start.Y + J * Step;
-						const int Z = Start.Z + K * Step;
-
-						int LocalX, LocalY, LocalZ;
-						GlobalToLocal(X, Y, Z, LocalX, LocalY, LocalZ);
-
-						const int LocalIndex = IndexFromCoordinates(LocalX, LocalY, LocalZ);
-						const int Index = (StartIndex.X + I) + ArraySize.X * (StartIndex.Y + J) + ArraySize.X * ArraySize.Y * (StartIndex.Z + K);
-
-						if (InValues)
-						{
-							InValues[Index] = Values[LocalIndex];
-						}
-						if (InMaterials)
-						{
-							InMaterials[Index] = Materials[LocalIndex];
-						}
-					}
-				}
+				// Not modified voxels
+				WorldGenerator->GetValuesAndMaterials(InValues, InMaterials, Start, StartIndex, Step, Size, ArraySize);
 			}
+			LeafData.GetValuesAndMaterials(GetMinimalCornerPosition(), InValues, InMaterials, Start, StartIndex, Step, Size, ArraySize);
 		}
 		else
 		{
 			WorldGenerator->GetValuesAndMaterials(InValues, InMaterials, Start, StartIndex, Step, Size, ArraySize);
 		}
 	}
-	else if (Size.X == 1 && Size.Y == 1 && Size.Z == 1 && false)
+	else if (Size.X == 1 && Size.Y == 1 && Size.Z == 1)
 	{
 		GetChild(Start.X, Start.Y, Start.Z)->GetValuesAndMaterials(InValues, InMaterials, Start, StartIndex, Step, Size, ArraySize);
 	}
@@ -364,18 +379,16 @@ void FValueOctree::GetValuesAndMaterials(float InValues[], FVoxelMaterial InMate
 	}
 }
 
-void FValueOctree::SetValueAndMaterial(int X, int Y, int Z, float Value, FVoxelMaterial Material, bool bSetValue, bool bSetMaterial)
+void FValueOctree::SetValueAndMaterial(int X, int Y, int Z, float Value, FVoxelMaterial Material, bool bSetValue, bool bSetMaterial, bool bMarkNetworkDirty)
 {
 	check(IsLeaf());
 	check(IsInOctree(X, Y, Z));
 
-	bIsNetworkDirty = true;
-
 	if (Depth != 0)
 	{
 		CreateChilds();
 		bIsDirty = true;
-		GetChild(X, Y, Z)->SetValueAndMaterial(X, Y, Z, Value, Material, bSetValue, bSetMaterial);
+		GetChild(X, Y, Z)->SetValueAndMaterial(X, Y, Z, Value, Material, bSetValue, bSetMaterial, bMarkNetworkDirty);
 	}
 	else
 	{
@@ -387,20 +400,122 @@ void FValueOctree::SetValueAndMaterial(int X, int Y, int Z, float Value, FVoxelM
 		int LocalX, LocalY, LocalZ;
 		GlobalToLocal(X, Y, Z, LocalX, LocalY, LocalZ);
 
+		FVoxelLeafData& LeafData = GetDataForWrite();
+
 		int Index = IndexFromCoordinates(LocalX, LocalY, LocalZ);
 		if (bSetValue)
 		{
-			Values[Index] = Value;
+			LeafData.SetValue(Index, Value);
 		}
 		if (bSetMaterial)
 		{
-			Materials[Index] = Material;
+			LeafData.SetMaterial(Index, Material);
+		}
+		MakeDenseIfNeeded(LeafData);
+
+		if (bMultiplayer && bMarkNetworkDirty)
+		{
+			if (!NetworkData)
+			{
+				NetworkData = new FVoxelLeafNetworkData();
+			}
+			if (bSetValue)
+			{
+				NetworkData->AddValue(Index);
+			}
+			if (bSetMaterial)
+			{
+				NetworkData->AddMaterial(Index);
+			}
 		}
 
 	}
 }
 
-void FValueOctree::AddDirtyChunksToSaveList(std::list<TSharedRef<FVoxelChunkSave>>& SaveList)
+void FValueOctree::SetValuesAndMaterials(const TArray<FVoxelLeafEdit>& Edits, bool bMarkNetworkDirty)
+{
+	check(Depth == 0);
+
+	if (!IsDirty())
+	{
+		SetAsDirty();
+	}
+
+	FVoxelLeafData& LeafData = GetDataForWrite();
+
+	if (!LeafData.IsDense())
+	{
+		int NewSparseCount = 0;
+		for (auto& Edit : Edits)
+		{
+			NewSparseCount += Edit.bSetValue + Edit.bSetMaterial;
+		}
+		if (LeafData.GetSparseCount() + NewSparseCount > FVoxelLeafData::MaxSparseCount)
+		{
+			// Avoid inserting in the sparse arrays just to make them dense afterwards
+			LeafData.MakeDense(WorldGenerator, GetMinimalCornerPosition());
+		}
+	}
+
+	for (auto& Edit : Edits)
+	{
+		if (Edit.bSetValue)
+		{
+			LeafData.SetValue(Edit.Index, Edit.Value);
+		}
+		if (Edit.bSetMaterial)
+		{
+			LeafData.SetMaterial(Edit.Index, Edit.Material);
+		}
+	}
+	MakeDenseIfNeeded(LeafData);
+
+	if (bMultiplayer && bMarkNetworkDirty)
+	{
+		if (!NetworkData)
+		{
+			NetworkData = new FVoxelLeafNetworkData();
+		}
+		for (auto& Edit : Edits)
+		{
+			if (Edit.bSetValue)
+			{
+				NetworkData->AddValue(Edit.Index);
+			}
+			if (Edit.bSetMaterial)
+			{
+				NetworkData->AddMaterial(Edit.Index);
+			}
+		}
+	}
+}
+
+void FValueOctree::GetValueAndMaterial(int X, int Y, int Z, float* OutValue, FVoxelMaterial* OutMaterial) const
+{
+	check(IsLeaf());
+	check(IsInOctree(X, Y, Z));
+
+	int LocalIndex = -1;
+	const FVoxelLeafData* LeafData = nullptr;
+	if (IsDirty())
+	{
+		int LocalX, LocalY, LocalZ;
+		GlobalToLocal(X, Y, Z, LocalX, LocalY, LocalZ);
+		LocalIndex = IndexFromCoordinates(LocalX, LocalY, LocalZ);
+		LeafData = GetDataForRead().Get();
+	}
+
+	if (OutValue)
+	{
+		*OutValue = LocalIndex >= 0 && LeafData->HasValue(LocalIndex) ? LeafData->GetValue(LocalIndex) : WorldGenerator->GetValue(X, Y, Z);
+	}
+	if (OutMaterial)
+	{
+		*OutMaterial = LocalIndex >= 0 && LeafData->HasMaterial(LocalIndex) ? LeafData->GetMaterial(LocalIndex) : WorldGenerator->GetMaterial(X, Y, Z);
+	}
+}
+
+void FValueOctree::AddDirtyChunksToSaveList(TArray<FVoxelChunkSave>& SaveList, TMap<const FVoxelLeafData*, uint64>& SavedDatas)
 {
 	check(!IsLeaf() == (Childs.Num() == 8));
 	check(!(IsDirty() && IsLeaf() && Depth != 0));
@@ -409,167 +524,329 @@ void FValueOctree::AddDirtyChunksToSaveList(std::list<TSharedRef<FVoxelChunkSave
 	{
 		if (IsLeaf())
 		{
-			auto SaveStruct = TSharedRef<FVoxelChunkSave>(new FVoxelChunkSave(Id, Position, Values, Materials));
-			SaveList.push_back(SaveStruct);
+			GetDataForRead();
+
+			// Sparse datas depend on the leaf position through the world generator
+			if (Data->IsDense())
+			{
+				if (const uint64* SourceId = SavedDatas.Find(Data.Get()))
+				{
+					SaveList.Emplace(Id, *SourceId);
+					return;
+				}
+				SavedDatas.Add(Data.Get(), Id);
+			}
+
+			SaveList.Add(CreateChunkSave(true));
 		}
 		else
 		{
 			for (auto Child : Childs)
 			{
-				Child->AddDirtyChunksToSaveList(SaveList);
+				Child->AddDirtyChunksToSaveList(SaveList, SavedDatas);
 			}
 		}
 	}
 }
 
-void FValueOctree::LoadFromSaveAndGetModifiedPositions(std::list<FVoxelChunkSave>& Save, std::forward_list<FIntVector>& OutModifiedPositions)
+FVoxelChunkSave FValueOctree::CreateChunkSave(bool bAllowResidual)
+{
+	check(IsLeaf() && IsDirty() && Depth == 0);
+
+	GetDataForRead();
+
+	if (bAllowResidual && !Data->IsDense())
+	{
+		// The voxels not stored are the generator ones
+		uint32 ValueMask[128];
+		uint32 MaterialMask[128];
+		TArray<FVoxelValue> SparseValues;
+		TArray<FVoxelMaterial> SparseMaterials;
+		Data->GetSparseVoxels(ValueMask, MaterialMask, SparseValues, SparseMaterials);
+
+		return FVoxelChunkSave(Id, ValueMask, MaterialMask, MoveTemp(SparseValues), MoveTemp(SparseMaterials));
+	}
+
+	float SaveValues[16 * 16 * 16];
+	FVoxelMaterial SaveMaterials[16 * 16 * 16];
+	GetValuesAndMaterials(SaveValues, SaveMaterials, GetMinimalCornerPosition(), FIntVector::ZeroValue, 1, FIntVector(16, 16, 16), FIntVector(16, 16, 16));
+
+	return FVoxelChunkSave(Id, Position, SaveValues, SaveMaterials);
+}
+
+void FValueOctree::LoadFromSaveAndGetModifiedBoxes(const TArray<const FVoxelChunkSave*>& Chunks, int Begin, int End, std::forward_list<FVoxelBox>& OutModifiedBoxes)
 {
-	if (Save.empty())
+	if (Begin == End)
 	{
 		return;
 	}
 
 	if (Depth == 0)
 	{
-		if (Save.front().Id == Id)
+		for (int ChunkIndex = Begin; ChunkIndex < End; ChunkIndex++)
 		{
-			bIsDirty = true;
-			for (int X = 0; X < 16; X++)
+			const FVoxelChunkSave& Chunk = *Chunks[ChunkIndex];
+			check(Chunk.Id == Id);
+
+			if (!Chunk.HasValidCounts())
+			{
+				UE_LOG(LogVoxel, Error, TEXT("LoadFromSave: Invalid chunk %llu: %d values and %d materials don't match its voxels. Skipping it"), Id, Chunk.Values.Num(), Chunk.Materials.Num());
+				continue;
+			}
+
+			if (!IsDirty())
 			{
-				for (int Y = 0; Y < 16; Y++)
+				SetAsDirty();
+			}
+			FVoxelLeafData& LeafData = GetDataForWrite();
+
+			FIntVector ChangedMin(16, 16, 16);
+			FIntVector ChangedMax(-1, -1, -1);
+
+			if (Chunk.bResidual && !LeafData.IsDense() && LeafData.GetSparseCount() == 0 && Chunk.Values.Num() + Chunk.Materials.Num() <= FVoxelLeafData::MaxSparseCount)
+			{
+				// Unmodified leaf: the voxels not in the chunk are already the generator ones, and the leaf stays sparse
+				int ValueRank = 0;
+				int MaterialRank = 0;
+				for (int Index = 0; Index < 16 * 16 * 16; Index++)
 				{
-					for (int Z = 0; Z < 16; Z++)
+					const bool bHasValue = Chunk.HasValue(Index);
+					const bool bHasMaterial = Chunk.HasMaterial(Index);
+					if (bHasValue)
+					{
+						LeafData.SetValue(Index, Chunk.Values[ValueRank++].ToFloat());
+					}
+					if (bHasMaterial)
+					{
+						LeafData.SetMaterial(Index, Chunk.Materials[MaterialRank++]);
+					}
+					if (bHasValue || bHasMaterial)
 					{
-						const int Index = X + 16 * Y + 16 * 16 * Z;
-						Values[Index] = Save.front().Values[Index];
-						Materials[Index] = Save.front().Materials[Index];
+						int X, Y, Z;
+						CoordinatesFromIndex(Index, X, Y, Z);
+						ChangedMin = FIntVector(FMath::Min(ChangedMin.X, X), FMath::Min(ChangedMin.Y, Y), FMath::Min(ChangedMin.Z, Z));
+						ChangedMax = FIntVector(FMath::Max(ChangedMax.X, X), FMath::Max(ChangedMax.Y, Y), FMath::Max(ChangedMax.Z, Z));
 					}
 				}
+
+				if (ChangedMin.X <= ChangedMax.X)
+				{
+					OutModifiedBoxes.push_front(FVoxelBox(GetMinimalCornerPosition() + ChangedMin, GetMinimalCornerPosition() + ChangedMax));
+				}
+				continue;
+			}
+
+			// Voxels not stored in a residual chunk are reset to the generator ones
+			float GeneratorValues[16 * 16 * 16];
+			FVoxelMaterial GeneratorMaterials[16 * 16 * 16];
+			if (Chunk.bResidual)
+			{
+				WorldGenerator->GetValuesAndMaterials(GeneratorValues, GeneratorMaterials, GetMinimalCornerPosition(), FIntVector::ZeroValue, 1, FIntVector(16, 16, 16), FIntVector(16, 16, 16));
+			}
+
+			if (!LeafData.IsDense())
+			{
+				// All the voxels are overwritten
+				LeafData.MakeDense(WorldGenerator, GetMinimalCornerPosition());
+			}
+
+			// Only write the voxels that change, so that only the chunks seeing them are updated
+			int ValueRank = 0;
+			int MaterialRank = 0;
+			for (int Index = 0; Index < 16 * 16 * 16; Index++)
+			{
+				const float NewValue = !Chunk.HasValue(Index) ? FVoxelValue(GeneratorValues[Index]).ToFloat() : Chunk.Values[Chunk.bResidual ? ValueRank++ : Index].ToFloat();
+				const FVoxelMaterial NewMaterial = !Chunk.HasMaterial(Index) ? GeneratorMaterials[Index] : Chunk.Materials[Chunk.bResidual ? MaterialRank++ : Index];
+				const bool bValueChanged = LeafData.GetValue(Index) != NewValue;
+				const bool bMaterialChanged = !(LeafData.GetMaterial(Index) == NewMaterial);
+
+				if (bValueChanged)
+				{
+					LeafData.SetValue(Index, NewValue);
+				}
+				if (bMaterialChanged)
+				{
+					LeafData.SetMaterial(Index, NewMaterial);
+				}
+				if (bValueChanged || bMaterialChanged)
+				{
+					int X, Y, Z;
+					CoordinatesFromIndex(Index, X, Y, Z);
+					ChangedMin = FIntVector(FMath::Min(ChangedMin.X, X), FMath::Min(ChangedMin.Y, Y), FMath::Min(ChangedMin.Z, Z));
+					ChangedMax = FIntVector(FMath::Max(ChangedMax.X, X), FMath::Max(ChangedMax.Y, Y), FMath::Max(ChangedMax.Z, Z));
+				}
 			}
-			Save.pop_front();
 
-			// Update neighbors
-			const int S = Size();
-			OutModifiedPositions.push_front(Position - FIntVector(0, 0, 0));
-			OutModifiedPositions.push_front(Position - FIntVector(S, 0, 0));
-			OutModifiedPositions.push_front(Position - FIntVector(0, S, 0));
-			OutModifiedPositions.push_front(Position - FIntVector(S, S, 0));
-			OutModifiedPositions.push_front(Position - FIntVector(0, 0, S));
-			OutModifiedPositions.push_front(Position - FIntVector(S, 0, S));
-			OutModifiedPositions.push_front(Position - FIntVector(0, S, S));
-			OutModifiedPositions.push_front(Position - FIntVector(S, S, S));
+			if (ChangedMin.X <= ChangedMax.X)
+			{
+				OutModifiedBoxes.push_front(FVoxelBox(GetMinimalCornerPosition() + ChangedMin, GetMinimalCornerPosition() + ChangedMax));
+			}
 		}
 	}
 	else
 	{
-		uint64 Pow = IntPow9(Depth);
-		if (Id / Pow == Save.front().Id / Pow)
+		if (IsLeaf())
 		{
-			if (IsLeaf())
-			{
-				CreateChilds();
-				bIsDirty = true;
-			}
-			for (auto Child : Childs)
-			{
-				Child->LoadFromSaveAndGetModifiedPositions(Save, OutModifiedPositions);
-			}
+			CreateChilds();
+			bIsDirty = true;
 		}
+		// Childs are sorted by Id: split the range between them
+		int ChildBegin = Begin;
+		for (auto Child : Childs)
+		{
+			uint64 ChildFirstId, ChildEndId;
+			FOctree::GetLeafIdsRange(Child->Id, Child->Depth, ChildFirstId, ChildEndId);
+			const int ChildEnd = LowerBoundById(Chunks, ChildBegin, End, ChildEndId);
+			Child->LoadFromSaveAndGetModifiedBoxes(Chunks, ChildBegin, ChildEnd, OutModifiedBoxes);
+			ChildBegin = ChildEnd;
+		}
+		check(ChildBegin == End);
 	}
 }
 
-void FValueOctree::AddChunksToDiffLists(std::forward_list<FVoxelValueDiff>& OutValueDiffList, std::forward_list<FVoxelMaterialDiff>& OutColorDiffList)
+void FValueOctree::AddChunksToDiffs(const FVoxelBox& Box, TArray<FVoxelLeafDiff>& OutDiffs)
 {
+	if (!Box.Intersect(GetBox()))
+	{
+		return;
+	}
+
 	if (IsLeaf())
 	{
-		if (bIsNetworkDirty)
+		if (NetworkData)
 		{
-			bIsNetworkDirty = false;
+			GetDataForRead();
+			FVoxelLeafDiff& Diff = OutDiffs[OutDiffs.Emplace(Id)];
+			FMemory::Memcpy(Diff.ValueMask.GetData(), NetworkData->DirtyValues, sizeof(NetworkData->DirtyValues));
+			FMemory::Memcpy(Diff.MaterialMask.GetData(), NetworkData->DirtyMaterials, sizeof(NetworkData->DirtyMaterials));
 
-			for (int Index : DirtyValues)
+			for (int Word = 0; Word < 128; Word++)
 			{
-				check(0 <= Index && Index < 16 * 16 * 16);
-				OutValueDiffList.push_front(FVoxelValueDiff(Id, Index, Values[Index]));
+				for (uint32 Bits = NetworkData->DirtyValues[Word]; Bits; Bits &= Bits - 1)
+				{
+					Diff.Values.Add(FVoxelValue(Data->GetValue(32 * Word + FMath::CountTrailingZeros(Bits))));
+				}
 			}
-			for (int Index : DirtyMaterials)
+			for (int Word = 0; Word < 128; Word++)
 			{
-				OutColorDiffList.push_front(FVoxelMaterialDiff(Id, Index, Materials[Index]));
+				for (uint32 Bits = NetworkData->DirtyMaterials[Word]; Bits; Bits &= Bits - 1)
+				{
+					Diff.Materials.Add(Data->GetMaterial(32 * Word + FMath::CountTrailingZeros(Bits)));
+				}
 			}
-			DirtyValues.Empty(4096);
-			DirtyMaterials.Empty(4096);
+			delete NetworkData;
+			NetworkData = nullptr;
 		}
 	}
 	else
 	{
 		for (auto Child : Childs)
 		{
-			Child->AddChunksToDiffLists(OutValueDiffList, OutColorDiffList);
+			Child->AddChunksToDiffs(Box, OutDiffs);
 		}
 	}
 }
 
-void FValueOctree::LoadFromDiffListsAndGetModifiedPositions(std::forward_list<FVoxelValueDiff>& ValuesDiffs, std::forward_list<FVoxelMaterialDiff>& MaterialsDiffs, std::forward_list<FIntVector>& OutModifiedPositions)
+void FValueOctree::ClearNetworkData()
 {
-	if (ValuesDiffs.empty() && MaterialsDiffs.empty())
+	if (IsLeaf())
+	{
+		delete NetworkData;
+		NetworkData = nullptr;
+	}
+	else
+	{
+		for (auto Child : Childs)
+		{
+			Child->ClearNetworkData();
+		}
+	}
+}
+
+void FValueOctree::LoadFromDiffsAndGetModifiedBoxes(const TArray<FVoxelLeafDiff>& Diffs, int Begin, int End, std::forward_list<FVoxelBox>& OutModifiedBoxes)
+{
+	if (Begin == End)
 	{
 		return;
 	}
 
 	if (Depth == 0)
 	{
-		// Values
-		while (!ValuesDiffs.empty() && ValuesDiffs.front().Id == Id)
+		if (!IsDirty())
 		{
-			if (!IsDirty())
-			{
-				SetAsDirty();
-			}
-
-			check(0 <= ValuesDiffs.front().Index && ValuesDiffs.front().Index < 16 * 16 * 16);
-			Values[ValuesDiffs.front().Index] = ValuesDiffs.front().Value;
+			SetAsDirty();
+		}
+		FVoxelLeafData& LeafData = GetDataForWrite();
 
-			int X, Y, Z;
-			CoordinatesFromIndex(ValuesDiffs.front().Index, X, Y, Z);
-			OutModifiedPositions.push_front(FIntVector(X, Y, Z) + GetMinimalCornerPosition());
+		FIntVector ChangedMin(16, 16, 16);
+		FIntVector ChangedMax(-1, -1, -1);
 
-			ValuesDiffs.pop_front();
-		}
-		// Colors
-		while (!MaterialsDiffs.empty() && MaterialsDiffs.front().Id == Id)
+		// Several diffs of the same leaf are applied in order
+		for (int DiffIndex = Begin; DiffIndex < End; DiffIndex++)
 		{
-			if (!IsDirty())
+			const FVoxelLeafDiff& Diff = Diffs[DiffIndex];
+			check(Diff.Id == Id);
+
+			if (!LeafData.IsDense() && LeafData.GetSparseCount() + Diff.Values.Num() + Diff.Materials.Num() > FVoxelLeafData::MaxSparseCount)
 			{
-				SetAsDirty();
+				// Avoid inserting in the sparse arrays just to make them dense afterwards
+				LeafData.MakeDense(WorldGenerator, GetMinimalCornerPosition());
 			}
 
-			Materials[MaterialsDiffs.front().Index] = MaterialsDiffs.front().Material;
+			int ValueIndex = 0;
+			int MaterialIndex = 0;
+			for (int Index = 0; Index < 16 * 16 * 16; Index++)
+			{
+				const bool bHasValue = Diff.HasValue(Index);
+				const bool bHasMaterial = Diff.HasMaterial(Index);
+				if (!bHasValue && !bHasMaterial)
+				{
+					continue;
+				}
+				if (bHasValue)
+				{
+					LeafData.SetValue(Index, Diff.Values[ValueIndex++].ToFloat());
+				}
+				if (bHasMaterial)
+				{
+					LeafData.SetMaterial(Index, Diff.Materials[MaterialIndex++]);
+				}
 
-			int X, Y, Z;
-			CoordinatesFromIndex(MaterialsDiffs.front().Index, X, Y, Z);
-			OutModifiedPositions.push_front(FIntVector(X, Y, Z) + GetMinimalCornerPosition());
+				int X, Y, Z;
+				CoordinatesFromIndex(Index, X, Y, Z);
+				ChangedMin = FIntVector(FMath::Min(ChangedMin.X, X), FMath::Min(ChangedMin.Y, Y), FMath::Min(ChangedMin.Z, Z));
+				ChangedMax = FIntVector(FMath::Max(ChangedMax.X, X), FMath::Max(ChangedMax.Y, Y), FMath::Max(ChangedMax.Z, Z));
+			}
+			check(ValueIndex == Diff.Values.Num() && MaterialIndex == Diff.Materials.Num());
+			MakeDenseIfNeeded(LeafData);
+		}
 
-			MaterialsDiffs.pop_front();
+		if (ChangedMin.X <= ChangedMax.X)
+		{
+			OutModifiedBoxes.push_front(FVoxelBox(GetMinimalCornerPosition() + ChangedMin, GetMinimalCornerPosition() + ChangedMax));
 		}
 	}
 	else
 	{
-		uint64 Pow = IntPow9(Depth);
-		if ((!ValuesDiffs.empty() && Id / Pow == ValuesDiffs.front().Id / Pow) || (!MaterialsDiffs.empty() && Id / Pow == MaterialsDiffs.front().Id / Pow))
+		if (IsLeaf())
 		{
-			if (IsLeaf())
-			{
-				bIsDirty = true;
-				CreateChilds();
-			}
-			for (auto Child : Childs)
-			{
-				Child->LoadFromDiffListsAndGetModifiedPositions(ValuesDiffs, MaterialsDiffs, OutModifiedPositions);
-			}
+			bIsDirty = true;
+			CreateChilds();
 		}
+		// Childs are sorted by Id: split the range between them
+		int ChildBegin = Begin;
+		for (auto Child : Childs)
+		{
+			uint64 ChildFirstId, ChildEndId;
+			FOctree::GetLeafIdsRange(Child->Id, Child->Depth, ChildFirstId, ChildEndId);
+			const int ChildEnd = LowerBoundById(Diffs, ChildBegin, End, ChildEndId);
+			Child->LoadFromDiffsAndGetModifiedBoxes(Diffs, ChildBegin, ChildEnd, OutModifiedBoxes);
+			ChildBegin = ChildEnd;
+		}
+		check(ChildBegin == End);
 	}
 }
 
-
 void FValueOctree::CreateChilds()
 {
 	check(IsLeaf());
@@ -577,32 +854,174 @@ void FValueOctree::CreateChilds()
 	check(Depth != 0);
 
 	int d = Size() / 4;
-	uint64 Pow = IntPow9(Depth - 1);
 
-	Childs.Add(new FValueOctree(WorldGenerator, Position + FIntVector(-d, -d, -d), Depth - 1, Id + 1 * Pow, bMultiplayer));
-	Childs.Add(new FValueOctree(WorldGenerator, Position + FIntVector(+d, -d, -d), Depth - 1, Id + 2 * Pow, bMultiplayer));
-	Childs.Add(new FValueOctree(WorldGenerator, Position + FIntVector(-d, +d, -d), Depth - 1, Id + 3 * Pow, bMultiplayer));
-	Childs.Add(new FValueOctree(WorldGenerator, Position + FIntVector(+d, +d, -d), Depth - 1, Id + 4 * Pow, bMultiplayer));
-	Childs.Add(new FValueOctree(WorldGenerator, Position + FIntVector(-d, -d, +d), Depth - 1, Id + 5 * Pow, bMultiplayer));
-	Childs.Add(new FValueOctree(WorldGenerator, Position + FIntVector(+d, -d, +d), Depth - 1, Id + 6 * Pow, bMultiplayer));
-	Childs.Add(new FValueOctree(WorldGenerator, Position + FIntVector(-d, +d, +d), Depth - 1, Id + 7 * Pow, bMultiplayer));
-	Childs.Add(new FValueOctree(WorldGenerator, Position + FIntVector(+d, +d, +d), Depth - 1, Id + 8 * Pow, bMultiplayer));
+	FValueOctree* Block = Childs.Allocate(*BlockPool);
+	new (&Block[0]) FValueOctree(WorldGenerator, Position + FIntVector(-d, -d, -d), Depth - 1, GetChildId(Id, 0), bMultiplayer, Pager, BlockPool);
+	new (&Block[1]) FValueOctree(WorldGenerator, Position + FIntVector(+d, -d, -d), Depth - 1, GetChildId(Id, 1), bMultiplayer, Pager, BlockPool);
+	new (&Block[2]) FValueOctree(WorldGenerator, Position + FIntVector(-d, +d, -d), Depth - 1, GetChildId(Id, 2), bMultiplayer, Pager, BlockPool);
+	new (&Block[3]) FValueOctree(WorldGenerator, Position + FIntVector(+d, +d, -d), Depth - 1, GetChildId(Id, 3), bMultiplayer, Pager, BlockPool);
+	new (&Block[4]) FValueOctree(WorldGenerator, Position + FIntVector(-d, -d, +d), Depth - 1, GetChildId(Id, 4), bMultiplayer, Pager, BlockPool);
+	new (&Block[5]) FValueOctree(WorldGenerator, Position + FIntVector(+d, -d, +d), Depth - 1, GetChildId(Id, 5), bMultiplayer, Pager, BlockPool);
+	new (&Block[6]) FValueOctree(WorldGenerator, Position + FIntVector(-d, +d, +d), Depth - 1, GetChildId(Id, 6), bMultiplayer, Pager, BlockPool);
+	new (&Block[7]) FValueOctree(WorldGenerator, Position + FIntVector(+d, +d, +d), Depth - 1, GetChildId(Id, 7), bMultiplayer, Pager, BlockPool);
 
 	bHasChilds = true;
 	check(!IsLeaf() == (Childs.Num() == 8));
 }
 
+void FValueOctree::Clear()
+{
+	// The childs free their own pages and network data
+	Childs.Reset();
+	bHasChilds = false;
+
+	if (bPagedOut)
+	{
+		Pager->Free(this);
+		bPagedOut = 0;
+	}
+	Data.Reset();
+	Mip.Reset();
+	bMipOutdated = false;
+	delete NetworkData;
+	NetworkData = nullptr;
+
+	bIsDirty = false;
+	bDataModified = false;
+	bEdited = false;
+}
+
 void FValueOctree::SetAsDirty()
 {
 	check(!IsDirty());
 	check(Depth == 0);
 
-	FIntVector Min = GetMinimalCornerPosition();
-	GetValuesAndMaterials(Values, Materials, FIntVector(Min.X, Min.Y, Min.Z), FIntVector::ZeroValue, 1, FIntVector(16, 16, 16), FIntVector(16, 16, 16));
+	// Sparse: only the modified voxels will be stored
+	Data = MakeShareable(new FVoxelLeafData());
+	bDataModified = true;
+	bEdited = true;
 
 	bIsDirty = true;
 }
 
+void FValueOctree::MakeDenseIfNeeded(FVoxelLeafData& LeafData)
+{
+	if (!LeafData.IsDense() && LeafData.GetSparseCount() > FVoxelLeafData::MaxSparseCount)
+	{
+		LeafData.MakeDense(WorldGenerator, GetMinimalCornerPosition());
+	}
+}
+
+FVoxelLeafData& FValueOctree::GetDataForWrite()
+{
+	check(IsDirty());
+	GetDataForRead();
+	check(Data.IsValid());
+
+	// The pool only keeps weak references: a data that may be in it is never written in place, even if unique,
+	// as the pool may be comparing it with another leaf data
+	if (!Data.IsUnique() || !bDataModified)
+	{
+		// A snapshot or identical leaves may still be using it
+		Data = MakeShareable(new FVoxelLeafData(*Data));
+	}
+	bDataModified = true;
+	bEdited = true;
+	return *Data;
+}
+
+const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& FValueOctree::GetDataForRead() const
+{
+	check(IsDirty() && Depth == 0);
+
+	if (Pager)
+	{
+		const int32 Time = Pager->GetTime();
+		if (LastAccessTime != Time)
+		{
+			FPlatformAtomics::InterlockedExchange(&LastAccessTime, Time);
+		}
+		if (bPagedOut)
+		{
+			PageIn();
+		}
+		// Data was written before bPagedOut was cleared
+		FPlatformMisc::MemoryBarrier();
+	}
+	return Data;
+}
+
+void FValueOctree::PageIn() const
+{
+	// Readers of other leaves are not blocked while this one is read and decompressed
+	if (FPlatformAtomics::InterlockedCompareExchange(&bPagedOut, 2, 1) == 1)
+	{
+		Data = Pager->PageIn(this);
+		if (!Data.IsValid())
+		{
+			// Disk error: fall back to the world generator values rather than crashing
+			const FIntVector Min = GetMinimalCornerPosition();
+			UE_LOG(LogVoxel, Error, TEXT("Paging: The voxels of the leaf at (%d, %d, %d) are lost"), Min.X, Min.Y, Min.Z);
+			Data = MakeShareable(new FVoxelLeafData());
+		}
+		FPlatformMisc::MemoryBarrier();
+		FPlatformAtomics::InterlockedExchange(&bPagedOut, 0);
+	}
+	else
+	{
+		// Another reader is paging it in
+		while (bPagedOut)
+		{
+			FPlatformProcess::Yield();
+		}
+	}
+}
+
+void FValueOctree::GetIdleLeavesToPageOut(const FVoxelBox& Box, int32 IdleTime, TArray<TPair<uint64, TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>>>& OutLeaves) const
+{
+	if (!IsDirty() || !Box.Intersect(GetBox()))
+	{
+		return;
+	}
+
+	if (IsLeaf())
+	{
+		check(Pager && Depth == 0);
+		// Already shared with the pool, and not shared: paging out a shared data wouldn't free it
+		if (!bPagedOut && !bDataModified && Data.IsUnique() && Pager->GetTime() - LastAccessTime >= IdleTime)
+		{
+			OutLeaves.Emplace(Id, Data);
+		}
+	}
+	else
+	{
+		for (auto Child : Childs)
+		{
+			Child->GetIdleLeavesToPageOut(Box, IdleTime, OutLeaves);
+		}
+	}
+}
+
+bool FValueOctree::SetPagedOut(const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& OldData, const FVoxelLeafPage& Page, int32 IdleTime)
+{
+	check(Pager && Depth == 0);
+
+	// Only referenced by this leaf and OldData: not modified nor used by a snapshot since
+	if (IsDirty() && !bPagedOut && Data == OldData && !bDataModified && Data.GetSharedReferenceCount() == 2 && Pager->GetTime() - LastAccessTime >= IdleTime)
+	{
+		Pager->Assign(this, Page);
+		Data.Reset();
+		bPagedOut = 1;
+		return true;
+	}
+	return false;
+}
+
+FVoxelBox FValueOctree::GetBox() const
+{
+	return FVoxelBox(GetMinimalCornerPosition(), GetMaximalCornerPosition() - FIntVector(1, 1, 1));
+}
+
 int FValueOctree::IndexFromCoordinates(int X, int Y, int Z) const
 {
 	check(0 <= X && X < 16);
@@ -647,28 +1066,273 @@ FValueOctree* FValueOctree::GetLeaf(int X, int Y, int Z)
 	return Ptr;
 }
 
-void FValueOctree::GetDirtyChunksPositions(std::forward_list<FIntVector>& OutPositions)
+FValueOctree* FValueOctree::CreateLeaf(int X, int Y, int Z)
+{
+	check(IsInOctree(X, Y, Z));
+
+	FValueOctree* Ptr = this;
+
+	while (Ptr->Depth != 0)
+	{
+		if (Ptr->IsLeaf())
+		{
+			Ptr->CreateChilds();
+			Ptr->bIsDirty = true;
+		}
+		Ptr = Ptr->GetChild(X, Y, Z);
+	}
+
+	return Ptr;
+}
+
+void FValueOctree::CreateRegions(int RegionDepth)
+{
+	if (Depth > RegionDepth)
+	{
+		if (IsLeaf())
+		{
+			CreateChilds();
+			// Childs may become dirty without us knowing it
+			bIsDirty = true;
+		}
+		for (auto Child : Childs)
+		{
+			Child->CreateRegions(RegionDepth);
+		}
+	}
+}
+
+void FValueOctree::SetBlockPool(TOctreeBlockPool<FValueOctree>* NewBlockPool)
+{
+	check(IsLeaf());
+	BlockPool = NewBlockPool;
+}
+
+void FValueOctree::ResetRegions(int RegionDepth)
+{
+	if (Depth > RegionDepth)
+	{
+		for (auto Child : Childs)
+		{
+			Child->ResetRegions(RegionDepth);
+		}
+	}
+	else
+	{
+		Clear();
+	}
+}
+
+void FValueOctree::AddLeavesToSnapshot(const FVoxelBox& Box, FVoxelDataSnapshot& Snapshot) const
+{
+	if (!IsDirty() || !Box.Intersect(GetBox()))
+	{
+		return;
+	}
+
+	if (IsLeaf())
+	{
+		check(Depth == 0);
+		Snapshot.AddLeaf(GetMinimalCornerPosition(), GetDataForRead());
+	}
+	else
+	{
+		if (Depth == Snapshot.GetMipDepth())
+		{
+			UpdateMip();
+			Snapshot.AddMip(GetMinimalCornerPosition(), Mip);
+		}
+		// Leaves are still needed for the reads that are not on the mip samples
+		for (auto Child : Childs)
+		{
+			Child->AddLeavesToSnapshot(Box, Snapshot);
+		}
+	}
+}
+
+void FValueOctree::InvalidateMips(const FVoxelBox& Box)
+{
+	if (IsLeaf() || !Box.Intersect(GetBox()))
+	{
+		return;
+	}
+
+	if (Mip.IsValid())
+	{
+		if (bMipOutdated)
+		{
+			MipOutdatedBox = FVoxelBox(
+				FIntVector(FMath::Min(MipOutdatedBox.Min.X, Box.Min.X), FMath::Min(MipOutdatedBox.Min.Y, Box.Min.Y), FMath::Min(MipOutdatedBox.Min.Z, Box.Min.Z)),
+				FIntVector(FMath::Max(MipOutdatedBox.Max.X, Box.Max.X), FMath::Max(MipOutdatedBox.Max.Y, Box.Max.Y), FMath::Max(MipOutdatedBox.Max.Z, Box.Max.Z)));
+		}
+		else
+		{
+			MipOutdatedBox = Box;
+			bMipOutdated = true;
+		}
+	}
+
+	for (auto Child : Childs)
+	{
+		Child->InvalidateMips(Box);
+	}
+}
+
+void FValueOctree::GetModifiedIds(const FVoxelBox& Box, int32 Time, TArray<uint64>& OutModifiedIds)
+{
+	if (!Box.Intersect(GetBox()))
+	{
+		return;
+	}
+
+	if (IsLeaf())
+	{
+		if (bEdited)
+		{
+			check(Depth == 0);
+			bEdited = false;
+			LastEditTime = Time;
+			OutModifiedIds.Add(Id);
+		}
+	}
+	else
+	{
+		for (auto Child : Childs)
+		{
+			Child->GetModifiedIds(Box, Time, OutModifiedIds);
+		}
+	}
+}
+
+void FValueOctree::GetIdleUnsharedLeaves(const FVoxelBox& Box, int32 Time, int32 IdleTime, TArray<TPair<uint64, TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>>>& OutLeaves) const
+{
+	if (!IsDirty() || !Box.Intersect(GetBox()))
+	{
+		return;
+	}
+
+	if (IsLeaf())
+	{
+		// Paged out leaves were shared before being paged out
+		if (bDataModified && !bPagedOut && Time - LastEditTime >= IdleTime)
+		{
+			check(Depth == 0 && Data.IsValid());
+			OutLeaves.Emplace(Id, Data);
+		}
+	}
+	else
+	{
+		for (auto Child : Childs)
+		{
+			Child->GetIdleUnsharedLeaves(Box, Time, IdleTime, OutLeaves);
+		}
+	}
+}
+
+void FValueOctree::SetSharedData(const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& OldData, const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& SharedData)
+{
+	check(Depth == 0);
+
+	// A write since GetIdleUnsharedLeaves copied the data, as it was referenced
+	if (IsDirty() && !bPagedOut && Data == OldData)
+	{
+		Data = SharedData;
+		bDataModified = false;
+	}
+}
+
+void FValueOctree::UpdateMip() const
+{
+	check(!IsLeaf());
+
+	const int MipStep = 1 << Depth;
+	const int FineStep = MipStep / 2;
+	const FIntVector Min = GetMinimalCornerPosition();
+
+	// Samples whose cell [P, P + MipStep) overlaps the modified voxels
+	FIntVector SampleMin, SampleMax;
+	if (!Mip.IsValid())
+	{
+		Mip = MakeShareable(new FVoxelMipData());
+		SampleMin = FIntVector(0, 0, 0);
+		SampleMax = FIntVector(15, 15, 15);
+	}
+	else if (bMipOutdated)
+	{
+		GetIndicesInRange(Min.X, MipStep, 16, MipOutdatedBox.Min.X - MipStep + 1, MipOutdatedBox.Max.X, SampleMin.X, SampleMax.X);
+		GetIndicesInRange(Min.Y, MipStep, 16, MipOutdatedBox.Min.Y - MipStep + 1, MipOutdatedBox.Max.Y, SampleMin.Y, SampleMax.Y);
+		GetIndicesInRange(Min.Z, MipStep, 16, MipOutdatedBox.Min.Z - MipStep + 1, MipOutdatedBox.Max.Z, SampleMin.Z, SampleMax.Z);
+		if (!Mip.IsUnique())
+		{
+			// A snapshot is still using it
+			Mip = MakeShareable(new FVoxelMipData(*Mip));
+		}
+	}
+	else
+	{
+		return;
+	}
+	bMipOutdated = false;
+
+	if (SampleMin.X > SampleMax.X || SampleMin.Y > SampleMax.Y || SampleMin.Z > SampleMax.Z)
+	{
+		return;
+	}
+
+	// 2 * 2 * 2 values one level finer per sample, read like the chunks of depth Depth - 1 read them
+	const FIntVector Size = SampleMax - SampleMin + FIntVector(1, 1, 1);
+	const FIntVector FineSize = Size * 2;
+	TArray<float> FineValues;
+	TArray<FVoxelMaterial> FineMaterials;
+	FineValues.SetNumUninitialized(FineSize.X * FineSize.Y * FineSize.Z);
+	FineMaterials.SetNumUninitialized(FineSize.X * FineSize.Y * FineSize.Z);
+
+	GetValuesAndMaterials(FineValues.GetData(), FineMaterials.GetData(), Min + SampleMin * MipStep, FIntVector::ZeroValue, FineStep, FineSize, FineSize);
+
+	for (int Z = 0; Z < Size.Z; Z++)
+	{
+		for (int Y = 0; Y < Size.Y; Y++)
+		{
+			for (int X = 0; X < Size.X; X++)
+			{
+				const int FineIndex = 2 * X + FineSize.X * 2 * Y + FineSize.X * FineSize.Y * 2 * Z;
+
+				// Box filter of the density
+				float Sum = 0;
+				for (int K = 0; K < 2; K++)
+				{
+					for (int J = 0; J < 2; J++)
+					{
+						Sum += FineValues[FineIndex + FineSize.X * J + FineSize.X * FineSize.Y * K] + FineValues[FineIndex + 1 + FineSize.X * J + FineSize.X * FineSize.Y * K];
+					}
+				}
+
+				const int Index = (SampleMin.X + X) + 16 * (SampleMin.Y + Y) + 16 * 16 * (SampleMin.Z + Z);
+				Mip->Values[Index] = FVoxelValue(Sum / 8);
+				// Materials can't be averaged: the one at the sample position
+				Mip->Materials[Index] = FineMaterials[FineIndex];
+			}
+		}
+	}
+}
+
+void FValueOctree::GetModifiedBoxes(std::forward_list<FVoxelBox>& OutBoxes)
 {
 	if (IsDirty())
 	{
 		if (IsLeaf())
 		{
-			// With neighbors
-			const int S = Size();
-			OutPositions.push_front(Position - FIntVector(0, 0, 0));
-			OutPositions.push_front(Position - FIntVector(S, 0, 0));
-			OutPositions.push_front(Position - FIntVector(0, S, 0));
-			OutPositions.push_front(Position - FIntVector(S, S, 0));
-			OutPositions.push_front(Position - FIntVector(0, 0, S));
-			OutPositions.push_front(Position - FIntVector(S, 0, S));
-			OutPositions.push_front(Position - FIntVector(0, S, S));
-			OutPositions.push_front(Position - FIntVector(S, S, S));
+			FIntVector ModifiedMin, ModifiedMax;
+			if (GetDataForRead()->GetModifiedBounds(ModifiedMin, ModifiedMax))
+			{
+				OutBoxes.push_front(FVoxelBox(GetMinimalCornerPosition() + ModifiedMin, GetMinimalCornerPosition() + ModifiedMax));
+			}
 		}
 		else
 		{
 			for (auto Child : Childs)
 			{
-				Child->GetDirtyChunksPositions(OutPositions);
+				Child->GetModifiedBoxes(OutBoxes);
 			}
 		}
 	}
@@ -2,11 +2,16 @@
 
 #include "CoreMinimal.h"
 #include "Octree.h"
+#include "OctreeChilds.h"
 #include "VoxelSave.h"
-#include <list>
+#include "VoxelBox.h"
+#include "VoxelLeafData.h"
 #include <forward_list>
 
 class UVoxelWorldGenerator;
+class FVoxelDataSnapshot;
+class FVoxelLeafPager;
+struct FVoxelLeafPage;
 
 /**
  * Octree that holds modified values & colors
@@ -19,8 +24,10 @@ public:
 	 * @param	Position		Position (center) of this in voxel space
 	 * @param	Depth			Distance to the highest resolution
 	 * @param	WorldGenerator	Generator of the current world
+	 * @param	Pager			Pager of the idle leaves data. Null if paging is disabled
+	 * @param	BlockPool		Pool the childs are allocated from
 	 */
-	FValueOctree(UVoxelWorldGenerator* WorldGenerator, FIntVector Position, uint8 Depth, uint64 Id, bool bMultiplayer);
+	FValueOctree(UVoxelWorldGenerator* WorldGenerator, FIntVector Position, uint8 Depth, uint64 Id, bool bMultiplayer, FVoxelLeafPager* Pager, TOctreeBlockPool<FValueOctree>* BlockPool);
 	~FValueOctree();
 
 	// Is the game multiplayer?
@@ -43,32 +50,60 @@ public:
 	 */
 	void GetValuesAndMaterials(float Values[], FVoxelMaterial Materials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const;
 
-	void SetValueAndMaterial(int X, int Y, int Z, float Value, FVoxelMaterial Material, bool bSetValue, bool bSetMaterial);
+	/**
+	 * @param	bMarkNetworkDirty	Add the edited voxel to the network dirty data, if multiplayer
+	 */
+	void SetValueAndMaterial(int X, int Y, int Z, float Value, FVoxelMaterial Material, bool bSetValue, bool bSetMaterial, bool bMarkNetworkDirty);
+
+	/**
+	 * Apply edits to this leaf, in order. Must be a depth 0 leaf
+	 * @param	Edits				Edits of voxels of this leaf
+	 * @param	bMarkNetworkDirty	Add the edited voxels to the network dirty data, if multiplayer
+	 */
+	void SetValuesAndMaterials(const TArray<FVoxelLeafEdit>& Edits, bool bMarkNetworkDirty);
+
+	/**
+	 * Get value and/or material of a single voxel. Must be a leaf
+	 * @param	OutValue	Can be null
+	 * @param	OutMaterial	Can be null
+	 */
+	FORCEINLINE void GetValueAndMaterial(int X, int Y, int Z, float* OutValue, FVoxelMaterial* OutMaterial) const;
 
 	/**
 	 * Add dirty chunks to SaveList
 	 * @param	SaveList		List to save chunks into
+	 * @param	SavedDatas		Id of the chunk saved for each dense data already saved. Leaves sharing them are saved as references
 	 */
-	void AddDirtyChunksToSaveList(std::list<TSharedRef<FVoxelChunkSave>>& SaveList);
+	void AddDirtyChunksToSaveList(TArray<FVoxelChunkSave>& SaveList, TMap<const FVoxelLeafData*, uint64>& SavedDatas);
 	/**
-	 * Load chunks from SaveArray
-	 * @param	SaveArray	Array to load chunks from
+	 * Save this leaf. Must be a dirty leaf of depth 0
+	 * @param	bAllowResidual	Save sparse datas as residual chunks, with only their modified voxels. Needs a GeneratorResiduals save
 	 */
-	void LoadFromSaveAndGetModifiedPositions(std::list<FVoxelChunkSave>& Save, std::forward_list<FIntVector>& OutModifiedPositions);
+	FVoxelChunkSave CreateChunkSave(bool bAllowResidual);
+	/**
+	 * Load chunks from save
+	 * @param	Chunks		Chunks sorted by increasing Id
+	 * @param	Begin		First chunk of this subtree
+	 * @param	End			End of the chunks of this subtree: all the chunks in [Begin, End) are in this subtree
+	 */
+	void LoadFromSaveAndGetModifiedBoxes(const TArray<const FVoxelChunkSave*>& Chunks, int Begin, int End, std::forward_list<FVoxelBox>& OutModifiedBoxes);
 
 	/**
-	 * Add values that have changed since last network sync to diff arrays
-	 * @param	ValuesDiffs		Values diff array; sorted by increasing Id
-	 * @param	ColorsDiffs		Colors diff array; sorted by increasing Id
+	 * Add the leaves that have changed since last network sync to the diffs, and clear their network dirty data.
+	 * Must be locked for reading, by one thread at a time
+	 * @param	Box			Only the leaves overlapping it are added
+	 * @param	OutDiffs	One diff by leaf, sorted by increasing Id
+	 */
+	void AddChunksToDiffs(const FVoxelBox& Box, TArray<FVoxelLeafDiff>& OutDiffs);
+	/**
+	 * Forget the network dirty data of all the leaves. Must be locked for reading, by one thread at a time
 	 */
-	void AddChunksToDiffLists(std::forward_list<FVoxelValueDiff>& OutValueDiffList, std::forward_list<FVoxelMaterialDiff>& OutColorDiffList);
+	void ClearNetworkData();
 	/**
-	 * Load values that have changed since last network sync from diff arrays
-	 * @param	ValuesDiffs		Values diff array; top is lowest Id
-	 * @param	ColorsDiffs		Colors diff array; top is lowest Id
-	 * @param	World			Voxel world
+	 * Load values that have changed since last network sync from leaf diffs
+	 * @param	Diffs	Diffs sorted by increasing Id. The ones in [Begin, End) are in this subtree
 	 */
-	void LoadFromDiffListsAndGetModifiedPositions(std::forward_list<FVoxelValueDiff>& ValuesDiffs, std::forward_list<FVoxelMaterialDiff>& ColorsDiffs, std::forward_list<FIntVector>& OutModifiedPositions);
+	void LoadFromDiffsAndGetModifiedBoxes(const TArray<FVoxelLeafDiff>& Diffs, int Begin, int End, std::forward_list<FVoxelBox>& OutModifiedBoxes);
 
 	/**
 	* Get direct child that owns GlobalPosition
@@ -79,10 +114,84 @@ public:
 	FORCEINLINE FValueOctree* GetLeaf(int X, int Y, int Z);
 
 	/**
-	 * Queue update of dirty chunks
-	 * @param	World	Voxel world
+	 * Get the depth 0 leaf at position, creating childs if needed
+	 */
+	FValueOctree* CreateLeaf(int X, int Y, int Z);
+
+	/**
+	 * Create childs recursively until RegionDepth. Nodes above RegionDepth are then never modified, which allows to lock regions independently
+	 * @param	RegionDepth		Depth of the regions roots
+	 */
+	void CreateRegions(int RegionDepth);
+
+	/**
+	 * Set the pool the childs of this region root are allocated from, so that each region is only allocated under its own lock
+	 * @param	NewBlockPool	Pool of the region. Must outlive the childs
+	 */
+	void SetBlockPool(TOctreeBlockPool<FValueOctree>* NewBlockPool);
+
+	/**
+	 * Discard the edits of all the regions, keeping the nodes above them. All the regions must be locked for writing
+	 * @param	RegionDepth		Depth of the regions roots
+	 */
+	void ResetRegions(int RegionDepth);
+
+	/**
+	 * Add the data of the dirty leaves overlapping Box to Snapshot, and the mips of its mip depth. Missing or outdated mips are built:
+	 * the mips of the regions overlapping Box must be locked
+	 * @param	Box			Box in voxel space
+	 * @param	Snapshot	Snapshot to add the leaves to
+	 */
+	void AddLeavesToSnapshot(const FVoxelBox& Box, FVoxelDataSnapshot& Snapshot) const;
+
+	/**
+	 * Mark the samples of the mips overlapping Box as outdated. They are rebuilt by the next snapshot reading them. Must be locked for writing
+	 * @param	Box		Box in voxel space containing all the edits since the last call
+	 */
+	void InvalidateMips(const FVoxelBox& Box);
+
+	/**
+	 * Get the leaves modified since the last call, and stamp them with their edit time. Must be locked for writing
+	 * @param	Box		Box in voxel space containing all the edits since the last call
+	 * @param	Time	Current time, in seconds
+	 * @return	OutModifiedIds	Ids of these leaves
+	 */
+	void GetModifiedIds(const FVoxelBox& Box, int32 Time, TArray<uint64>& OutModifiedIds);
+
+	/**
+	 * Get the data of the leaves in Box modified since they were last shared with the pool, and not edited since IdleTime. Must be locked for reading
+	 * @param	Time		Current time, in seconds
+	 * @return	OutLeaves	Id and data of these leaves. Their data is copied on the next write while referenced
 	 */
-	void GetDirtyChunksPositions(std::forward_list<FIntVector>& OutPositions);
+	void GetIdleUnsharedLeaves(const FVoxelBox& Box, int32 Time, int32 IdleTime, TArray<TPair<uint64, TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>>>& OutLeaves) const;
+
+	/**
+	 * Use the data given by the pool for the one returned by GetIdleUnsharedLeaves. Does nothing if this leaf data changed since. Must be locked for writing
+	 * @param	OldData		Data returned by GetIdleUnsharedLeaves
+	 * @param	SharedData	Data identical to OldData, shared with the other leaves
+	 */
+	void SetSharedData(const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& OldData, const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& SharedData);
+
+	/**
+	 * Get the data of the leaves in Box not used for IdleTime, and freed if paged out. Must be locked for reading
+	 * @param	IdleTime	In seconds
+	 * @return	OutLeaves	Id and data of these leaves, to write to the pager without any lock
+	 */
+	void GetIdleLeavesToPageOut(const FVoxelBox& Box, int32 IdleTime, TArray<TPair<uint64, TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>>>& OutLeaves) const;
+
+	/**
+	 * Page out this leaf, whose data was written to Page. Must be locked for writing
+	 * @param	OldData		Data returned by GetIdleLeavesToPageOut
+	 * @param	IdleTime	In seconds
+	 * @return	false if the data changed or was used since GetIdleLeavesToPageOut: Page must then be released
+	 */
+	bool SetPagedOut(const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& OldData, const FVoxelLeafPage& Page, int32 IdleTime);
+
+	/**
+	 * Get the bounds of the modified voxels of each dirty leaf
+	 * @param	OutBoxes	Boxes in voxel space
+	 */
+	void GetModifiedBoxes(std::forward_list<FVoxelBox>& OutBoxes);
 
 private:
 	/*
@@ -94,21 +203,38 @@ private:
 	v 1 | 3    5 | 7
 	x
 	*/
-	TArray<FValueOctree*, TFixedAllocator<8>> Childs;
+	TOctreeChilds<FValueOctree> Childs;
 
-	// Values if dirty
-	float Values[16 * 16 * 16];
-	// Materials if dirty
-	FVoxelMaterial Materials[16 * 16 * 16];
+	// Values & materials if dirty. Copied on write if shared with a snapshot or with identical leaves.
+	// Null while paged out; mutable as reads page it back in
+	mutable TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe> Data;
 
-	bool bIsDirty;
+	FVoxelLeafPager* const Pager;
+	// Pool of Childs, inherited by them. Protected by the lock of the region
+	TOctreeBlockPool<FValueOctree>* BlockPool;
+	// Is Data paged out? Only set while locked for writing. 2 while a reader pages it in, cleared once it is in
+	mutable volatile int32 bPagedOut;
+	// Pager time of the last read or write of Data
+	mutable volatile int32 LastAccessTime;
 
-	// For multiplayer
+	bool bIsDirty;
+	// Was Data modified since it was last shared with the pool? Sharing is done once the leaf is no longer edited.
+	// If false, Data may be in the pool and is copied on the next write
+	bool bDataModified;
+	// Was Data modified since the last EndSet?
+	bool bEdited;
+	// Time of the last EndSet after which Data was modified, in seconds
+	int32 LastEditTime;
 
-	TSet<int> DirtyValues;
-	TSet<int> DirtyMaterials;
+	// Downsampled values & materials if this has modified childs and a snapshot read them. Copied on write if shared with a snapshot.
+	// Mutable as snapshots build it, under the mip lock of the region
+	mutable TSharedPtr<FVoxelMipData, ESPMode::ThreadSafe> Mip;
+	// Voxels modified since Mip was last updated. Only valid if bMipOutdated
+	mutable FVoxelBox MipOutdatedBox;
+	mutable bool bMipOutdated;
 
-	bool bIsNetworkDirty;
+	// For multiplayer. Null if not modified since last sync
+	FVoxelLeafNetworkData* NetworkData;
 
 	/**
 	 * Create childs of this octree
@@ -116,10 +242,42 @@ private:
 	void CreateChilds();
 
 	/**
-	 * Init arrays
+	 * Destroy the childs and the data of this node: it becomes an unmodified leaf
+	 */
+	void Clear();
+
+	/**
+	 * Allocate the leaf data, sparse at first
 	 */
 	void SetAsDirty();
 
+	/**
+	 * Switch LeafData to dense storage once it stores too many voxels
+	 */
+	FORCEINLINE void MakeDenseIfNeeded(FVoxelLeafData& LeafData);
+
+	/**
+	 * Get the data of this leaf for reading, paging it in if needed. Can be called concurrently by readers
+	 */
+	FORCEINLINE const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& GetDataForRead() const;
+
+	/**
+	 * Read back the data from the pager. Only the first reader reads it, the other ones wait for it
+	 */
+	void PageIn() const;
+
+	/**
+	 * Get the data of this leaf for writing. Copies it if it's shared with a snapshot or with identical leaves, or if it may be in the pool
+	 */
+	FORCEINLINE FVoxelLeafData& GetDataForWrite();
+
+	/**
+	 * Build the mip, or only its outdated samples
+	 */
+	void UpdateMip() const;
+
+	FORCEINLINE FVoxelBox GetBox() const;
+
 	FORCEINLINE int IndexFromCoordinates(int X, int Y, int Z) const;
 
 	FORCEINLINE void CoordinatesFromIndex(int Index, int& OutX, int& OutY, int& OutZ) const;
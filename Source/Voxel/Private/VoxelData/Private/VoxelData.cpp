@@ -1,29 +1,47 @@
 // Copyright 2017 Phyronnaz
 
+#include "VoxelPrivate.h"
 #include "VoxelData.h"
 #include "ValueOctree.h"
+#include "VoxelDataSnapshot.h"
+#include "VoxelLeafDataPool.h"
+#include "VoxelLeafPager.h"
 #include "VoxelSave.h"
+#include "VoxelSaveJournal.h"
 #include "VoxelWorldGenerator.h"
 
-FVoxelData::FVoxelData(int Depth, UVoxelWorldGenerator* WorldGenerator, bool bMultiplayer)
+FVoxelData::FVoxelData(int Depth, UVoxelWorldGenerator* WorldGenerator, bool bMultiplayer, bool bEnablePaging)
 	: Depth(Depth)
 	, WorldGenerator(WorldGenerator)
 	, bMultiplayer(bMultiplayer)
+	, RegionDepth(FMath::Max(Depth - RegionLevels, 0))
+	, RegionCount(1 << (Depth - FMath::Max(Depth - RegionLevels, 0)))
+	, StartTime(FPlatformTime::Seconds())
+	, bRecordNetworkDiffs(bMultiplayer)
+	, bJournalTracking(false)
+	, bJournalReset(false)
 {
-	MainOctree = MakeShareable( new FValueOctree(WorldGenerator, FIntVector::ZeroValue, Depth, FOctree::GetTopIdFromDepth(Depth), bMultiplayer) );
+	RegionLocks = new FRWLock[RegionCount * RegionCount * RegionCount];
+	RegionMipSections = new FCriticalSection[RegionCount * RegionCount * RegionCount];
+	RegionBlockPools = new TOctreeBlockPool<FValueOctree>[RegionCount * RegionCount * RegionCount];
+	TopBlockPool = new TOctreeBlockPool<FValueOctree>();
+	RegionLeaves.SetNum(RegionCount * RegionCount * RegionCount);
+	LeafDataPool = new FVoxelLeafDataPool();
+	LeafPager = bEnablePaging ? new FVoxelLeafPager() : nullptr;
 
-	GetCount.Reset();
-
-	CanGetEvent = FGenericPlatformProcess::GetSynchEventFromPool(true);
-	CanSetEvent = FGenericPlatformProcess::GetSynchEventFromPool(true);
-
-	CanGetEvent->Trigger();
-	CanSetEvent->Trigger();
+	CreateOctree();
 }
 
 FVoxelData::~FVoxelData()
 {
+	// Frees the pages and gives the blocks back before the pools are freed
 	MainOctree.Reset();
+	delete[] RegionLocks;
+	delete[] RegionMipSections;
+	delete[] RegionBlockPools;
+	delete TopBlockPool;
+	delete LeafDataPool;
+	delete LeafPager;
 }
 
 int FVoxelData::Size() const
@@ -31,49 +49,423 @@ int FVoxelData::Size() const
 	return 16 << Depth;
 }
 
+int FVoxelData::RegionSize() const
+{
+	return 16 << RegionDepth;
+}
+
 FIntVector FVoxelData::GetMinimalCornerPosition() const
 {
-	return MainOctree->GetMinimalCornerPosition();
+	// Only depends on Depth: used to find the regions to lock, before any lock is taken
+	const int S = Size() / 2;
+	return FIntVector(-S, -S, -S);
 }
 
 FIntVector FVoxelData::GetMaximalCornerPosition() const
 {
-	return MainOctree->GetMaximalCornerPosition();
+	const int S = Size() / 2;
+	return FIntVector(S, S, S);
 }
 
 void FVoxelData::BeginSet()
 {
-	CanGetEvent->Reset();
-	CanSetEvent->Wait();
-	CanSetEvent->Reset();
+	BeginSet(GetWorldBox());
 }
 
 void FVoxelData::EndSet()
 {
-	CanSetEvent->Trigger();
-	CanGetEvent->Trigger();
+	EndSet(GetWorldBox());
 }
 
 void FVoxelData::BeginGet()
 {
-	CanGetEvent->Wait();
-	CanSetEvent->Reset();
-	GetCount.Increment();
+	BeginGet(GetWorldBox());
 }
 
 void FVoxelData::EndGet()
 {
-	GetCount.Decrement();
-	if (GetCount.GetValue() == 0)
+	EndGet(GetWorldBox());
+}
+
+void FVoxelData::BeginSet(const FVoxelBox& Box)
+{
+	FIntVector Min, Max;
+	GetRegionsInBox(Box, Min, Max);
+
+	// Always lock in increasing index order to avoid deadlocks
+	for (int Z = Min.Z; Z <= Max.Z; Z++)
+	{
+		for (int Y = Min.Y; Y <= Max.Y; Y++)
+		{
+			for (int X = Min.X; X <= Max.X; X++)
+			{
+				RegionLocks[X + RegionCount * Y + RegionCount * RegionCount * Z].WriteLock();
+			}
+		}
+	}
+}
+
+void FVoxelData::EndSet(const FVoxelBox& Box)
+{
+	// Still locked. Mips are rebuilt later by the snapshots reading them, and data are shared once the leaves are idle
+	TArray<uint64> ModifiedIds;
+	MainOctree->GetModifiedIds(Box, GetTime(), ModifiedIds);
+	MainOctree->InvalidateMips(Box);
+
+	if (ModifiedIds.Num() > 0)
+	{
+		FScopeLock Lock(&JournalSection);
+		if (bJournalTracking)
+		{
+			JournalLeaves.Append(ModifiedIds);
+		}
+	}
+
+	WriteUnlock(Box);
+}
+
+void FVoxelData::WriteUnlock(const FVoxelBox& Box)
+{
+	FIntVector Min, Max;
+	GetRegionsInBox(Box, Min, Max);
+
+	for (int Z = Min.Z; Z <= Max.Z; Z++)
+	{
+		for (int Y = Min.Y; Y <= Max.Y; Y++)
+		{
+			for (int X = Min.X; X <= Max.X; X++)
+			{
+				RegionLocks[X + RegionCount * Y + RegionCount * RegionCount * Z].WriteUnlock();
+			}
+		}
+	}
+}
+
+void FVoxelData::BeginGet(const FVoxelBox& Box)
+{
+	FIntVector Min, Max;
+	GetRegionsInBox(Box, Min, Max);
+
+	// Always lock in increasing index order to avoid deadlocks
+	for (int Z = Min.Z; Z <= Max.Z; Z++)
+	{
+		for (int Y = Min.Y; Y <= Max.Y; Y++)
+		{
+			for (int X = Min.X; X <= Max.X; X++)
+			{
+				RegionLocks[X + RegionCount * Y + RegionCount * RegionCount * Z].ReadLock();
+			}
+		}
+	}
+}
+
+void FVoxelData::EndGet(const FVoxelBox& Box)
+{
+	FIntVector Min, Max;
+	GetRegionsInBox(Box, Min, Max);
+
+	for (int Z = Min.Z; Z <= Max.Z; Z++)
+	{
+		for (int Y = Min.Y; Y <= Max.Y; Y++)
+		{
+			for (int X = Min.X; X <= Max.X; X++)
+			{
+				RegionLocks[X + RegionCount * Y + RegionCount * RegionCount * Z].ReadUnlock();
+			}
+		}
+	}
+}
+
+void FVoxelData::LockMips(const FVoxelBox& Box)
+{
+	FIntVector Min, Max;
+	GetRegionsInBox(Box, Min, Max);
+
+	// Always lock in increasing index order to avoid deadlocks
+	for (int Z = Min.Z; Z <= Max.Z; Z++)
+	{
+		for (int Y = Min.Y; Y <= Max.Y; Y++)
+		{
+			for (int X = Min.X; X <= Max.X; X++)
+			{
+				RegionMipSections[X + RegionCount * Y + RegionCount * RegionCount * Z].Lock();
+			}
+		}
+	}
+}
+
+void FVoxelData::UnlockMips(const FVoxelBox& Box)
+{
+	FIntVector Min, Max;
+	GetRegionsInBox(Box, Min, Max);
+
+	for (int Z = Min.Z; Z <= Max.Z; Z++)
 	{
-		CanSetEvent->Trigger();
+		for (int Y = Min.Y; Y <= Max.Y; Y++)
+		{
+			for (int X = Min.X; X <= Max.X; X++)
+			{
+				RegionMipSections[X + RegionCount * Y + RegionCount * RegionCount * Z].Unlock();
+			}
+		}
 	}
 }
 
 void FVoxelData::Reset()
 {
-	MainOctree.Reset();
-	MainOctree = MakeShareable( new FValueOctree(WorldGenerator, FIntVector::ZeroValue, Depth, FOctree::GetTopIdFromDepth(Depth), bMultiplayer) );
+	// The nodes above the regions are kept: they may be used by threads waiting for the region locks
+	MainOctree->ResetRegions(RegionDepth);
+	for (auto& Leaves : RegionLeaves)
+	{
+		Leaves.Reset();
+	}
+
+	FScopeLock Lock(&JournalSection);
+	if (bJournalTracking)
+	{
+		// The leaves modified before don't need to be appended
+		JournalLeaves.Empty();
+		bJournalReset = true;
+	}
+}
+
+void FVoxelData::ResetAndGetModifiedBoxes(std::forward_list<FVoxelBox>& OutModifiedBoxes)
+{
+	check(IsInGameThread());
+
+	BeginSet();
+	MainOctree->GetModifiedBoxes(OutModifiedBoxes);
+	Reset();
+	EndSet();
+}
+
+void FVoxelData::ShareIdleLeavesData()
+{
+	const int32 Time = GetTime();
+
+	for (int Z = 0; Z < RegionCount; Z++)
+	{
+		for (int Y = 0; Y < RegionCount; Y++)
+		{
+			for (int X = 0; X < RegionCount; X++)
+			{
+				FRWLock& Lock = RegionLocks[X + RegionCount * Y + RegionCount * RegionCount * Z];
+
+				TArray<TPair<uint64, TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>>> Leaves;
+				Lock.ReadLock();
+				MainOctree->GetIdleUnsharedLeaves(GetRegionBox(X, Y, Z), Time, ShareIdleTime, Leaves);
+				Lock.ReadUnlock();
+
+				if (Leaves.Num() == 0)
+				{
+					continue;
+				}
+
+				// Hashed while the region is available: the datas can't change while referenced here
+				TArray<TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>> SharedDatas;
+				SharedDatas.Reserve(Leaves.Num());
+				for (auto& Leaf : Leaves)
+				{
+					SharedDatas.Add(LeafDataPool->Share(Leaf.Value));
+				}
+
+				Lock.WriteLock();
+				for (int Index = 0; Index < Leaves.Num(); Index++)
+				{
+					// The leaf may have been destroyed by a reset meanwhile
+					const FIntVector LeafMin = FOctree::GetLeafMinimalCornerFromId(Leaves[Index].Key, Depth);
+					FValueOctree* Leaf = FindLeaf(LeafMin.X, LeafMin.Y, LeafMin.Z);
+					if (Leaf->Depth == 0)
+					{
+						Leaf->SetSharedData(Leaves[Index].Value, SharedDatas[Index]);
+					}
+				}
+				Lock.WriteUnlock();
+			}
+		}
+	}
+}
+
+int FVoxelData::PageOutIdleLeaves(float IdleTime)
+{
+	if (!LeafPager)
+	{
+		return 0;
+	}
+
+	const int32 IdleSeconds = FMath::CeilToInt(IdleTime);
+
+	int Count = 0;
+	for (int Z = 0; Z < RegionCount; Z++)
+	{
+		for (int Y = 0; Y < RegionCount; Y++)
+		{
+			for (int X = 0; X < RegionCount; X++)
+			{
+				FRWLock& Lock = RegionLocks[X + RegionCount * Y + RegionCount * RegionCount * Z];
+
+				TArray<TPair<uint64, TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>>> Leaves;
+				Lock.ReadLock();
+				MainOctree->GetIdleLeavesToPageOut(GetRegionBox(X, Y, Z), IdleSeconds, Leaves);
+				Lock.ReadUnlock();
+
+				if (Leaves.Num() == 0)
+				{
+					continue;
+				}
+
+				// Compressed and written while the region is available: the datas can't change while referenced here
+				TArray<FVoxelLeafPage> Pages;
+				Pages.SetNum(Leaves.Num());
+				for (int Index = Leaves.Num() - 1; Index >= 0; Index--)
+				{
+					if (!LeafPager->Write(*Leaves[Index].Value, Pages[Index]))
+					{
+						Leaves.RemoveAtSwap(Index);
+						Pages.RemoveAtSwap(Index);
+					}
+				}
+
+				Lock.WriteLock();
+				for (int Index = 0; Index < Leaves.Num(); Index++)
+				{
+					// The leaf may have been destroyed by a reset meanwhile
+					const FIntVector LeafMin = FOctree::GetLeafMinimalCornerFromId(Leaves[Index].Key, Depth);
+					FValueOctree* Leaf = FindLeaf(LeafMin.X, LeafMin.Y, LeafMin.Z);
+					if (Leaf->Depth == 0 && Leaf->SetPagedOut(Leaves[Index].Value, Pages[Index], IdleSeconds))
+					{
+						Count++;
+					}
+					else
+					{
+						LeafPager->Release(Pages[Index]);
+					}
+				}
+				Lock.WriteUnlock();
+			}
+		}
+	}
+
+	if (Count > 0)
+	{
+		int PageCount;
+		int64 FileSize;
+		LeafPager->GetStats(PageCount, FileSize);
+		UE_LOG(LogVoxel, Verbose, TEXT("Paged out %d leaves. %d leaves paged out in %lld bytes"), Count, PageCount, FileSize);
+	}
+
+	return Count;
+}
+
+TSharedRef<FVoxelDataSnapshot> FVoxelData::CreateSnapshot(const FVoxelBox& Box, int MipDepth)
+{
+	// Nodes above the regions roots are shared between regions and don't have mips
+	const int SnapshotMipDepth = MipDepth <= RegionDepth ? MipDepth : 0;
+	TSharedRef<FVoxelDataSnapshot> Snapshot = MakeShareable(new FVoxelDataSnapshot(WorldGenerator, Box, SnapshotMipDepth));
+
+	BeginGet(Box);
+	if (SnapshotMipDepth > 0)
+	{
+		// Readers build the mips: one at a time per region
+		LockMips(Box);
+		MainOctree->AddLeavesToSnapshot(Box, *Snapshot);
+		UnlockMips(Box);
+	}
+	else
+	{
+		MainOctree->AddLeavesToSnapshot(Box, *Snapshot);
+	}
+	EndGet(Box);
+
+	return Snapshot;
+}
+
+void FVoxelData::CreateOctree()
+{
+	MainOctree = MakeShareable( new FValueOctree(WorldGenerator, FIntVector::ZeroValue, Depth, FOctree::GetTopIdFromDepth(Depth), bMultiplayer, LeafPager, TopBlockPool) );
+	MainOctree->CreateRegions(RegionDepth);
+
+	// The regions roots are leaves until edited
+	for (int X = 0; X < RegionCount; X++)
+	{
+		for (int Y = 0; Y < RegionCount; Y++)
+		{
+			for (int Z = 0; Z < RegionCount; Z++)
+			{
+				const FIntVector RegionMin = GetRegionBox(X, Y, Z).Min;
+				MainOctree->GetLeaf(RegionMin.X, RegionMin.Y, RegionMin.Z)->SetBlockPool(&RegionBlockPools[X + RegionCount * Y + RegionCount * RegionCount * Z]);
+			}
+		}
+	}
+}
+
+void FVoxelData::GetRegionsInBox(const FVoxelBox& Box, FIntVector& OutMin, FIntVector& OutMax) const
+{
+	const FIntVector WorldMin = GetMinimalCornerPosition();
+	const int RegionShift = RegionDepth + 4; // log2(16 << RegionDepth)
+
+	int MinX = Box.Min.X;
+	int MinY = Box.Min.Y;
+	int MinZ = Box.Min.Z;
+	int MaxX = Box.Max.X;
+	int MaxY = Box.Max.Y;
+	int MaxZ = Box.Max.Z;
+	ClampToWorld(MinX, MinY, MinZ);
+	ClampToWorld(MaxX, MaxY, MaxZ);
+
+	OutMin = FIntVector((MinX - WorldMin.X) >> RegionShift, (MinY - WorldMin.Y) >> RegionShift, (MinZ - WorldMin.Z) >> RegionShift);
+	OutMax = FIntVector((MaxX - WorldMin.X) >> RegionShift, (MaxY - WorldMin.Y) >> RegionShift, (MaxZ - WorldMin.Z) >> RegionShift);
+
+	check(0 <= OutMin.GetMin() && OutMax.GetMax() < RegionCount);
+}
+
+int FVoxelData::GetRegionIndex(int X, int Y, int Z) const
+{
+	const FIntVector WorldMin = GetMinimalCornerPosition();
+	const int RegionShift = RegionDepth + 4;
+
+	const int RX = (X - WorldMin.X) >> RegionShift;
+	const int RY = (Y - WorldMin.Y) >> RegionShift;
+	const int RZ = (Z - WorldMin.Z) >> RegionShift;
+	check(0 <= RX && RX < RegionCount && 0 <= RY && RY < RegionCount && 0 <= RZ && RZ < RegionCount);
+
+	return RX + RegionCount * RY + RegionCount * RegionCount * RZ;
+}
+
+FValueOctree* FVoxelData::FindLeaf(int X, int Y, int Z) const
+{
+	FValueOctree* const* Leaf = RegionLeaves[GetRegionIndex(X, Y, Z)].Find(FIntVector(X & ~15, Y & ~15, Z & ~15));
+	return Leaf ? *Leaf : MainOctree->GetLeaf(X, Y, Z);
+}
+
+FValueOctree* FVoxelData::FindOrCreateLeaf(int X, int Y, int Z)
+{
+	const FIntVector LeafMin(X & ~15, Y & ~15, Z & ~15);
+	TMap<FIntVector, FValueOctree*>& Leaves = RegionLeaves[GetRegionIndex(X, Y, Z)];
+
+	FValueOctree** Leaf = Leaves.Find(LeafMin);
+	if (Leaf)
+	{
+		return *Leaf;
+	}
+	return Leaves.Add(LeafMin, MainOctree->CreateLeaf(X, Y, Z));
+}
+
+FVoxelBox FVoxelData::GetWorldBox() const
+{
+	return FVoxelBox(GetMinimalCornerPosition(), GetMaximalCornerPosition() - FIntVector(1, 1, 1));
+}
+
+FVoxelBox FVoxelData::GetRegionBox(int X, int Y, int Z) const
+{
+	const int RegionSize = 16 << RegionDepth;
+	const FIntVector RegionMin = GetMinimalCornerPosition() + FIntVector(X, Y, Z) * RegionSize;
+	return FVoxelBox(RegionMin, RegionMin + FIntVector(RegionSize - 1, RegionSize - 1, RegionSize - 1));
+}
+
+int32 FVoxelData::GetTime() const
+{
+	return (int32)(FPlatformTime::Seconds() - StartTime);
 }
 
 void FVoxelData::GetValuesAndMaterials(float Values[], FVoxelMaterial Materials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& InSize, const FIntVector& ArraySize) const
@@ -128,68 +520,100 @@ void FVoxelData::GetValuesAndMaterials(float Values[], FVoxelMaterial Materials[
 
 float FVoxelData::GetValue(int X, int Y, int Z) const
 {
-	float Values[1];
-	GetValuesAndMaterials(Values, nullptr, FIntVector(X, Y, Z), FIntVector::ZeroValue, 1, FIntVector(1, 1, 1), FIntVector(1, 1, 1));
-	return Values[0];
+	if (UNLIKELY(!IsInWorld(X, Y, Z)))
+	{
+		return WorldGenerator->GetValue(X, Y, Z);
+	}
+
+	float Value;
+	FindLeaf(X, Y, Z)->GetValueAndMaterial(X, Y, Z, &Value, nullptr);
+	return Value;
 }
 
 FVoxelMaterial FVoxelData::GetMaterial(int X, int Y, int Z) const
 {
-	FVoxelMaterial Materials[1];
-	GetValuesAndMaterials(nullptr, Materials, FIntVector(X, Y, Z), FIntVector::ZeroValue, 1, FIntVector(1, 1, 1), FIntVector(1, 1, 1));
-	return Materials[0];
+	if (UNLIKELY(!IsInWorld(X, Y, Z)))
+	{
+		return WorldGenerator->GetMaterial(X, Y, Z);
+	}
+
+	FVoxelMaterial Material;
+	FindLeaf(X, Y, Z)->GetValueAndMaterial(X, Y, Z, nullptr, &Material);
+	return Material;
 }
 
 void FVoxelData::GetValueAndMaterial(int X, int Y, int Z, float& OutValue, FVoxelMaterial& OutMaterial)
 {
-	float Values[1];
-	FVoxelMaterial Materials[1];
-	GetValuesAndMaterials(Values, Materials, FIntVector(X, Y, Z), FIntVector::ZeroValue, 1, FIntVector(1, 1, 1), FIntVector(1, 1, 1));
+	if (UNLIKELY(!IsInWorld(X, Y, Z)))
+	{
+		OutValue = WorldGenerator->GetValue(X, Y, Z);
+		OutMaterial = WorldGenerator->GetMaterial(X, Y, Z);
+		return;
+	}
 
-	OutValue = Values[0];
-	OutMaterial = Materials[0];
+	FindLeaf(X, Y, Z)->GetValueAndMaterial(X, Y, Z, &OutValue, &OutMaterial);
 }
 
 void FVoxelData::SetValue(int X, int Y, int Z, float Value)
 {
 	check(IsInWorld(X, Y, Z));
-	MainOctree->GetLeaf(X, Y, Z)->SetValueAndMaterial(X, Y, Z, Value, FVoxelMaterial(), true, false);
+	FindOrCreateLeaf(X, Y, Z)->SetValueAndMaterial(X, Y, Z, Value, FVoxelMaterial(), true, false, bRecordNetworkDiffs);
 }
 
 void FVoxelData::SetValue(int X, int Y, int Z, float Value, FValueOctree*& LastOctree)
 {
 	check(IsInWorld(X, Y, Z));
-	if (UNLIKELY(!LastOctree || !LastOctree->IsLeaf() || !LastOctree->IsInOctree(X, Y, Z)))
+	if (UNLIKELY(!LastOctree || !LastOctree->IsInOctree(X, Y, Z)))
 	{
-		LastOctree = MainOctree->GetLeaf(X, Y, Z);
+		LastOctree = FindOrCreateLeaf(X, Y, Z);
 	}
-	LastOctree->SetValueAndMaterial(X, Y, Z, Value, FVoxelMaterial(), true, false);
+	LastOctree->SetValueAndMaterial(X, Y, Z, Value, FVoxelMaterial(), true, false, bRecordNetworkDiffs);
 }
 
 void FVoxelData::SetMaterial(int X, int Y, int Z, FVoxelMaterial Material)
 {
 	check(IsInWorld(X, Y, Z));
-	MainOctree->GetLeaf(X, Y, Z)->SetValueAndMaterial(X, Y, Z, 0, Material, false, true);
+	FindOrCreateLeaf(X, Y, Z)->SetValueAndMaterial(X, Y, Z, 0, Material, false, true, bRecordNetworkDiffs);
 }
 
 void FVoxelData::SetMaterial(int X, int Y, int Z, FVoxelMaterial Material, FValueOctree*& LastOctree)
 {
 	check(IsInWorld(X, Y, Z));
-	if (UNLIKELY(!LastOctree || !LastOctree->IsLeaf() || !LastOctree->IsInOctree(X, Y, Z)))
+	if (UNLIKELY(!LastOctree || !LastOctree->IsInOctree(X, Y, Z)))
 	{
-		LastOctree = MainOctree->GetLeaf(X, Y, Z);
+		LastOctree = FindOrCreateLeaf(X, Y, Z);
 	}
-	LastOctree->SetValueAndMaterial(X, Y, Z, 0, Material, false, true);
+	LastOctree->SetValueAndMaterial(X, Y, Z, 0, Material, false, true, bRecordNetworkDiffs);
 }
 
 void FVoxelData::SetValueAndMaterial(int X, int Y, int Z, float Value, FVoxelMaterial Material, FValueOctree*& LastOctree)
 {
 	check(IsInWorld(X, Y, Z));
-	if (UNLIKELY(!LastOctree || !LastOctree->IsLeaf() || !LastOctree->IsInOctree(X, Y, Z)))
+	if (UNLIKELY(!LastOctree || !LastOctree->IsInOctree(X, Y, Z)))
+	{
+		LastOctree = FindOrCreateLeaf(X, Y, Z);
+	}
+	LastOctree->SetValueAndMaterial(X, Y, Z, Value, Material, true, true, bRecordNetworkDiffs);
+}
+
+void FVoxelData::SetLeafValuesAndMaterials(const FIntVector& LeafMin, const TArray<FVoxelLeafEdit>& Edits, bool bMarkNetworkDirty)
+{
+	check(IsInWorld(LeafMin.X, LeafMin.Y, LeafMin.Z));
+	FindOrCreateLeaf(LeafMin.X, LeafMin.Y, LeafMin.Z)->SetValuesAndMaterials(Edits, bMarkNetworkDirty && bRecordNetworkDiffs);
+}
+
+void FVoxelData::SetRecordNetworkDiffs(bool bRecord)
+{
+	bRecordNetworkDiffs = bRecord;
+	if (!bRecord)
 	{
-		LastOctree = MainOctree->GetLeaf(X, Y, Z);
+		BeginGet();
+		{
+			FScopeLock Lock(&NetworkSection);
+			MainOctree->ClearNetworkData();
+		}
+		EndGet();
 	}
-	LastOctree->SetValueAndMaterial(X, Y, Z, Value, Material, true, true);
 }
 
 bool FVoxelData::IsInWorld(int X, int Y, int Z) const
@@ -208,40 +632,183 @@ FORCEINLINE void FVoxelData::ClampToWorld(int& X, int& Y, int& Z) const
 	Z = FMath::Clamp(Z, -S, S - 1);
 }
 
+void FVoxelData::StartJournalTracking()
+{
+	FScopeLock Lock(&JournalSection);
+	bJournalTracking = true;
+	bJournalReset = false;
+	JournalLeaves.Empty();
+}
+
+bool FVoxelData::AppendToJournal(FVoxelSaveJournal& Journal)
+{
+	TSet<uint64> Leaves;
+	bool bReset;
+	{
+		FScopeLock Lock(&JournalSection);
+		check(bJournalTracking);
+		Leaves = MoveTemp(JournalLeaves);
+		JournalLeaves.Empty();
+		bReset = bJournalReset;
+		bJournalReset = false;
+	}
+
+	if (bReset && !Journal.AppendReset())
+	{
+		FScopeLock Lock(&JournalSection);
+		JournalLeaves.Append(Leaves);
+		bJournalReset = true;
+		return false;
+	}
+
+	const bool bAllowResidual = Journal.GetVersion() >= EVoxelSaveVersion::GeneratorResiduals;
+
+	// Read the leaves one by one: edits elsewhere are never blocked. A leaf modified after being read is appended next time
+	TArray<FVoxelChunkSave> Chunks;
+	Chunks.Reserve(Leaves.Num());
+	for (uint64 Id : Leaves)
+	{
+		const FIntVector LeafMin = FOctree::GetLeafMinimalCornerFromId(Id, Depth);
+		const FVoxelBox LeafBox(LeafMin, LeafMin + FIntVector(15, 15, 15));
+
+		BeginGet(LeafBox);
+		FValueOctree* Leaf = FindLeaf(LeafMin.X, LeafMin.Y, LeafMin.Z);
+		if (Leaf->Depth == 0 && Leaf->IsDirty())
+		{
+			Chunks.Add(Leaf->CreateChunkSave(bAllowResidual));
+		}
+		else
+		{
+			float Values[16 * 16 * 16];
+			FVoxelMaterial Materials[16 * 16 * 16];
+			GetValuesAndMaterials(Values, Materials, LeafMin, FIntVector::ZeroValue, 1, FIntVector(16, 16, 16), FIntVector(16, 16, 16));
+			Chunks.Emplace(Id, LeafMin, Values, Materials);
+		}
+		EndGet(LeafBox);
+	}
+
+	if (!Journal.AppendChunks(Chunks))
+	{
+		FScopeLock Lock(&JournalSection);
+		JournalLeaves.Append(Leaves);
+		return false;
+	}
+
+	return true;
+}
+
 void FVoxelData::GetSave(FVoxelWorldSave& OutSave)
 {
 	BeginGet();
-	std::list<TSharedRef<FVoxelChunkSave>> SaveList;
-	MainOctree->AddDirtyChunksToSaveList(SaveList);
-	OutSave.Init(Depth, SaveList);
+	TArray<FVoxelChunkSave> SaveList;
+	TMap<const FVoxelLeafData*, uint64> SavedDatas;
+	MainOctree->AddDirtyChunksToSaveList(SaveList, SavedDatas);
 	EndGet();
+
+	// The chunks are copies: compress them without blocking the edits
+	OutSave.Init(Depth, SaveList);
 }
 
-void FVoxelData::LoadFromSaveAndGetModifiedPositions(FVoxelWorldSave& Save, std::forward_list<FIntVector>& OutModifiedPositions, bool bReset)
+void FVoxelData::LoadFromSaveAndGetModifiedBoxes(FVoxelWorldSave& Save, std::forward_list<FVoxelBox>& OutModifiedBoxes, bool bReset)
 {
+	// Decompressed before locking
+	const auto SaveList = Save.GetChunksList();
+
+	check(!bReset || IsInGameThread());
+
 	BeginSet();
 	if (bReset)
 	{
-		MainOctree->GetDirtyChunksPositions(OutModifiedPositions);
+		MainOctree->GetModifiedBoxes(OutModifiedBoxes);
 		Reset();
 	}
 
-	auto SaveList = Save.GetChunksList();
-	MainOctree->LoadFromSaveAndGetModifiedPositions(SaveList, OutModifiedPositions);
-	check(SaveList.empty());
+	LoadChunksAndGetModifiedBoxes(SaveList, OutModifiedBoxes);
 	EndSet();
 }
 
-void FVoxelData::GetDiffLists(std::forward_list<FVoxelValueDiff>& OutValueDiffList, std::forward_list<FVoxelMaterialDiff>& OutMaterialDiffList)
+void FVoxelData::LoadBoxFromSaveAndGetModifiedBoxes(FVoxelWorldSave& Save, const FVoxelBox& Box, std::forward_list<FVoxelBox>& OutModifiedBoxes)
 {
-	BeginGet();
-	MainOctree->AddChunksToDiffLists(OutValueDiffList, OutMaterialDiffList);
-	EndGet();
+	// Whole chunks are loaded
+	const FVoxelBox ChunksBox(
+		FIntVector(Box.Min.X & ~15, Box.Min.Y & ~15, Box.Min.Z & ~15),
+		FIntVector(Box.Max.X | 15, Box.Max.Y | 15, Box.Max.Z | 15));
+
+	// Decompressed before locking
+	const auto SaveList = Save.GetChunksListInBox(Box);
+
+	BeginSet(ChunksBox);
+	LoadChunksAndGetModifiedBoxes(SaveList, OutModifiedBoxes);
+	EndSet(ChunksBox);
 }
 
-void FVoxelData::LoadFromDiffListsAndGetModifiedPositions(std::forward_list<FVoxelValueDiff> ValueDiffList, std::forward_list<FVoxelMaterialDiff> MaterialDiffList, std::forward_list<FIntVector>& OutModifiedPositions)
+void FVoxelData::LoadChunksAndGetModifiedBoxes(const TArray<FVoxelChunkSave>& SaveList, std::forward_list<FVoxelBox>& OutModifiedBoxes)
 {
+	// Sorted by Id so that each node finds the chunks of its childs with binary searches. The chunks themselves are not moved
+	TArray<const FVoxelChunkSave*> Chunks;
+	Chunks.Reserve(SaveList.Num());
+	for (auto& Chunk : SaveList)
+	{
+		if (FOctree::IsInSubtree(MainOctree->Id, Chunk.Id, Depth))
+		{
+			Chunks.Add(&Chunk);
+		}
+		else
+		{
+			UE_LOG(LogVoxel, Error, TEXT("LoadFromSave: Invalid chunk Id %llu"), Chunk.Id);
+		}
+	}
+	Chunks.StableSort([](const FVoxelChunkSave& A, const FVoxelChunkSave& B) { return A.Id < B.Id; });
+
+	MainOctree->LoadFromSaveAndGetModifiedBoxes(Chunks, 0, Chunks.Num(), OutModifiedBoxes);
+}
+
+void FVoxelData::GetDiffs(TArray<FVoxelLeafDiff>& OutDiffs)
+{
+	// One region at a time, for reading only: edits elsewhere and reads are never blocked
+	for (int Z = 0; Z < RegionCount; Z++)
+	{
+		for (int Y = 0; Y < RegionCount; Y++)
+		{
+			for (int X = 0; X < RegionCount; X++)
+			{
+				const FVoxelBox RegionBox = GetRegionBox(X, Y, Z);
+				BeginGet(RegionBox);
+				GetDiffsInBox(RegionBox, OutDiffs);
+				EndGet(RegionBox);
+			}
+		}
+	}
+
+	// The regions are not in Id order
+	OutDiffs.Sort([](const FVoxelLeafDiff& A, const FVoxelLeafDiff& B) { return A.Id < B.Id; });
+}
+
+void FVoxelData::GetDiffsInBox(const FVoxelBox& Box, TArray<FVoxelLeafDiff>& OutDiffs)
+{
+	// The network dirty data are only modified under write locks, and cleared under this section
+	FScopeLock Lock(&NetworkSection);
+	MainOctree->AddChunksToDiffs(Box, OutDiffs);
+}
+
+void FVoxelData::LoadFromDiffsAndGetModifiedBoxes(TArray<FVoxelLeafDiff> Diffs, std::forward_list<FVoxelBox>& OutModifiedBoxes)
+{
+	// Sorted by Id so that each node finds the diffs of its childs with binary searches. Stable: diffs of the same leaf are applied in order
+	const uint64 RootId = MainOctree->Id;
+	const int WorldDepth = Depth;
+
+	Diffs.RemoveAll([&](const FVoxelLeafDiff& Diff)
+	{
+		if (!FOctree::IsInSubtree(RootId, Diff.Id, WorldDepth))
+		{
+			UE_LOG(LogVoxel, Error, TEXT("LoadFromDiffs: Invalid leaf diff Id %llu"), Diff.Id);
+			return true;
+		}
+		return false;
+	});
+	Diffs.StableSort([](const FVoxelLeafDiff& A, const FVoxelLeafDiff& B) { return A.Id < B.Id; });
+
 	BeginSet();
-	MainOctree->LoadFromDiffListsAndGetModifiedPositions(ValueDiffList, MaterialDiffList, OutModifiedPositions);
+	MainOctree->LoadFromDiffsAndGetModifiedBoxes(Diffs, 0, Diffs.Num(), OutModifiedBoxes);
 	EndSet();
 }
@@ -0,0 +1,152 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelDataSnapshot.h"
+#include "VoxelLeafData.h"
+#include "VoxelWorldGenerator.h"
+
+FVoxelDataSnapshot::FVoxelDataSnapshot(UVoxelWorldGenerator* WorldGenerator, const FVoxelBox& Bounds, int MipDepth)
+	: WorldGenerator(WorldGenerator)
+	, Bounds(Bounds)
+	, MipDepth(MipDepth)
+{
+
+}
+
+void FVoxelDataSnapshot::AddLeaf(const FIntVector& LeafMin, const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& LeafData)
+{
+	check(LeafData.IsValid());
+	Leaves.Add(LeafMin, LeafData);
+}
+
+void FVoxelDataSnapshot::AddMip(const FIntVector& NodeMin, const TSharedPtr<FVoxelMipData, ESPMode::ThreadSafe>& MipData)
+{
+	check(MipData.IsValid());
+	Mips.Add(NodeMin, MipData);
+}
+
+int FVoxelDataSnapshot::GetMipDepth() const
+{
+	return MipDepth;
+}
+
+void FVoxelDataSnapshot::GetValuesAndMaterials(float Values[], FVoxelMaterial Materials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const
+{
+	if (Size.X <= 0 || Size.Y <= 0 || Size.Z <= 0)
+	{
+		return;
+	}
+	check(Bounds.IsInside(Start.X, Start.Y, Start.Z));
+	check(Bounds.IsInside(Start.X + (Size.X - 1) * Step, Start.Y + (Size.Y - 1) * Step, Start.Z + (Size.Z - 1) * Step));
+
+	WorldGenerator->GetValuesAndMaterials(Values, Materials, Start, StartIndex, Step, Size, ArraySize);
+
+	// Mips can be used if all the positions are on their samples
+	const int MipStep = 1 << MipDepth;
+	const int MipSize = 16 << MipDepth;
+	const bool bUseMips = Mips.Num() > 0 && Step % MipStep == 0 && (Start.X & (MipStep - 1)) == 0 && (Start.Y & (MipStep - 1)) == 0 && (Start.Z & (MipStep - 1)) == 0;
+
+	if (bUseMips)
+	{
+		for (auto& It : Mips)
+		{
+			const FIntVector& NodeMin = It.Key;
+
+			int MinI, MaxI, MinJ, MaxJ, MinK, MaxK;
+			GetIndicesInRange(Start.X, Step, Size.X, NodeMin.X, NodeMin.X + MipSize - 1, MinI, MaxI);
+			GetIndicesInRange(Start.Y, Step, Size.Y, NodeMin.Y, NodeMin.Y + MipSize - 1, MinJ, MaxJ);
+			GetIndicesInRange(Start.Z, Step, Size.Z, NodeMin.Z, NodeMin.Z + MipSize - 1, MinK, MaxK);
+
+			if (MinI <= MaxI && MinJ <= MaxJ && MinK <= MaxK)
+			{
+				It.Value->GetValuesAndMaterials(NodeMin, MipStep, Values, Materials,
+					Start + FIntVector(MinI, MinJ, MinK) * Step,
+					StartIndex + FIntVector(MinI, MinJ, MinK),
+					Step,
+					FIntVector(MaxI - MinI + 1, MaxJ - MinJ + 1, MaxK - MinK + 1),
+					ArraySize);
+			}
+		}
+	}
+
+	// Overwrite with the modified values
+	for (auto& It : Leaves)
+	{
+		const FIntVector& LeafMin = It.Key;
+		const FVoxelLeafData& LeafData = *It.Value;
+
+		if (bUseMips && Mips.Contains(FIntVector(LeafMin.X & ~(MipSize - 1), LeafMin.Y & ~(MipSize - 1), LeafMin.Z & ~(MipSize - 1))))
+		{
+			// Already read from the mip
+			continue;
+		}
+
+		int MinI, MaxI, MinJ, MaxJ, MinK, MaxK;
+		GetIndicesInRange(Start.X, Step, Size.X, LeafMin.X, LeafMin.X + 15, MinI, MaxI);
+		GetIndicesInRange(Start.Y, Step, Size.Y, LeafMin.Y, LeafMin.Y + 15, MinJ, MaxJ);
+		GetIndicesInRange(Start.Z, Step, Size.Z, LeafMin.Z, LeafMin.Z + 15, MinK, MaxK);
+
+		if (MinI <= MaxI && MinJ <= MaxJ && MinK <= MaxK)
+		{
+			LeafData.GetValuesAndMaterials(LeafMin, Values, Materials,
+				Start + FIntVector(MinI, MinJ, MinK) * Step,
+				StartIndex + FIntVector(MinI, MinJ, MinK),
+				Step,
+				FIntVector(MaxI - MinI + 1, MaxJ - MinJ + 1, MaxK - MinK + 1),
+				ArraySize);
+		}
+	}
+}
+
+void FVoxelDataSnapshot::GetValueAndMaterial(int X, int Y, int Z, float& OutValue, FVoxelMaterial& OutMaterial) const
+{
+	check(Bounds.IsInside(X, Y, Z));
+
+	// Leaves are 16-aligned
+	const FIntVector LeafMin(X & ~15, Y & ~15, Z & ~15);
+	const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>* LeafData = Leaves.Find(LeafMin);
+
+	const int LocalIndex = (X - LeafMin.X) + 16 * (Y - LeafMin.Y) + 16 * 16 * (Z - LeafMin.Z);
+
+	if (LeafData && (*LeafData)->HasValue(LocalIndex))
+	{
+		OutValue = (*LeafData)->GetValue(LocalIndex);
+	}
+	else
+	{
+		OutValue = WorldGenerator->GetValue(X, Y, Z);
+	}
+	if (LeafData && (*LeafData)->HasMaterial(LocalIndex))
+	{
+		OutMaterial = (*LeafData)->GetMaterial(LocalIndex);
+	}
+	else
+	{
+		OutMaterial = WorldGenerator->GetMaterial(X, Y, Z);
+	}
+}
+
+bool FVoxelDataSnapshot::GetValueRange(const FVoxelBox& Box, float& OutMin, float& OutMax) const
+{
+	if (!WorldGenerator->GetValueRange(Box, OutMin, OutMax))
+	{
+		return false;
+	}
+
+	for (auto& It : Leaves)
+	{
+		const FIntVector& LeafMin = It.Key;
+
+		float LeafMinValue, LeafMaxValue;
+		if (Box.Intersect(FVoxelBox(LeafMin, LeafMin + FIntVector(15, 15, 15))) && It.Value->GetValueRange(LeafMinValue, LeafMaxValue))
+		{
+			OutMin = FMath::Min(OutMin, LeafMinValue);
+			OutMax = FMath::Max(OutMax, LeafMaxValue);
+		}
+	}
+	return true;
+}
+
+const FVoxelBox& FVoxelDataSnapshot::GetBounds() const
+{
+	return Bounds;
+}
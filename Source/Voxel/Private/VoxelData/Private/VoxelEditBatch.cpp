@@ -0,0 +1,114 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelEditBatch.h"
+#include "VoxelData.h"
+
+FVoxelEditBatch::FVoxelEditBatch(FVoxelData* Data, bool bMarkNetworkDirty)
+	: Data(Data)
+	, bMarkNetworkDirty(bMarkNetworkDirty)
+{
+
+}
+
+void FVoxelEditBatch::SetValue(int X, int Y, int Z, float Value)
+{
+	AddEdit(X, Y, Z, true, false, Value, FVoxelMaterial());
+}
+
+void FVoxelEditBatch::SetMaterial(int X, int Y, int Z, const FVoxelMaterial& Material)
+{
+	AddEdit(X, Y, Z, false, true, 0, Material);
+}
+
+void FVoxelEditBatch::SetValueAndMaterial(int X, int Y, int Z, float Value, const FVoxelMaterial& Material)
+{
+	AddEdit(X, Y, Z, true, true, Value, Material);
+}
+
+int FVoxelEditBatch::Num() const
+{
+	return Edits.Num();
+}
+
+void FVoxelEditBatch::Apply(TArray<FVoxelBox>& OutModifiedBoxes)
+{
+	ApplyImpl(true, OutModifiedBoxes);
+}
+
+void FVoxelEditBatch::ApplyLocked(TArray<FVoxelBox>& OutModifiedBoxes)
+{
+	ApplyImpl(false, OutModifiedBoxes);
+}
+
+void FVoxelEditBatch::ApplyImpl(bool bLock, TArray<FVoxelBox>& OutModifiedBoxes)
+{
+	// Group by leaf. Stable: edits of the same voxel stay in order
+	Edits.StableSort([](const FEdit& A, const FEdit& B)
+	{
+		if (A.LeafMin.Z != B.LeafMin.Z)
+		{
+			return A.LeafMin.Z < B.LeafMin.Z;
+		}
+		if (A.LeafMin.Y != B.LeafMin.Y)
+		{
+			return A.LeafMin.Y < B.LeafMin.Y;
+		}
+		if (A.LeafMin.X != B.LeafMin.X)
+		{
+			return A.LeafMin.X < B.LeafMin.X;
+		}
+		return A.Edit.Index < B.Edit.Index;
+	});
+
+	TArray<FVoxelLeafEdit> LeafEdits;
+	int Start = 0;
+	while (Start < Edits.Num())
+	{
+		const FIntVector LeafMin = Edits[Start].LeafMin;
+
+		LeafEdits.Reset();
+		FIntVector EditsMin(15, 15, 15);
+		FIntVector EditsMax(0, 0, 0);
+		int End = Start;
+		while (End < Edits.Num() && Edits[End].LeafMin == LeafMin)
+		{
+			const FVoxelLeafEdit& Edit = Edits[End].Edit;
+			LeafEdits.Add(Edit);
+
+			const FIntVector Local(Edit.Index & 15, (Edit.Index >> 4) & 15, Edit.Index >> 8);
+			EditsMin = FIntVector(FMath::Min(EditsMin.X, Local.X), FMath::Min(EditsMin.Y, Local.Y), FMath::Min(EditsMin.Z, Local.Z));
+			EditsMax = FIntVector(FMath::Max(EditsMax.X, Local.X), FMath::Max(EditsMax.Y, Local.Y), FMath::Max(EditsMax.Z, Local.Z));
+			End++;
+		}
+
+		if (bLock)
+		{
+			const FVoxelBox LeafBox(LeafMin, LeafMin + FIntVector(15, 15, 15));
+			Data->BeginSet(LeafBox);
+			Data->SetLeafValuesAndMaterials(LeafMin, LeafEdits, bMarkNetworkDirty);
+			Data->EndSet(LeafBox);
+		}
+		else
+		{
+			Data->SetLeafValuesAndMaterials(LeafMin, LeafEdits, bMarkNetworkDirty);
+		}
+
+		OutModifiedBoxes.Emplace(LeafMin + EditsMin, LeafMin + EditsMax);
+		Start = End;
+	}
+
+	Edits.Reset();
+}
+
+void FVoxelEditBatch::AddEdit(int X, int Y, int Z, bool bSetValue, bool bSetMaterial, float Value, const FVoxelMaterial& Material)
+{
+	check(Data->IsInWorld(X, Y, Z));
+
+	FEdit& Edit = Edits[Edits.AddUninitialized()];
+	Edit.LeafMin = FIntVector(X & ~15, Y & ~15, Z & ~15);
+	Edit.Edit.Index = (X & 15) + 16 * (Y & 15) + 16 * 16 * (Z & 15);
+	Edit.Edit.bSetValue = bSetValue;
+	Edit.Edit.bSetMaterial = bSetMaterial;
+	Edit.Edit.Value = Value;
+	Edit.Edit.Material = Material;
+}
@@ -0,0 +1,183 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelPrivate.h"
+#include "VoxelEditLog.h"
+#include "VoxelData.h"
+#include "VoxelSave.h"
+#include "VoxelToolOperation.h"
+#include "MemoryWriter.h"
+
+// Diffs entries are split once larger, so that the log can be split in several messages
+#define VOXEL_EDIT_LOG_MAX_ENTRY_SIZE (1024 * 1024)
+
+FVoxelEditLog::FVoxelEditLog()
+{
+
+}
+
+void FVoxelEditLog::ApplyAndLogOperation(FVoxelData* Data, const FVoxelToolOperation& Operation)
+{
+	// Locked until the operation is applied: the voxels sent are the ones it reads
+	const FVoxelBox Box = Operation.GetBox();
+	Data->BeginSet(Box);
+
+	// The clients must have the voxels read by the operation before replaying it
+	TArray<FVoxelLeafDiff> Diffs;
+	Data->GetDiffsInBox(Box, Diffs);
+	LogDiffs(Diffs);
+
+	EntryOffsets.Add(Entries.Num());
+	FMemoryWriter Writer(Entries, false, true);
+	uint8 Type = EVoxelEditLogEntry::Operation;
+	FVoxelToolOperation LoggedOperation = Operation;
+	Writer << Type;
+	Writer << LoggedOperation;
+
+	Operation.ApplyLocked(Data, false);
+	Data->EndSet(Box);
+}
+
+void FVoxelEditLog::Flush(FVoxelData* Data, TArray<TArray<uint8>>& OutMessages, int32 MaxMessageSize)
+{
+	TArray<FVoxelLeafDiff> Diffs;
+	Data->GetDiffs(Diffs);
+	LogDiffs(Diffs);
+
+	// Values are sent in the storage format
+	int ValueBits = VOXEL_VALUE_BITS;
+	const int32 HeaderSize = sizeof(ValueBits) + sizeof(int);
+	auto GetEntryEnd = [&](int Entry) { return Entry + 1 < EntryOffsets.Num() ? EntryOffsets[Entry + 1] : Entries.Num(); };
+
+	// Each message can be replayed alone. Sent even if empty
+	int Begin = 0;
+	do
+	{
+		const int32 BeginOffset = Begin < EntryOffsets.Num() ? EntryOffsets[Begin] : Entries.Num();
+		int End = FMath::Min(Begin + 1, EntryOffsets.Num());
+		while (End < EntryOffsets.Num() && HeaderSize + GetEntryEnd(End) - BeginOffset <= MaxMessageSize)
+		{
+			End++;
+		}
+		const int32 EndOffset = End > 0 ? GetEntryEnd(End - 1) : Entries.Num();
+
+		TArray<uint8>& Message = OutMessages[OutMessages.AddDefaulted()];
+		FMemoryWriter Writer(Message);
+		int Count = End - Begin;
+		Writer << ValueBits;
+		Writer << Count;
+		Writer.Serialize(Entries.GetData() + BeginOffset, EndOffset - BeginOffset);
+
+		Begin = End;
+	} while (Begin < EntryOffsets.Num());
+
+	Entries.Reset();
+	EntryOffsets.Reset();
+}
+
+bool FVoxelEditLog::Replay(FVoxelData* Data, FArchive& Ar, std::forward_list<FVoxelBox>& OutModifiedBoxes)
+{
+	int ValueBits = 0;
+	int Count = 0;
+	Ar << ValueBits;
+	Ar << Count;
+	if (ValueBits != VOXEL_VALUE_BITS)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Sync: Current VOXEL_VALUE_BITS is %d while server one is %d"), VOXEL_VALUE_BITS, ValueBits);
+		return false;
+	}
+
+	const FVoxelBox WorldBox(Data->GetMinimalCornerPosition(), Data->GetMaximalCornerPosition() - FIntVector(1, 1, 1));
+
+	for (int Entry = 0; Entry < Count && !Ar.AtEnd(); Entry++)
+	{
+		uint8 Type = 0;
+		Ar << Type;
+
+		if (Type == EVoxelEditLogEntry::Diffs)
+		{
+			int DiffCount = 0;
+			Ar << DiffCount;
+
+			// The count comes from the network: don't trust it for the allocation. A diff is at least 3 bytes
+			TArray<FVoxelLeafDiff> Diffs;
+			Diffs.Reserve(FMath::Clamp<int64>(DiffCount, 0, (Ar.TotalSize() - Ar.Tell()) / 3));
+
+			uint64 PreviousId = 0;
+			for (int i = 0; i < DiffCount && !Ar.AtEnd(); i++)
+			{
+				FVoxelLeafDiff Diff;
+				SerializeVoxelLeafDiff(Ar, Diff, PreviousId);
+				if (Ar.IsError())
+				{
+					break;
+				}
+				PreviousId = Diff.Id;
+				Diffs.Add(MoveTemp(Diff));
+			}
+
+			// Apply the valid part: the next entries are dropped anyway
+			Data->LoadFromDiffsAndGetModifiedBoxes(MoveTemp(Diffs), OutModifiedBoxes);
+		}
+		else if (Type == EVoxelEditLogEntry::Operation)
+		{
+			FVoxelToolOperation Operation;
+			Ar << Operation;
+			if (!Ar.IsError() && !Operation.IsValid(Data))
+			{
+				Ar.SetError();
+			}
+			if (!Ar.IsError() && WorldBox.Intersect(Operation.GetBox()))
+			{
+				Operation.Apply(Data, false);
+				OutModifiedBoxes.push_front(Operation.GetBox());
+			}
+		}
+		else
+		{
+			Ar.SetError();
+		}
+
+		if (Ar.IsError())
+		{
+			UE_LOG(LogVoxel, Error, TEXT("Sync: Invalid edit log entry. Ignoring the rest of the packet"));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void FVoxelEditLog::LogDiffs(TArray<FVoxelLeafDiff>& Diffs)
+{
+	if (Diffs.Num() == 0)
+	{
+		return;
+	}
+
+	int Begin = 0;
+	while (Begin < Diffs.Num())
+	{
+		TArray<uint8> DiffsData;
+		FMemoryWriter DiffsWriter(DiffsData);
+
+		// Sorted by increasing Id: each diff stores the delta from the previous Id. Each entry starts from 0 so that it can be replayed alone
+		uint64 PreviousId = 0;
+		int End = Begin;
+		while (End < Diffs.Num() && DiffsData.Num() < VOXEL_EDIT_LOG_MAX_ENTRY_SIZE)
+		{
+			SerializeVoxelLeafDiff(DiffsWriter, Diffs[End], PreviousId);
+			PreviousId = Diffs[End].Id;
+			End++;
+		}
+
+		EntryOffsets.Add(Entries.Num());
+		FMemoryWriter Writer(Entries, false, true);
+		uint8 Type = EVoxelEditLogEntry::Diffs;
+		int DiffCount = End - Begin;
+		Writer << Type;
+		Writer << DiffCount;
+		Writer.Serialize(DiffsData.GetData(), DiffsData.Num());
+
+		Begin = End;
+	}
+}
@@ -0,0 +1,604 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelLeafData.h"
+#include "VoxelWorldGenerator.h"
+
+FORCEINLINE int CountBits(uint32 Bits)
+{
+	Bits = Bits - ((Bits >> 1) & 0x55555555);
+	Bits = (Bits & 0x33333333) + ((Bits >> 2) & 0x33333333);
+	return (((Bits + (Bits >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+/**
+ * Position of Index in the sparse array
+ */
+FORCEINLINE int GetSparseRank(const uint32 Mask[128], const uint16 Ranks[128], int Index)
+{
+	return Ranks[Index / 32] + CountBits(Mask[Index / 32] & ((1u << (Index % 32)) - 1));
+}
+
+template<typename T>
+FORCEINLINE void SetSparse(uint32 Mask[128], uint16 Ranks[128], TArray<T>& Array, int Index, const T& Value)
+{
+	const int Rank = GetSparseRank(Mask, Ranks, Index);
+	const uint32 Bit = 1u << (Index % 32);
+
+	if (Mask[Index / 32] & Bit)
+	{
+		Array[Rank] = Value;
+	}
+	else
+	{
+		Mask[Index / 32] |= Bit;
+		Array.Insert(Value, Rank);
+		for (int Word = Index / 32 + 1; Word < 128; Word++)
+		{
+			Ranks[Word]++;
+		}
+	}
+}
+
+/**
+ * Call Callback(I, Value) for each stored voxel of the row, at LocalX + I * Step for I in [0, Count)
+ * A row of 16 voxels is half a mask word, so only the set bits are visited and the rank is computed once
+ */
+template<typename T, typename F>
+FORCEINLINE void GetSparseRow(const uint32 Mask[128], const uint16 Ranks[128], const T* Array, int RowIndex, int LocalX, int Step, int Count, F Callback)
+{
+	const int Word = RowIndex / 32;
+	const int Shift = RowIndex % 32;
+	uint32 RowBits = (Mask[Word] >> Shift) & 0xFFFF;
+	if (RowBits == 0)
+	{
+		return;
+	}
+
+	const int RowRank = Ranks[Word] + CountBits(Mask[Word] & ((1u << Shift) - 1));
+	const int EndX = LocalX + (Count - 1) * Step;
+
+	int Rank = RowRank;
+	while (RowBits)
+	{
+		const int X = FMath::CountTrailingZeros(RowBits);
+		RowBits &= RowBits - 1;
+
+		if (X > EndX)
+		{
+			break;
+		}
+		if (X >= LocalX && (X - LocalX) % Step == 0)
+		{
+			Callback((X - LocalX) / Step, Array[Rank]);
+		}
+		Rank++;
+	}
+}
+
+template<typename T>
+FORCEINLINE uint32 GetArrayHash(const TArray<T>& Array, uint32 Crc)
+{
+	return FCrc::MemCrc32(Array.GetData(), Array.Num() * sizeof(T), Crc);
+}
+
+/**
+ * Bitwise comparison, consistent with GetArrayHash
+ */
+template<typename T>
+FORCEINLINE bool AreArraysIdentical(const TArray<T>& A, const TArray<T>& B)
+{
+	return A.Num() == B.Num() && FMemory::Memcmp(A.GetData(), B.GetData(), A.Num() * sizeof(T)) == 0;
+}
+
+FVoxelMaterialPalette::FVoxelMaterialPalette()
+	: BitsPerIndex(0)
+{
+	Palette.Add(FVoxelMaterial());
+}
+
+void FVoxelMaterialPalette::Init(const FVoxelMaterial Materials[])
+{
+	Palette.Reset();
+	Indices.Empty();
+	RawMaterials.Empty();
+	BitsPerIndex = 0;
+
+	for (int Index = 0; Index < 16 * 16 * 16; Index++)
+	{
+		Palette.AddUnique(Materials[Index]);
+		if (Palette.Num() > 16)
+		{
+			BitsPerIndex = 8;
+			Palette.Empty();
+			RawMaterials.Append(Materials, 16 * 16 * 16);
+			return;
+		}
+	}
+
+	BitsPerIndex = Palette.Num() <= 1 ? 0 : Palette.Num() <= 2 ? 1 : Palette.Num() <= 4 ? 2 : 4;
+	Indices.SetNumZeroed(16 * 16 * 16 * BitsPerIndex / 32);
+
+	if (BitsPerIndex > 0)
+	{
+		for (int Index = 0; Index < 16 * 16 * 16; Index++)
+		{
+			SetIndex(Index, Palette.Find(Materials[Index]));
+		}
+	}
+}
+
+FVoxelMaterial FVoxelMaterialPalette::Get(int Index) const
+{
+	check(0 <= Index && Index < 16 * 16 * 16);
+	return BitsPerIndex == 8 ? RawMaterials[Index] : Palette[GetIndex(Index)];
+}
+
+void FVoxelMaterialPalette::Set(int Index, const FVoxelMaterial& Material)
+{
+	check(0 <= Index && Index < 16 * 16 * 16);
+	if (BitsPerIndex == 8)
+	{
+		RawMaterials[Index] = Material;
+		return;
+	}
+
+	int PaletteIndex = Palette.Find(Material);
+	if (PaletteIndex == INDEX_NONE)
+	{
+		PaletteIndex = Palette.Add(Material);
+		if (Palette.Num() > (1 << BitsPerIndex))
+		{
+			SetBitsPerIndex(BitsPerIndex == 0 ? 1 : 2 * BitsPerIndex);
+			if (BitsPerIndex == 8)
+			{
+				RawMaterials[Index] = Material;
+				return;
+			}
+		}
+	}
+	SetIndex(Index, PaletteIndex);
+}
+
+void FVoxelMaterialPalette::GetRow(int Index, int Step, int Count, FVoxelMaterial OutMaterials[]) const
+{
+	check(0 <= Index && Index + (Count - 1) * Step < 16 * 16 * 16);
+
+	if (BitsPerIndex == 0)
+	{
+		const FVoxelMaterial Material = Palette[0];
+		for (int I = 0; I < Count; I++)
+		{
+			OutMaterials[I] = Material;
+		}
+	}
+	else if (BitsPerIndex == 8)
+	{
+		if (Step == 1)
+		{
+			FMemory::Memcpy(OutMaterials, RawMaterials.GetData() + Index, Count * sizeof(FVoxelMaterial));
+		}
+		else
+		{
+			for (int I = 0; I < Count; I++)
+			{
+				OutMaterials[I] = RawMaterials[Index + I * Step];
+			}
+		}
+	}
+	else
+	{
+		const FVoxelMaterial* RESTRICT PaletteData = Palette.GetData();
+		const uint32* RESTRICT IndicesData = Indices.GetData();
+		const uint32 IndexMask = (1u << BitsPerIndex) - 1;
+		for (int I = 0; I < Count; I++)
+		{
+			const int Bit = (Index + I * Step) * BitsPerIndex;
+			OutMaterials[I] = PaletteData[(IndicesData[Bit / 32] >> (Bit % 32)) & IndexMask];
+		}
+	}
+}
+
+bool FVoxelMaterialPalette::IsUniform() const
+{
+	return BitsPerIndex == 0;
+}
+
+uint32 FVoxelMaterialPalette::GetHash(uint32 Crc) const
+{
+	Crc = FCrc::MemCrc32(&BitsPerIndex, sizeof(BitsPerIndex), Crc);
+	Crc = GetArrayHash(Palette, Crc);
+	Crc = GetArrayHash(Indices, Crc);
+	return GetArrayHash(RawMaterials, Crc);
+}
+
+bool FVoxelMaterialPalette::operator==(const FVoxelMaterialPalette& Other) const
+{
+	return BitsPerIndex == Other.BitsPerIndex
+		&& AreArraysIdentical(Palette, Other.Palette)
+		&& AreArraysIdentical(Indices, Other.Indices)
+		&& AreArraysIdentical(RawMaterials, Other.RawMaterials);
+}
+
+void FVoxelMaterialPalette::Serialize(FArchive& Ar)
+{
+	Ar << Palette;
+	Ar << Indices;
+	Ar << BitsPerIndex;
+	Ar << RawMaterials;
+}
+
+int FVoxelMaterialPalette::GetIndex(int Index) const
+{
+	if (BitsPerIndex == 0)
+	{
+		return 0;
+	}
+	const int Bit = Index * BitsPerIndex;
+	return (Indices[Bit / 32] >> (Bit % 32)) & ((1u << BitsPerIndex) - 1);
+}
+
+void FVoxelMaterialPalette::SetIndex(int Index, int PaletteIndex)
+{
+	check(0 < BitsPerIndex && BitsPerIndex < 8);
+	check(0 <= PaletteIndex && PaletteIndex < (1 << BitsPerIndex));
+
+	const int Bit = Index * BitsPerIndex;
+	const uint32 Mask = ((1u << BitsPerIndex) - 1) << (Bit % 32);
+	Indices[Bit / 32] = (Indices[Bit / 32] & ~Mask) | ((uint32)PaletteIndex << (Bit % 32));
+}
+
+void FVoxelMaterialPalette::SetBitsPerIndex(int NewBitsPerIndex)
+{
+	check(NewBitsPerIndex > BitsPerIndex);
+
+	// The new material is already in the palette but not referenced yet
+	TArray<uint8> OldIndices;
+	OldIndices.SetNumUninitialized(16 * 16 * 16);
+	for (int Index = 0; Index < 16 * 16 * 16; Index++)
+	{
+		OldIndices[Index] = GetIndex(Index);
+	}
+
+	if (NewBitsPerIndex > 4)
+	{
+		RawMaterials.SetNumUninitialized(16 * 16 * 16);
+		for (int Index = 0; Index < 16 * 16 * 16; Index++)
+		{
+			RawMaterials[Index] = Palette[OldIndices[Index]];
+		}
+		Palette.Empty();
+		Indices.Empty();
+		BitsPerIndex = 8;
+	}
+	else
+	{
+		BitsPerIndex = NewBitsPerIndex;
+		Indices.Empty(16 * 16 * 16 * BitsPerIndex / 32);
+		Indices.SetNumZeroed(16 * 16 * 16 * BitsPerIndex / 32);
+		for (int Index = 0; Index < 16 * 16 * 16; Index++)
+		{
+			SetIndex(Index, OldIndices[Index]);
+		}
+	}
+}
+
+FVoxelLeafData::FVoxelLeafData()
+	: ValueMin(MAX_flt)
+	, ValueMax(-MAX_flt)
+	, ModifiedMin(16, 16, 16)
+	, ModifiedMax(-1, -1, -1)
+{
+	FMemory::Memzero(ValueMask);
+	FMemory::Memzero(MaterialMask);
+	FMemory::Memzero(ValueRanks);
+	FMemory::Memzero(MaterialRanks);
+}
+
+bool FVoxelLeafData::IsDense() const
+{
+	return Values.Num() != 0;
+}
+
+bool FVoxelLeafData::HasValue(int Index) const
+{
+	check(0 <= Index && Index < 16 * 16 * 16);
+	return IsDense() || (ValueMask[Index / 32] & (1u << (Index % 32)));
+}
+
+bool FVoxelLeafData::HasMaterial(int Index) const
+{
+	check(0 <= Index && Index < 16 * 16 * 16);
+	return IsDense() || (MaterialMask[Index / 32] & (1u << (Index % 32)));
+}
+
+float FVoxelLeafData::GetValue(int Index) const
+{
+	check(HasValue(Index));
+	return IsDense() ? Values[Index].ToFloat() : SparseValues[GetSparseRank(ValueMask, ValueRanks, Index)].ToFloat();
+}
+
+FVoxelMaterial FVoxelLeafData::GetMaterial(int Index) const
+{
+	check(HasMaterial(Index));
+	return IsDense() ? Materials.Get(Index) : SparseMaterials[GetSparseRank(MaterialMask, MaterialRanks, Index)];
+}
+
+void FVoxelLeafData::SetValue(int Index, float Value)
+{
+	check(0 <= Index && Index < 16 * 16 * 16);
+
+	const FVoxelValue StoredValue(Value);
+	if (IsDense())
+	{
+		Values[Index] = StoredValue;
+	}
+	else
+	{
+		SetSparse(ValueMask, ValueRanks, SparseValues, Index, StoredValue);
+	}
+
+	ValueMin = FMath::Min(ValueMin, StoredValue.ToFloat());
+	ValueMax = FMath::Max(ValueMax, StoredValue.ToFloat());
+	AddModified(Index);
+}
+
+void FVoxelLeafData::SetMaterial(int Index, const FVoxelMaterial& Material)
+{
+	check(0 <= Index && Index < 16 * 16 * 16);
+	if (IsDense())
+	{
+		Materials.Set(Index, Material);
+	}
+	else
+	{
+		SetSparse(MaterialMask, MaterialRanks, SparseMaterials, Index, Material);
+	}
+	AddModified(Index);
+}
+
+bool FVoxelLeafData::GetValueRange(float& OutMin, float& OutMax) const
+{
+	OutMin = ValueMin;
+	OutMax = ValueMax;
+	return ValueMin <= ValueMax;
+}
+
+bool FVoxelLeafData::GetModifiedBounds(FIntVector& OutMin, FIntVector& OutMax) const
+{
+	OutMin = ModifiedMin;
+	OutMax = ModifiedMax;
+	return ModifiedMin.X <= ModifiedMax.X;
+}
+
+void FVoxelLeafData::AddModified(int Index)
+{
+	const FIntVector Position(Index % 16, (Index / 16) % 16, Index / (16 * 16));
+	ModifiedMin = FIntVector(FMath::Min(ModifiedMin.X, Position.X), FMath::Min(ModifiedMin.Y, Position.Y), FMath::Min(ModifiedMin.Z, Position.Z));
+	ModifiedMax = FIntVector(FMath::Max(ModifiedMax.X, Position.X), FMath::Max(ModifiedMax.Y, Position.Y), FMath::Max(ModifiedMax.Z, Position.Z));
+}
+
+int FVoxelLeafData::GetSparseCount() const
+{
+	return SparseValues.Num() + SparseMaterials.Num();
+}
+
+void FVoxelLeafData::GetSparseVoxels(uint32 OutValueMask[128], uint32 OutMaterialMask[128], TArray<FVoxelValue>& OutValues, TArray<FVoxelMaterial>& OutMaterials) const
+{
+	check(!IsDense());
+
+	FMemory::Memcpy(OutValueMask, ValueMask, sizeof(ValueMask));
+	FMemory::Memcpy(OutMaterialMask, MaterialMask, sizeof(MaterialMask));
+	OutValues = SparseValues;
+	OutMaterials = SparseMaterials;
+}
+
+void FVoxelLeafData::MakeDense(UVoxelWorldGenerator* WorldGenerator, const FIntVector& LeafMin)
+{
+	check(!IsDense());
+
+	Values.SetNumUninitialized(16 * 16 * 16);
+	ValueMin = MAX_flt;
+	ValueMax = -MAX_flt;
+
+	float GeneratorValues[16 * 16 * 16];
+	FVoxelMaterial GeneratorMaterials[16 * 16 * 16];
+	WorldGenerator->GetValuesAndMaterials(GeneratorValues, GeneratorMaterials, LeafMin, FIntVector::ZeroValue, 1, FIntVector(16, 16, 16), FIntVector(16, 16, 16));
+
+	for (int Index = 0; Index < 16 * 16 * 16; Index++)
+	{
+		if (ValueMask[Index / 32] & (1u << (Index % 32)))
+		{
+			Values[Index] = SparseValues[GetSparseRank(ValueMask, ValueRanks, Index)];
+		}
+		else
+		{
+			Values[Index] = FVoxelValue(GeneratorValues[Index]);
+		}
+		ValueMin = FMath::Min(ValueMin, Values[Index].ToFloat());
+		ValueMax = FMath::Max(ValueMax, Values[Index].ToFloat());
+		if (MaterialMask[Index / 32] & (1u << (Index % 32)))
+		{
+			GeneratorMaterials[Index] = SparseMaterials[GetSparseRank(MaterialMask, MaterialRanks, Index)];
+		}
+	}
+	Materials.Init(GeneratorMaterials);
+
+	SparseValues.Empty();
+	SparseMaterials.Empty();
+	FMemory::Memzero(ValueMask);
+	FMemory::Memzero(MaterialMask);
+	FMemory::Memzero(ValueRanks);
+	FMemory::Memzero(MaterialRanks);
+}
+
+uint32 FVoxelLeafData::GetHash() const
+{
+	uint32 Crc = FCrc::MemCrc32(&ModifiedMin, sizeof(ModifiedMin));
+	Crc = FCrc::MemCrc32(&ModifiedMax, sizeof(ModifiedMax), Crc);
+	if (IsDense())
+	{
+		Crc = GetArrayHash(Values, Crc);
+		return Materials.GetHash(Crc);
+	}
+	else
+	{
+		Crc = FCrc::MemCrc32(ValueMask, sizeof(ValueMask), Crc);
+		Crc = FCrc::MemCrc32(MaterialMask, sizeof(MaterialMask), Crc);
+		Crc = GetArrayHash(SparseValues, Crc);
+		return GetArrayHash(SparseMaterials, Crc);
+	}
+}
+
+bool FVoxelLeafData::operator==(const FVoxelLeafData& Other) const
+{
+	if (IsDense() != Other.IsDense() || ModifiedMin != Other.ModifiedMin || ModifiedMax != Other.ModifiedMax)
+	{
+		return false;
+	}
+	if (IsDense())
+	{
+		return AreArraysIdentical(Values, Other.Values) && Materials == Other.Materials;
+	}
+	else
+	{
+		// Ranks are derived from the masks
+		return FMemory::Memcmp(ValueMask, Other.ValueMask, sizeof(ValueMask)) == 0
+			&& FMemory::Memcmp(MaterialMask, Other.MaterialMask, sizeof(MaterialMask)) == 0
+			&& AreArraysIdentical(SparseValues, Other.SparseValues)
+			&& AreArraysIdentical(SparseMaterials, Other.SparseMaterials);
+	}
+}
+
+void FVoxelLeafData::Serialize(FArchive& Ar)
+{
+	Ar << ValueMin;
+	Ar << ValueMax;
+	Ar << ModifiedMin;
+	Ar << ModifiedMax;
+
+	Ar << Values;
+	Materials.Serialize(Ar);
+
+	Ar.Serialize(ValueMask, sizeof(ValueMask));
+	Ar.Serialize(MaterialMask, sizeof(MaterialMask));
+	Ar.Serialize(ValueRanks, sizeof(ValueRanks));
+	Ar.Serialize(MaterialRanks, sizeof(MaterialRanks));
+	Ar << SparseValues;
+	Ar << SparseMaterials;
+}
+
+void FVoxelLeafData::GetValuesAndMaterials(const FIntVector& LeafMin, float OutValues[], FVoxelMaterial OutMaterials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const
+{
+	const FIntVector LocalStart = Start - LeafMin;
+	check(0 <= LocalStart.GetMin() && (LocalStart + (Size - FIntVector(1, 1, 1)) * Step).GetMax() < 16);
+
+	if (OutValues)
+	{
+		GetValues(OutValues, LocalStart, StartIndex, Step, Size, ArraySize);
+	}
+	if (OutMaterials)
+	{
+		GetMaterials(OutMaterials, LocalStart, StartIndex, Step, Size, ArraySize);
+	}
+}
+
+void FVoxelLeafData::GetValues(float OutValues[], const FIntVector& LocalStart, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const
+{
+	for (int K = 0; K < Size.Z; K++)
+	{
+		for (int J = 0; J < Size.Y; J++)
+		{
+			// Rows are along X, both in the leaf and in the output
+			const int RowIndex = 16 * (LocalStart.Y + J * Step) + 16 * 16 * (LocalStart.Z + K * Step);
+			float* RESTRICT Out = OutValues + StartIndex.X + ArraySize.X * (StartIndex.Y + J) + ArraySize.X * ArraySize.Y * (StartIndex.Z + K);
+
+			if (IsDense())
+			{
+				const FVoxelValue* RESTRICT In = Values.GetData() + RowIndex + LocalStart.X;
+#if VOXEL_VALUE_BITS == 32
+				static_assert(sizeof(FVoxelValue) == sizeof(float), "FVoxelValue must be a float");
+				if (Step == 1)
+				{
+					FMemory::Memcpy(Out, In, Size.X * sizeof(float));
+					continue;
+				}
+#endif
+				for (int I = 0; I < Size.X; I++)
+				{
+					Out[I] = In[I * Step].ToFloat();
+				}
+			}
+			else
+			{
+				GetSparseRow(ValueMask, ValueRanks, SparseValues.GetData(), RowIndex, LocalStart.X, Step, Size.X, [&](int I, const FVoxelValue& Value)
+				{
+					Out[I] = Value.ToFloat();
+				});
+			}
+		}
+	}
+}
+
+void FVoxelLeafData::GetMaterials(FVoxelMaterial OutMaterials[], const FIntVector& LocalStart, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const
+{
+	for (int K = 0; K < Size.Z; K++)
+	{
+		for (int J = 0; J < Size.Y; J++)
+		{
+			const int RowIndex = 16 * (LocalStart.Y + J * Step) + 16 * 16 * (LocalStart.Z + K * Step);
+			FVoxelMaterial* RESTRICT Out = OutMaterials + StartIndex.X + ArraySize.X * (StartIndex.Y + J) + ArraySize.X * ArraySize.Y * (StartIndex.Z + K);
+
+			if (IsDense())
+			{
+				Materials.GetRow(RowIndex + LocalStart.X, Step, Size.X, Out);
+			}
+			else
+			{
+				GetSparseRow(MaterialMask, MaterialRanks, SparseMaterials.GetData(), RowIndex, LocalStart.X, Step, Size.X, [&](int I, const FVoxelMaterial& Material)
+				{
+					Out[I] = Material;
+				});
+			}
+		}
+	}
+}
+
+FVoxelMipData::FVoxelMipData()
+{
+	Values.SetNumUninitialized(16 * 16 * 16);
+	Materials.SetNumUninitialized(16 * 16 * 16);
+}
+
+void FVoxelMipData::GetValuesAndMaterials(const FIntVector& NodeMin, int MipStep, float OutValues[], FVoxelMaterial OutMaterials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const
+{
+	check(Step % MipStep == 0);
+	check((Start - NodeMin).X % MipStep == 0 && (Start - NodeMin).Y % MipStep == 0 && (Start - NodeMin).Z % MipStep == 0);
+
+	const FIntVector LocalStart = (Start - NodeMin) / MipStep;
+	const int LocalStep = Step / MipStep;
+	check(0 <= LocalStart.GetMin() && (LocalStart + (Size - FIntVector(1, 1, 1)) * LocalStep).GetMax() < 16);
+
+	for (int K = 0; K < Size.Z; K++)
+	{
+		for (int J = 0; J < Size.Y; J++)
+		{
+			const int RowIndex = LocalStart.X + 16 * (LocalStart.Y + J * LocalStep) + 16 * 16 * (LocalStart.Z + K * LocalStep);
+			const int Index = StartIndex.X + ArraySize.X * (StartIndex.Y + J) + ArraySize.X * ArraySize.Y * (StartIndex.Z + K);
+
+			if (OutValues)
+			{
+				for (int I = 0; I < Size.X; I++)
+				{
+					OutValues[Index + I] = Values[RowIndex + I * LocalStep].ToFloat();
+				}
+			}
+			if (OutMaterials)
+			{
+				for (int I = 0; I < Size.X; I++)
+				{
+					OutMaterials[Index + I] = Materials[RowIndex + I * LocalStep];
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,256 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VoxelMaterial.h"
+#include "VoxelValue.h"
+
+class UVoxelWorldGenerator;
+
+/**
+ * Get the indices I such that Min <= Start + I * Step <= Max and 0 <= I < Size
+ * @return	OutMin	Inclusive
+ * @return	OutMax	Inclusive. OutMax < OutMin if there are none
+ */
+FORCEINLINE void GetIndicesInRange(int Start, int Step, int Size, int Min, int Max, int& OutMin, int& OutMax)
+{
+	OutMin = Min - Start <= 0 ? 0 : (Min - Start + Step - 1) / Step;
+	OutMax = Max - Start < 0 ? -1 : FMath::Min(Size - 1, (Max - Start) / Step);
+}
+
+/**
+ * Materials of the 16 * 16 * 16 voxels of a leaf, palette encoded: each voxel stores the index of its material in the palette, with 0 (uniform), 1, 2 or 4 bits.
+ * Falls back to raw materials above 16 different materials
+ */
+class FVoxelMaterialPalette
+{
+public:
+	FVoxelMaterialPalette();
+
+	/**
+	 * Encode Materials
+	 * @param	Materials	Materials of the 16 * 16 * 16 voxels
+	 */
+	void Init(const FVoxelMaterial Materials[]);
+
+	FORCEINLINE FVoxelMaterial Get(int Index) const;
+	FORCEINLINE void Set(int Index, const FVoxelMaterial& Material);
+
+	/**
+	 * Decode Count materials, starting at Index and every Step voxels
+	 * @param	OutMaterials	Array of size Count
+	 */
+	FORCEINLINE void GetRow(int Index, int Step, int Count, FVoxelMaterial OutMaterials[]) const;
+
+	/**
+	 * Do all the voxels have the same material? If so, it's Get(0)
+	 */
+	FORCEINLINE bool IsUniform() const;
+
+	/**
+	 * Hash of the encoded materials. Equal palettes have equal hashes
+	 */
+	uint32 GetHash(uint32 Crc) const;
+
+	/**
+	 * Same encoded materials? Can be false for the same materials encoded differently
+	 */
+	bool operator==(const FVoxelMaterialPalette& Other) const;
+
+	void Serialize(FArchive& Ar);
+
+private:
+	// Materials used. Empty if raw
+	TArray<FVoxelMaterial> Palette;
+	// Palette indices, packed
+	TArray<uint32> Indices;
+	// 0, 1, 2 or 4. 8 if raw
+	int BitsPerIndex;
+	// Used if more than 16 different materials
+	TArray<FVoxelMaterial> RawMaterials;
+
+	FORCEINLINE int GetIndex(int Index) const;
+	FORCEINLINE void SetIndex(int Index, int PaletteIndex);
+
+	/**
+	 * Repack the indices with more bits per index, or switch to raw materials
+	 */
+	void SetBitsPerIndex(int NewBitsPerIndex);
+};
+
+/**
+ * Values & materials of a dirty leaf. Only allocated once the leaf is modified
+ * Shared with snapshots: never modified while not uniquely owned
+ *
+ * Starts sparse: only the modified voxels are stored, the others must be read from the world generator.
+ * Becomes dense (all the voxels stored) once too many voxels are modified
+ */
+class FVoxelLeafData
+{
+public:
+	// Above this number of modified values + materials, the leaf should be made dense
+	static const int MaxSparseCount = 1024;
+
+	FVoxelLeafData();
+
+	FORCEINLINE bool IsDense() const;
+
+	/**
+	 * Is the value at Index stored in this? Always true if dense
+	 */
+	FORCEINLINE bool HasValue(int Index) const;
+	FORCEINLINE bool HasMaterial(int Index) const;
+
+	/**
+	 * Get the value/material at Index. HasValue/HasMaterial must be true
+	 */
+	FORCEINLINE float GetValue(int Index) const;
+	FORCEINLINE FVoxelMaterial GetMaterial(int Index) const;
+
+	FORCEINLINE void SetValue(int Index, float Value);
+	FORCEINLINE void SetMaterial(int Index, const FVoxelMaterial& Material);
+
+	/**
+	 * Conservative bounds of the stored values: never shrinks until the leaf is made dense
+	 * @return	false if no value is stored
+	 */
+	FORCEINLINE bool GetValueRange(float& OutMin, float& OutMax) const;
+
+	/**
+	 * Bounds of the voxels modified, relative to the leaf minimal corner. Kept when made dense
+	 * @return	false if none
+	 */
+	FORCEINLINE bool GetModifiedBounds(FIntVector& OutMin, FIntVector& OutMax) const;
+
+	/**
+	 * Number of values + materials stored while sparse
+	 */
+	FORCEINLINE int GetSparseCount() const;
+
+	/**
+	 * Copy the sparse storage. Must not be dense
+	 * @return	OutValueMask		One bit per voxel, set if its value is stored
+	 * @return	OutMaterialMask		One bit per voxel, set if its material is stored
+	 * @return	OutValues			Values stored, by increasing index
+	 * @return	OutMaterials		Materials stored, by increasing index
+	 */
+	void GetSparseVoxels(uint32 OutValueMask[128], uint32 OutMaterialMask[128], TArray<FVoxelValue>& OutValues, TArray<FVoxelMaterial>& OutMaterials) const;
+
+	/**
+	 * Store all the voxels, using the world generator for the ones not modified
+	 * @param	WorldGenerator	Generator of the current world
+	 * @param	LeafMin			Minimal corner of the leaf
+	 */
+	void MakeDense(UVoxelWorldGenerator* WorldGenerator, const FIntVector& LeafMin);
+
+	/**
+	 * Hash of the stored voxels and of the modified bounds, for sharing identical leaves data. Equal datas have equal hashes
+	 */
+	uint32 GetHash() const;
+
+	/**
+	 * Same stored voxels and modified bounds? The values bounds are ignored: the ones of either data are valid for both
+	 */
+	bool operator==(const FVoxelLeafData& Other) const;
+
+	/**
+	 * Serialize everything, for paging. Not a stable format
+	 */
+	void Serialize(FArchive& Ar);
+
+	/**
+	 * Copy the stored values and materials, with the same arguments as FValueOctree::GetValuesAndMaterials. Voxels not stored are left untouched
+	 * @param	LeafMin		Minimal corner of the leaf. All the positions must be in the leaf
+	 */
+	void GetValuesAndMaterials(const FIntVector& LeafMin, float OutValues[], FVoxelMaterial OutMaterials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const;
+
+private:
+	/**
+	 * Row by row copies, along X. Positions are relative to the leaf minimal corner
+	 */
+	void GetValues(float OutValues[], const FIntVector& LocalStart, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const;
+	void GetMaterials(FVoxelMaterial OutMaterials[], const FIntVector& LocalStart, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const;
+
+	// Bounds of the stored values. Min > Max if none
+	float ValueMin;
+	float ValueMax;
+
+	// Bounds of the modified voxels, inclusive. Min > Max if none
+	FIntVector ModifiedMin;
+	FIntVector ModifiedMax;
+
+	FORCEINLINE void AddModified(int Index);
+
+	// Dense storage. Empty while sparse
+	TArray<FVoxelValue> Values;
+	FVoxelMaterialPalette Materials;
+
+	// Sparse storage: one bit per voxel, set if stored
+	uint32 ValueMask[128];
+	uint32 MaterialMask[128];
+	// Number of bits set in the mask before each word
+	uint16 ValueRanks[128];
+	uint16 MaterialRanks[128];
+	// Stored voxels, by increasing index
+	TArray<FVoxelValue> SparseValues;
+	TArray<FVoxelMaterial> SparseMaterials;
+};
+
+/**
+ * Values & materials of a modified node of depth > 0, sampled every 2^Depth voxels from its minimal corner: the 16 * 16 * 16 samples read by the chunks of the same depth.
+ * Each value is the average of the 2 * 2 * 2 values one level finer in its cell, so that far chunks don't alias the edits. Each material is the one at the sample.
+ * Only built for the depths read by snapshots, and updated by them after edits. Shared with snapshots: never modified while not uniquely owned
+ */
+struct FVoxelMipData
+{
+	TArray<FVoxelValue> Values;
+	TArray<FVoxelMaterial> Materials;
+
+	FVoxelMipData();
+
+	/**
+	 * Copy the samples, with the same arguments as FValueOctree::GetValuesAndMaterials
+	 * @param	NodeMin		Minimal corner of the node
+	 * @param	MipStep		Distance between samples: 2^Depth. Step must be a multiple of it, and Start must be aligned on it
+	 */
+	void GetValuesAndMaterials(const FIntVector& NodeMin, int MipStep, float OutValues[], FVoxelMaterial OutMaterials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const;
+};
+
+/**
+ * Modification of a voxel of a leaf, for batched edits
+ */
+struct FVoxelLeafEdit
+{
+	// Index in the leaf: X + 16 * Y + 16 * 16 * Z
+	uint16 Index;
+	bool bSetValue;
+	bool bSetMaterial;
+	float Value;
+	FVoxelMaterial Material;
+};
+
+/**
+ * Indices of the voxels of a leaf modified since last network sync. Only allocated in multiplayer, between a modification and the next sync
+ */
+struct FVoxelLeafNetworkData
+{
+	// One bit per voxel, sent as is in FVoxelLeafDiff
+	uint32 DirtyValues[128];
+	uint32 DirtyMaterials[128];
+
+	FVoxelLeafNetworkData()
+	{
+		FMemory::Memzero(DirtyValues);
+		FMemory::Memzero(DirtyMaterials);
+	}
+
+	FORCEINLINE void AddValue(int Index)
+	{
+		DirtyValues[Index / 32] |= 1u << (Index % 32);
+	}
+	FORCEINLINE void AddMaterial(int Index)
+	{
+		DirtyMaterials[Index / 32] |= 1u << (Index % 32);
+	}
+};
@@ -0,0 +1,53 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelLeafDataPool.h"
+#include "VoxelLeafData.h"
+
+FVoxelLeafDataPool::FVoxelLeafDataPool()
+	: LastCleanNum(0)
+{
+
+}
+
+TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe> FVoxelLeafDataPool::Share(const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& Data)
+{
+	check(Data.IsValid());
+
+	// Hashed outside of the lock: Data isn't shared yet
+	const uint32 Hash = Data->GetHash();
+
+	FScopeLock Lock(&Section);
+
+	TArray<TWeakPtr<FVoxelLeafData, ESPMode::ThreadSafe>*, TInlineAllocator<4>> Candidates;
+	Datas.MultiFindPointer(Hash, Candidates);
+	for (auto* Candidate : Candidates)
+	{
+		TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe> CandidateData = Candidate->Pin();
+		if (CandidateData.IsValid() && (CandidateData == Data || *CandidateData == *Data))
+		{
+			return CandidateData;
+		}
+	}
+
+	Datas.Add(Hash, Data);
+
+	// Expired entries are only removed here, each time the pool doubled
+	if (Datas.Num() > FMath::Max(2 * LastCleanNum, 1024))
+	{
+		RemoveExpired();
+	}
+
+	return Data;
+}
+
+void FVoxelLeafDataPool::RemoveExpired()
+{
+	for (auto It = Datas.CreateIterator(); It; ++It)
+	{
+		if (!It.Value().IsValid())
+		{
+			It.RemoveCurrent();
+		}
+	}
+	LastCleanNum = Datas.Num();
+}
@@ -0,0 +1,37 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/ScopeLock.h"
+
+class FVoxelLeafData;
+
+/**
+ * Hash consing of the leaves data: identical datas are shared by all their leaves, and copied on write like when shared with a snapshot.
+ * Only weak references are kept: a data is forgotten once no leaf nor snapshot uses it. Thread safe
+ */
+class FVoxelLeafDataPool
+{
+public:
+	FVoxelLeafDataPool();
+
+	/**
+	 * Get a data identical to Data from the pool, or add Data to it
+	 * @param	Data	Data of a leaf. Once given here, it must never be modified in place, even when no longer referenced elsewhere:
+	 *					the pool may be comparing it concurrently
+	 * @return	The data the leaf should use
+	 */
+	TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe> Share(const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& Data);
+
+private:
+	FCriticalSection Section;
+	TMultiMap<uint32, TWeakPtr<FVoxelLeafData, ESPMode::ThreadSafe>> Datas;
+	// Number of entries after the last removal of the expired ones
+	int LastCleanNum;
+
+	/**
+	 * Remove the entries whose data is no longer used
+	 */
+	void RemoveExpired();
+};
@@ -0,0 +1,166 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelPrivate.h"
+#include "VoxelLeafPager.h"
+#include "VoxelLeafData.h"
+#include "HAL/PlatformFilemanager.h"
+#include "Misc/Paths.h"
+#include "Misc/Compression.h"
+#include "BufferArchive.h"
+#include "MemoryReader.h"
+
+FVoxelLeafPager::FVoxelLeafPager()
+	: File(nullptr)
+	, FileSize(0)
+	, StartTime(FPlatformTime::Seconds())
+{
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+
+	const FString Directory = FPaths::GameSavedDir() / TEXT("VoxelPages");
+	PlatformFile.CreateDirectoryTree(*Directory);
+
+	Filename = FPaths::CreateTempFilename(*Directory, TEXT("Pages"), TEXT(".bin"));
+	File = PlatformFile.OpenWrite(*Filename, false, true);
+	if (!File)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Paging: Can't open %s. Leaves will stay in memory"), *Filename);
+	}
+}
+
+FVoxelLeafPager::~FVoxelLeafPager()
+{
+	delete File;
+	FPlatformFileManager::Get().GetPlatformFile().DeleteFile(*Filename);
+}
+
+int32 FVoxelLeafPager::GetTime() const
+{
+	return (int32)(FPlatformTime::Seconds() - StartTime);
+}
+
+bool FVoxelLeafPager::Write(FVoxelLeafData& Data, FVoxelLeafPage& OutPage)
+{
+	if (!File)
+	{
+		return false;
+	}
+
+	// Serialize and compress outside of the lock
+	FBufferArchive Uncompressed;
+	Data.Serialize(Uncompressed);
+
+	int32 CompressedSize = FCompression::CompressMemoryBound(ECompressionFlags::COMPRESS_ZLIB, Uncompressed.Num());
+	TArray<uint8> Compressed;
+	Compressed.SetNumUninitialized(CompressedSize);
+	if (!FCompression::CompressMemory(ECompressionFlags::COMPRESS_ZLIB, Compressed.GetData(), CompressedSize, Uncompressed.GetData(), Uncompressed.Num()))
+	{
+		return false;
+	}
+
+	FScopeLock Lock(&Section);
+
+	FVoxelLeafPage Page = Allocate(CompressedSize);
+	if (!File->Seek(Page.Offset) || !File->Write(Compressed.GetData(), CompressedSize))
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Paging: Write failed in %s"), *Filename);
+		FreePages.Add(Page);
+		return false;
+	}
+	Page.CompressedSize = CompressedSize;
+	Page.UncompressedSize = Uncompressed.Num();
+	OutPage = Page;
+
+	return true;
+}
+
+void FVoxelLeafPager::Assign(const void* Leaf, const FVoxelLeafPage& Page)
+{
+	FScopeLock Lock(&Section);
+	check(!Pages.Contains(Leaf));
+	Pages.Add(Leaf, Page);
+}
+
+void FVoxelLeafPager::Release(const FVoxelLeafPage& Page)
+{
+	FScopeLock Lock(&Section);
+	FreePages.Add(Page);
+}
+
+TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe> FVoxelLeafPager::PageIn(const void* Leaf)
+{
+	TArray<uint8> Compressed;
+	TArray<uint8> Uncompressed;
+	{
+		FScopeLock Lock(&Section);
+
+		FVoxelLeafPage Page;
+		verify(Pages.RemoveAndCopyValue(Leaf, Page));
+
+		// Seek and read on the shared handle
+		Compressed.SetNumUninitialized(Page.CompressedSize);
+		if (!File->Seek(Page.Offset) || !File->Read(Compressed.GetData(), Page.CompressedSize))
+		{
+			// The page isn't reused: that part of the file may be unreadable
+			UE_LOG(LogVoxel, Error, TEXT("Paging: Read failed in %s"), *Filename);
+			return nullptr;
+		}
+		FreePages.Add(Page);
+
+		Uncompressed.SetNumUninitialized(Page.UncompressedSize);
+	}
+
+	if (!FCompression::UncompressMemory(ECompressionFlags::COMPRESS_ZLIB, Uncompressed.GetData(), Uncompressed.Num(), Compressed.GetData(), Compressed.Num()))
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Paging: Corrupted page in %s"), *Filename);
+		return nullptr;
+	}
+
+	TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe> Data = MakeShareable(new FVoxelLeafData());
+	FMemoryReader Reader(Uncompressed);
+	Data->Serialize(Reader);
+	if (Reader.IsError())
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Paging: Corrupted page in %s"), *Filename);
+		return nullptr;
+	}
+
+	return Data;
+}
+
+void FVoxelLeafPager::Free(const void* Leaf)
+{
+	FScopeLock Lock(&Section);
+
+	FVoxelLeafPage Page;
+	verify(Pages.RemoveAndCopyValue(Leaf, Page));
+	FreePages.Add(Page);
+}
+
+void FVoxelLeafPager::GetStats(int& OutPageCount, int64& OutFileSize) const
+{
+	FScopeLock Lock(&Section);
+
+	OutPageCount = Pages.Num();
+	OutFileSize = FileSize;
+}
+
+FVoxelLeafPage FVoxelLeafPager::Allocate(int32 Size)
+{
+	for (int Index = 0; Index < FreePages.Num(); Index++)
+	{
+		if (FreePages[Index].Capacity >= Size)
+		{
+			FVoxelLeafPage Page = FreePages[Index];
+			FreePages.RemoveAtSwap(Index);
+			return Page;
+		}
+	}
+
+	FVoxelLeafPage Page;
+	Page.Offset = FileSize;
+	Page.Capacity = Size;
+	Page.CompressedSize = 0;
+	Page.UncompressedSize = 0;
+	FileSize += Size;
+	return Page;
+}
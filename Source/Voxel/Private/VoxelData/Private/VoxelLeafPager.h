@@ -0,0 +1,87 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/ScopeLock.h"
+
+class FVoxelLeafData;
+class IFileHandle;
+
+/**
+ * Location of a compressed leaf data in the pages file
+ */
+struct FVoxelLeafPage
+{
+	int64 Offset;
+	// Allocated size in the file
+	int32 Capacity;
+	int32 CompressedSize;
+	int32 UncompressedSize;
+};
+
+/**
+ * Compressed leaves data paged out to a temporary file, by leaf. Thread safe
+ */
+class FVoxelLeafPager
+{
+public:
+	FVoxelLeafPager();
+	~FVoxelLeafPager();
+
+	/**
+	 * Seconds since the pager creation, to timestamp the leaves accesses
+	 */
+	FORCEINLINE int32 GetTime() const;
+
+	/**
+	 * Compress Data and write it to a new page of the file. Only the file write is done under the pager lock
+	 * @return	false if the write failed: the data must then stay in memory
+	 */
+	bool Write(FVoxelLeafData& Data, FVoxelLeafPage& OutPage);
+
+	/**
+	 * Give a page written by Write to a leaf
+	 * @param	Leaf	Owner of the data, used as key
+	 */
+	void Assign(const void* Leaf, const FVoxelLeafPage& Page);
+
+	/**
+	 * Free a page written by Write that was not assigned
+	 */
+	void Release(const FVoxelLeafPage& Page);
+
+	/**
+	 * Read back the data of Leaf and free its page. Decompressed outside of the pager lock
+	 * @return	Null if the page can't be read back: the data is lost
+	 */
+	TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe> PageIn(const void* Leaf);
+
+	/**
+	 * Free the page of Leaf without reading it, when the leaf is destroyed
+	 */
+	void Free(const void* Leaf);
+
+	/**
+	 * Number of leaves paged out, and size used in the file
+	 */
+	void GetStats(int& OutPageCount, int64& OutFileSize) const;
+
+private:
+	mutable FCriticalSection Section;
+
+	FString Filename;
+	IFileHandle* File;
+	int64 FileSize;
+
+	const double StartTime;
+
+	TMap<const void*, FVoxelLeafPage> Pages;
+	// Space of the pages freed, reused first fit
+	TArray<FVoxelLeafPage> FreePages;
+
+	/**
+	 * Find space for Size bytes in the file
+	 */
+	FVoxelLeafPage Allocate(int32 Size);
+};
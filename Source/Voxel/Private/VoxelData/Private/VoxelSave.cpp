@@ -1,21 +1,29 @@
 // Copyright 2017 Phyronnaz
 
+#include "VoxelPrivate.h"
 #include "VoxelSave.h"
+#include "Octree.h"
 #include "BufferArchive.h"
-#include "ArchiveSaveCompressedProxy.h"
 #include "ArchiveLoadCompressedProxy.h"
 #include "MemoryReader.h"
+#include "Misc/Compression.h"
+#include "Async/ParallelFor.h"
+#include "ZSTDTypes.h"
 
 
 
 FVoxelChunkSave::FVoxelChunkSave()
 	: Id(-1)
+	, SourceId(0)
+	, bResidual(false)
 {
 
 }
 
 FVoxelChunkSave::FVoxelChunkSave(uint64 Id, FIntVector Position, float InValues[16 * 16 * 16], FVoxelMaterial InMaterials[16 * 16 * 16])
 	: Id(Id)
+	, SourceId(0)
+	, bResidual(false)
 {
 	Values.SetNumUninitialized(16 * 16 * 16);
 	Materials.SetNumUninitialized(16 * 16 * 16);
@@ -27,44 +35,230 @@ FVoxelChunkSave::FVoxelChunkSave(uint64 Id, FIntVector Position, float InValues[
 			for (int Z = 0; Z < 16; Z++)
 			{
 				const int Index = X + 16 * Y + 16 * 16 * Z;
-				Values[Index] = InValues[Index];
+				Values[Index] = FVoxelValue(InValues[Index]);
 				Materials[Index] = InMaterials[Index];
 			}
 		}
 	}
 }
 
+FVoxelChunkSave::FVoxelChunkSave(uint64 Id, uint64 SourceId)
+	: Id(Id)
+	, SourceId(SourceId)
+	, bResidual(false)
+{
+
+}
+
+FVoxelChunkSave::FVoxelChunkSave(uint64 Id, const uint32 InValueMask[128], const uint32 InMaterialMask[128], TArray<FVoxelValue>&& InValues, TArray<FVoxelMaterial>&& InMaterials)
+	: Id(Id)
+	, SourceId(0)
+	, bResidual(true)
+	, Values(MoveTemp(InValues))
+	, Materials(MoveTemp(InMaterials))
+{
+	ValueMask.Append(InValueMask, 128);
+	MaterialMask.Append(InMaterialMask, 128);
+}
+
+static int CountMaskBits(const TArray<uint32>& Mask)
+{
+	int Count = 0;
+	for (uint32 Bits : Mask)
+	{
+		Bits = Bits - ((Bits >> 1) & 0x55555555);
+		Bits = (Bits & 0x33333333) + ((Bits >> 2) & 0x33333333);
+		Count += (((Bits + (Bits >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+	}
+	return Count;
+}
+
+bool FVoxelChunkSave::HasValidCounts() const
+{
+	if (!bResidual)
+	{
+		return Values.Num() == 16 * 16 * 16 && Materials.Num() == 16 * 16 * 16;
+	}
+	return ValueMask.Num() == 128 && MaterialMask.Num() == 128 && Values.Num() == CountMaskBits(ValueMask) && Materials.Num() == CountMaskBits(MaterialMask);
+}
+
 FVoxelWorldSave::FVoxelWorldSave()
 	: Depth(-1)
+	, ValueBits(32)
+	, Version(EVoxelSaveVersion::Base9Ids)
 {
 
 }
 
-void FVoxelWorldSave::Init(int NewDepth, std::list<TSharedRef<FVoxelChunkSave>> ChunksList)
+void FVoxelWorldSave::Init(int NewDepth, TArray<FVoxelChunkSave>& Chunks)
 {
 	Depth = NewDepth;
+	ValueBits = VOXEL_VALUE_BITS;
+	Version = EVoxelSaveVersion::Latest;
+
+	Data.Empty();
+	Records.Empty();
+
+	// Each chunk is compressed on its own so that it can be read without the others: they are compressed in parallel
+	TArray<TArray<uint8>> CompressedChunks;
+	CompressedChunks.SetNum(Chunks.Num());
+	Records.SetNum(Chunks.Num());
+	ParallelFor(Chunks.Num(), [&](int32 Index)
+	{
+		CompressChunk(Chunks[Index], Version, CompressedChunks[Index], Records[Index]);
+	});
+
+	int64 DataSize = 0;
+	for (auto& CompressedChunk : CompressedChunks)
+	{
+		DataSize += CompressedChunk.Num();
+	}
+	check(DataSize <= MAX_int32);
+	Data.Reserve(DataSize);
+
+	for (int Index = 0; Index < Chunks.Num(); Index++)
+	{
+		Records[Index].Offset = Data.Num();
+		Data.Append(CompressedChunks[Index]);
+	}
+
+	Records.Sort([](const FVoxelChunkRecord& A, const FVoxelChunkRecord& B) { return A.Id < B.Id; });
+}
+
+void FVoxelWorldSave::CompressChunk(FVoxelChunkSave& Chunk, int Version, TArray<uint8>& OutData, FVoxelChunkRecord& OutRecord)
+{
+	check(Version >= EVoxelSaveVersion::IndexedChunks);
+	check(!Chunk.bResidual || Version >= EVoxelSaveVersion::GeneratorResiduals);
 
 	FBufferArchive ToBinary;
+	SerializeVoxelChunk(ToBinary, Chunk, Version);
+
+	OutRecord.Id = Chunk.Id;
+	OutRecord.Offset = OutData.Num();
+	OutRecord.UncompressedSize = ToBinary.Num();
 
-	// Order matters
-	for (auto Chunk : ChunksList)
+	if (Version >= EVoxelSaveVersion::ZSTDChunks)
 	{
-		ToBinary << *Chunk;
+		TPSZSTDBufferData Compressed = FZSTDUtils::CompressData(ToBinary.GetData(), ToBinary.Num());
+		check(Compressed.IsValid());
+
+		OutRecord.CompressedSize = Compressed->BufferSize;
+		OutData.Append(static_cast<const uint8*>(Compressed->Buffer), Compressed->BufferSize);
 	}
+	else
+	{
+		OutRecord.CompressedSize = FCompression::CompressMemoryBound(ECompressionFlags::COMPRESS_ZLIB, ToBinary.Num());
 
-	Data.Empty();
-	FArchiveSaveCompressedProxy Compressor = FArchiveSaveCompressedProxy(Data, ECompressionFlags::COMPRESS_ZLIB);
+		OutData.AddUninitialized(OutRecord.CompressedSize);
+		verify(FCompression::CompressMemory(ECompressionFlags::COMPRESS_ZLIB, OutData.GetData() + OutRecord.Offset, OutRecord.CompressedSize, ToBinary.GetData(), ToBinary.Num()));
+		OutData.SetNum(OutRecord.Offset + OutRecord.CompressedSize, false);
+	}
+}
+
+/**
+ * Convert the Id of a depth 0 chunk from the base 9 encoding of old saves to a Morton key
+ * @param	Depth	Depth of the world
+ * @return	0 if Id is not a valid base 9 Id. 0 is never a valid Morton key
+ */
+static uint64 GetMortonIdFromBase9Id(uint64 Id, int Depth)
+{
+	uint64 Pow = 1;
+	for (int Level = 0; Level < Depth - 1; Level++)
+	{
+		Pow *= 9;
+	}
+
+	// Base 9 digits from the root: 1 + index of the child at each level
+	uint64 MortonId = FOctree::GetTopIdFromDepth(Depth);
+	for (int Level = Depth - 1; Level >= 0; Level--)
+	{
+		const int Digit = (Id / Pow) % 9;
+		if (Digit < 1 || 8 < Digit)
+		{
+			return 0;
+		}
+		MortonId = FOctree::GetChildId(MortonId, Digit - 1);
+		Pow /= 9;
+	}
+	return MortonId;
+}
+
+TArray<FVoxelChunkSave> FVoxelWorldSave::GetChunksList() const
+{
+	if (Version < EVoxelSaveVersion::IndexedChunks)
+	{
+		return GetChunksListFromStream();
+	}
+
+	// Decompress in parallel, then resolve the references in order
+	TArray<FVoxelChunkSave> Chunks;
+	TArray<bool> ChunksRead;
+	Chunks.SetNum(Records.Num());
+	ChunksRead.SetNum(Records.Num());
+	ParallelFor(Records.Num(), [&](int32 Index)
+	{
+		ChunksRead[Index] = ReadChunk(Records[Index], Chunks[Index]);
+	});
+
+	TArray<FVoxelChunkSave> ChunksList;
+	TMap<uint64, int32> IndicesById;
+	ChunksList.Reserve(Chunks.Num());
+
+	for (int Index = 0; Index < Chunks.Num(); Index++)
+	{
+		FVoxelChunkSave& Chunk = Chunks[Index];
+		if (ChunksRead[Index] && ResolveChunk(Chunk, ChunksList, IndicesById))
+		{
+			IndicesById.Add(Chunk.Id, ChunksList.Num());
+			ChunksList.Add(MoveTemp(Chunk));
+		}
+	}
 
-	// Send entire binary array/archive to compressor
-	Compressor << ToBinary;
+	return ChunksList;
+}
+
+TArray<FVoxelChunkSave> FVoxelWorldSave::GetChunksListInBox(const FVoxelBox& Box) const
+{
+	TArray<FVoxelChunkSave> ChunksList;
+
+	if (Version < EVoxelSaveVersion::IndexedChunks)
+	{
+		// Everything has to be decompressed anyway
+		for (auto& Chunk : GetChunksListFromStream())
+		{
+			const FIntVector ChunkMin = FOctree::GetLeafMinimalCornerFromId(Chunk.Id, Depth);
+			if (Box.Intersect(FVoxelBox(ChunkMin, ChunkMin + FIntVector(15, 15, 15))))
+			{
+				ChunksList.Add(MoveTemp(Chunk));
+			}
+		}
+		return ChunksList;
+	}
+
+	TMap<uint64, int32> IndicesById;
+
+	for (auto& Record : Records)
+	{
+		const FIntVector ChunkMin = FOctree::GetLeafMinimalCornerFromId(Record.Id, Depth);
+		if (!Box.Intersect(FVoxelBox(ChunkMin, ChunkMin + FIntVector(15, 15, 15))))
+		{
+			continue;
+		}
+
+		FVoxelChunkSave Chunk;
+		if (ReadChunk(Record, Chunk) && ResolveChunk(Chunk, ChunksList, IndicesById))
+		{
+			IndicesById.Add(Chunk.Id, ChunksList.Num());
+			ChunksList.Add(MoveTemp(Chunk));
+		}
+	}
 
-	// Send archive serialized data to binary array
-	Compressor.Flush();
+	return ChunksList;
 }
 
-std::list<FVoxelChunkSave> FVoxelWorldSave::GetChunksList() const
+TArray<FVoxelChunkSave> FVoxelWorldSave::GetChunksListFromStream() const
 {
-	std::list<FVoxelChunkSave> ChunksList;
+	TArray<FVoxelChunkSave> ChunksList;
 
 	FArchiveLoadCompressedProxy Decompressor = FArchiveLoadCompressedProxy(Data, ECompressionFlags::COMPRESS_ZLIB);
 
@@ -77,46 +271,374 @@ std::list<FVoxelChunkSave> FVoxelWorldSave::GetChunksList() const
 	FMemoryReader FromBinary = FMemoryReader(DecompressedBinaryArray);
 	FromBinary.Seek(0);
 
+	// Chunks that can be referenced by the next ones
+	TMap<uint64, int32> IndicesById;
+
 	while (!FromBinary.AtEnd())
 	{
 		FVoxelChunkSave Chunk;
-		FromBinary << Chunk;
+		SerializeVoxelChunk(FromBinary, Chunk, Version);
+
+		if (Version == EVoxelSaveVersion::Base9Ids)
+		{
+			const uint64 MortonId = GetMortonIdFromBase9Id(Chunk.Id, Depth);
+			if (!MortonId)
+			{
+				UE_LOG(LogVoxel, Error, TEXT("LoadFromSave: Invalid chunk Id %llu"), Chunk.Id);
+				continue;
+			}
+			Chunk.Id = MortonId;
+		}
+
+		if (!ResolveChunk(Chunk, ChunksList, IndicesById))
+		{
+			continue;
+		}
 
 		// Order matters
-		ChunksList.push_back(Chunk);
+		IndicesById.Add(Chunk.Id, ChunksList.Num());
+		ChunksList.Add(MoveTemp(Chunk));
 	}
 
 	return ChunksList;
 }
 
-FVoxelValueDiff::FVoxelValueDiff()
-	: Id(-1)
-	, Index(-1)
-	, Value(0)
+bool FVoxelWorldSave::ReadChunk(const FVoxelChunkRecord& Record, FVoxelChunkSave& OutChunk) const
 {
+	if (Record.Offset < 0 || Record.CompressedSize < 0 || Record.Offset + Record.CompressedSize > Data.Num())
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Invalid save: chunk %llu is out of the data"), Record.Id);
+		return false;
+	}
 
+	TArray<uint8> Uncompressed;
+	if (Version >= EVoxelSaveVersion::ZSTDChunks)
+	{
+		TPSZSTDBufferData Decompressed = FZSTDUtils::DecompressData(Data.GetData() + Record.Offset, Record.CompressedSize);
+		if (!Decompressed.IsValid() || Decompressed->BufferSize != Record.UncompressedSize)
+		{
+			UE_LOG(LogVoxel, Error, TEXT("Invalid save: can't decompress chunk %llu"), Record.Id);
+			return false;
+		}
+		Uncompressed.Append(static_cast<const uint8*>(Decompressed->Buffer), Decompressed->BufferSize);
+	}
+	else
+	{
+		Uncompressed.SetNumUninitialized(Record.UncompressedSize);
+		if (!FCompression::UncompressMemory(ECompressionFlags::COMPRESS_ZLIB, Uncompressed.GetData(), Record.UncompressedSize, Data.GetData() + Record.Offset, Record.CompressedSize))
+		{
+			UE_LOG(LogVoxel, Error, TEXT("Invalid save: can't decompress chunk %llu"), Record.Id);
+			return false;
+		}
+	}
+
+	FMemoryReader FromBinary = FMemoryReader(Uncompressed);
+	SerializeVoxelChunk(FromBinary, OutChunk, Version);
+
+	return !FromBinary.IsError() && OutChunk.Id == Record.Id;
 }
 
-FVoxelValueDiff::FVoxelValueDiff(uint64 Id, int Index, float Value)
-	: Id(Id)
-	, Index(Index)
-	, Value(Value)
+const FVoxelChunkRecord* FVoxelWorldSave::FindRecord(uint64 Id) const
+{
+	int Begin = 0;
+	int End = Records.Num();
+	while (Begin < End)
+	{
+		const int Middle = Begin + (End - Begin) / 2;
+		if (Records[Middle].Id < Id)
+		{
+			Begin = Middle + 1;
+		}
+		else
+		{
+			End = Middle;
+		}
+	}
+	return Begin < Records.Num() && Records[Begin].Id == Id ? &Records[Begin] : nullptr;
+}
+
+bool FVoxelWorldSave::ResolveChunk(FVoxelChunkSave& Chunk, const TArray<FVoxelChunkSave>& LoadedChunks, const TMap<uint64, int32>& LoadedIndices) const
 {
+	if (Chunk.SourceId == 0)
+	{
+		return true;
+	}
 
+	// Sources are never references themselves
+	FVoxelChunkSave ReadSource;
+	const FVoxelChunkSave* Source = nullptr;
+	if (const int32* LoadedIndex = LoadedIndices.Find(Chunk.SourceId))
+	{
+		Source = &LoadedChunks[*LoadedIndex];
+	}
+	else if (const FVoxelChunkRecord* SourceRecord = FindRecord(Chunk.SourceId))
+	{
+		if (ReadChunk(*SourceRecord, ReadSource) && ReadSource.SourceId == 0)
+		{
+			Source = &ReadSource;
+		}
+	}
+
+	if (!Source || Source->bResidual)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Invalid save: chunk %llu references unknown or residual chunk %llu"), Chunk.Id, Chunk.SourceId);
+		return false;
+	}
+
+	Chunk.Values = Source->Values;
+	Chunk.Materials = Source->Materials;
+	Chunk.SourceId = 0;
+	return true;
 }
 
-FVoxelMaterialDiff::FVoxelMaterialDiff()
+FVoxelLeafDiff::FVoxelLeafDiff()
 	: Id(-1)
-	, Index(-1)
-	, Material()
 {
 
 }
 
-FVoxelMaterialDiff::FVoxelMaterialDiff(uint64 Id, int Index, FVoxelMaterial Material)
+FVoxelLeafDiff::FVoxelLeafDiff(uint64 Id)
 	: Id(Id)
-	, Index(Index)
-	, Material(Material)
 {
+	ValueMask.SetNumZeroed(128);
+	MaterialMask.SetNumZeroed(128);
+}
+
+/**
+ * LEB128: 7 bits by byte, low bits first
+ */
+static void SerializeVarInt(FArchive& Ar, uint64& Value)
+{
+	if (Ar.IsLoading())
+	{
+		Value = 0;
+		for (int Shift = 0; Shift < 64 && !Ar.IsError(); Shift += 7)
+		{
+			uint8 Byte = 0;
+			Ar << Byte;
+			Value |= (uint64)(Byte & 0x7F) << Shift;
+			if (!(Byte & 0x80))
+			{
+				return;
+			}
+		}
+		Ar.SetError();
+	}
+	else
+	{
+		uint64 Remaining = Value;
+		do
+		{
+			uint8 Byte = Remaining & 0x7F;
+			Remaining >>= 7;
+			if (Remaining)
+			{
+				Byte |= 0x80;
+			}
+			Ar << Byte;
+		} while (Remaining);
+	}
+}
+
+static int GetVarIntSize(uint64 Value)
+{
+	int Size = 1;
+	while (Value >>= 7)
+	{
+		Size++;
+	}
+	return Size;
+}
+
+static int CountMaskBits(const TArray<uint32>& Mask)
+{
+	int Count = 0;
+	for (uint32 Bits : Mask)
+	{
+		for (; Bits; Bits &= Bits - 1)
+		{
+			Count++;
+		}
+	}
+	return Count;
+}
+
+namespace EVoxelDiffMaskEncoding
+{
+	enum Type : uint8
+	{
+		// Lengths of the alternating runs of clear and set bits, starting with clear
+		Runs = 0,
+		// The 128 words
+		Raw = 1,
+		// Same as the value mask
+		SameAsValues = 2
+	};
+}
+
+/**
+ * @param	ValueMask	Mask already serialized that Mask can reference, nullptr if none
+ */
+static void SerializeDiffMask(FArchive& Ar, TArray<uint32>& Mask, const TArray<uint32>* ValueMask)
+{
+	uint8 Encoding = EVoxelDiffMaskEncoding::Runs;
+	TArray<uint64> Runs;
+
+	if (Ar.IsSaving())
+	{
+		check(Mask.Num() == 128);
+		if (ValueMask && FMemory::Memcmp(Mask.GetData(), ValueMask->GetData(), 128 * sizeof(uint32)) == 0)
+		{
+			Encoding = EVoxelDiffMaskEncoding::SameAsValues;
+		}
+		else
+		{
+			// Edits are spatially coherent: few runs, except for noisy masks that are sent raw
+			bool bSet = false;
+			uint64 Length = 0;
+			int Size = 0;
+			for (int Index = 0; Index < 16 * 16 * 16; Index++)
+			{
+				const bool bBit = (Mask[Index / 32] & (1u << (Index % 32))) != 0;
+				if (bBit != bSet)
+				{
+					Runs.Add(Length);
+					Size += GetVarIntSize(Length);
+					bSet = bBit;
+					Length = 0;
+				}
+				Length++;
+			}
+			Runs.Add(Length);
+			Size += GetVarIntSize(Length);
+
+			Encoding = Size < (int)(128 * sizeof(uint32)) ? EVoxelDiffMaskEncoding::Runs : EVoxelDiffMaskEncoding::Raw;
+		}
+	}
+
+	Ar << Encoding;
+
+	if (Ar.IsLoading())
+	{
+		Mask.SetNumZeroed(128);
+	}
+
+	if (Encoding == EVoxelDiffMaskEncoding::SameAsValues)
+	{
+		if (!ValueMask)
+		{
+			Ar.SetError();
+			return;
+		}
+		Mask = *ValueMask;
+	}
+	else if (Encoding == EVoxelDiffMaskEncoding::Raw)
+	{
+		Ar.Serialize(Mask.GetData(), 128 * sizeof(uint32));
+	}
+	else if (Encoding == EVoxelDiffMaskEncoding::Runs)
+	{
+		if (Ar.IsSaving())
+		{
+			for (uint64& Length : Runs)
+			{
+				SerializeVarInt(Ar, Length);
+			}
+		}
+		else
+		{
+			bool bSet = false;
+			uint64 Index = 0;
+			for (int Run = 0; Index < 16 * 16 * 16 && !Ar.IsError(); Run++, bSet = !bSet)
+			{
+				uint64 Length = 0;
+				SerializeVarInt(Ar, Length);
+				// Only the first run can be empty, when the first bit is set
+				if ((Length == 0 && Run > 0) || Length > 16 * 16 * 16 - Index)
+				{
+					Ar.SetError();
+					return;
+				}
+				if (bSet)
+				{
+					for (uint64 End = Index + Length; Index < End; Index++)
+					{
+						Mask[Index / 32] |= 1u << (Index % 32);
+					}
+				}
+				else
+				{
+					Index += Length;
+				}
+			}
+		}
+	}
+	else
+	{
+		Ar.SetError();
+	}
+}
+
+/**
+ * Run-length coding of Elements: run length then element
+ * @param	Num		Number of elements, known from the mask
+ */
+template<typename T>
+static void SerializeDiffRuns(FArchive& Ar, TArray<T>& Elements, int Num)
+{
+	if (Ar.IsLoading())
+	{
+		Elements.Reset(Num);
+		while (Elements.Num() < Num && !Ar.IsError())
+		{
+			uint64 Length = 0;
+			T Element;
+			SerializeVarInt(Ar, Length);
+			Ar << Element;
+			if (Length == 0 || Length > (uint64)(Num - Elements.Num()))
+			{
+				Ar.SetError();
+				return;
+			}
+			for (uint64 Index = 0; Index < Length; Index++)
+			{
+				Elements.Add(Element);
+			}
+		}
+	}
+	else
+	{
+		check(Elements.Num() == Num);
+		int Begin = 0;
+		while (Begin < Num)
+		{
+			// Bitwise comparison: the decoded values are exactly the sent ones
+			int End = Begin + 1;
+			while (End < Num && FMemory::Memcmp(&Elements[End], &Elements[Begin], sizeof(T)) == 0)
+			{
+				End++;
+			}
+			uint64 Length = End - Begin;
+			SerializeVarInt(Ar, Length);
+			Ar << Elements[Begin];
+			Begin = End;
+		}
+	}
+}
+
+void SerializeVoxelLeafDiff(FArchive& Ar, FVoxelLeafDiff& Diff, uint64 PreviousId)
+{
+	uint64 IdDelta = Diff.Id - PreviousId;
+	SerializeVarInt(Ar, IdDelta);
+	Diff.Id = PreviousId + IdDelta;
+
+	SerializeDiffMask(Ar, Diff.ValueMask, nullptr);
+	SerializeDiffMask(Ar, Diff.MaterialMask, &Diff.ValueMask);
+	if (Ar.IsError())
+	{
+		return;
+	}
 
+	SerializeDiffRuns(Ar, Diff.Values, CountMaskBits(Diff.ValueMask));
+	SerializeDiffRuns(Ar, Diff.Materials, CountMaskBits(Diff.MaterialMask));
 }
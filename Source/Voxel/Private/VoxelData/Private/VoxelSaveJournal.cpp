@@ -0,0 +1,404 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelPrivate.h"
+#include "VoxelSaveJournal.h"
+#include "VoxelSave.h"
+#include "HAL/PlatformFilemanager.h"
+#include "Misc/Paths.h"
+#include "BufferArchive.h"
+#include "MemoryReader.h"
+
+// 'VXJL'
+static const uint32 JournalMagic = 0x4C4A5856;
+// Magic, Version, Depth, ValueBits
+static const int64 HeaderSize = 16;
+// Type, Id, CompressedSize, UncompressedSize
+static const int64 RecordHeaderSize = 17;
+// Smaller journals are never compacted
+static const int64 MinCompactionSize = 1024 * 1024;
+
+FVoxelSaveJournal::FVoxelSaveJournal(const FString& Filename, int Depth)
+	: Filename(Filename)
+	, Depth(Depth)
+	, Version(EVoxelSaveVersion::Latest)
+	, File(nullptr)
+	, FileSize(0)
+	, LiveSize(0)
+{
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+
+	// Crash between the delete and the move of a compaction
+	const FString TempFilename = Filename + TEXT(".tmp");
+	if (!PlatformFile.FileExists(*Filename) && PlatformFile.FileExists(*TempFilename))
+	{
+		PlatformFile.MoveFile(*Filename, *TempFilename);
+	}
+
+	if (PlatformFile.FileExists(*Filename))
+	{
+		if (!ReadRecords())
+		{
+			return;
+		}
+
+		if (PlatformFile.FileSize(*Filename) != FileSize)
+		{
+			// Last record was only partially written: drop it
+			UE_LOG(LogVoxel, Warning, TEXT("Save journal: %s ends with an incomplete record. Compacting it"), *Filename);
+			Compact();
+		}
+		else
+		{
+			File = PlatformFile.OpenWrite(*Filename, true, false);
+		}
+	}
+	else
+	{
+		PlatformFile.CreateDirectoryTree(*FPaths::GetPath(Filename));
+
+		File = PlatformFile.OpenWrite(*Filename, false, false);
+		if (File && !WriteHeader(*File))
+		{
+			delete File;
+			File = nullptr;
+		}
+		FileSize = HeaderSize;
+	}
+
+	if (!File)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: Can't open %s"), *Filename);
+	}
+}
+
+FVoxelSaveJournal::~FVoxelSaveJournal()
+{
+	delete File;
+}
+
+bool FVoxelSaveJournal::IsValid() const
+{
+	return File != nullptr;
+}
+
+int FVoxelSaveJournal::GetVersion() const
+{
+	return Version;
+}
+
+bool FVoxelSaveJournal::AppendChunks(TArray<FVoxelChunkSave>& NewChunks)
+{
+	if (!File)
+	{
+		return false;
+	}
+
+	TArray<uint8> Compressed;
+	for (auto& Chunk : NewChunks)
+	{
+		// Chunks of the journal can't reference each other: the source could be replaced
+		check(Chunk.SourceId == 0);
+
+		FVoxelChunkRecord Compression;
+		Compressed.Reset();
+		FVoxelWorldSave::CompressChunk(Chunk, Version, Compressed, Compression);
+
+		if (!WriteRecord(ERecordType::Chunk, Chunk.Id, Compressed.GetData(), Compression.CompressedSize, Compression.UncompressedSize))
+		{
+			return false;
+		}
+
+		if (const FChunkRecord* OldRecord = Chunks.Find(Chunk.Id))
+		{
+			LiveSize -= RecordHeaderSize + OldRecord->CompressedSize;
+		}
+
+		FChunkRecord Record;
+		Record.Offset = FileSize - Compression.CompressedSize;
+		Record.CompressedSize = Compression.CompressedSize;
+		Record.UncompressedSize = Compression.UncompressedSize;
+		Chunks.Add(Chunk.Id, Record);
+		LiveSize += RecordHeaderSize + Record.CompressedSize;
+	}
+
+	File->Flush();
+	return true;
+}
+
+bool FVoxelSaveJournal::AppendReset()
+{
+	if (!File || !WriteRecord(ERecordType::Reset, 0, nullptr, 0, 0))
+	{
+		return false;
+	}
+
+	Chunks.Empty();
+	LiveSize = 0;
+
+	File->Flush();
+	return true;
+}
+
+bool FVoxelSaveJournal::NeedsCompaction() const
+{
+	return File && FileSize > MinCompactionSize && FileSize - HeaderSize > 2 * LiveSize;
+}
+
+bool FVoxelSaveJournal::Compact()
+{
+	if (FileSize < HeaderSize)
+	{
+		// The file isn't a journal of this world: don't overwrite it
+		return false;
+	}
+
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	const FString TempFilename = Filename + TEXT(".tmp");
+
+	// Everything written must be readable
+	delete File;
+	File = nullptr;
+
+	TUniquePtr<IFileHandle> Reader(PlatformFile.OpenRead(*Filename));
+	TUniquePtr<IFileHandle> Writer(PlatformFile.OpenWrite(*TempFilename, false, false));
+
+	bool bSuccess = Reader.IsValid() && Writer.IsValid() && WriteHeader(*Writer);
+
+	// Sorted by Id so that the compacted journal is read in order
+	TArray<uint64> Ids;
+	Chunks.GetKeys(Ids);
+	Ids.Sort();
+
+	TMap<uint64, FChunkRecord> NewChunks;
+	int64 NewFileSize = HeaderSize;
+	TArray<uint8> Compressed;
+	for (int Index = 0; bSuccess && Index < Ids.Num(); Index++)
+	{
+		const FChunkRecord& Record = Chunks[Ids[Index]];
+
+		Compressed.SetNumUninitialized(Record.CompressedSize, false);
+		bSuccess = Reader->Seek(Record.Offset) && Reader->Read(Compressed.GetData(), Record.CompressedSize);
+
+		FBufferArchive RecordHeader;
+		uint8 Type = (uint8)ERecordType::Chunk;
+		uint64 Id = Ids[Index];
+		int32 CompressedSize = Record.CompressedSize;
+		int32 UncompressedSize = Record.UncompressedSize;
+		RecordHeader << Type << Id << CompressedSize << UncompressedSize;
+
+		bSuccess = bSuccess && Writer->Write(RecordHeader.GetData(), RecordHeader.Num()) && Writer->Write(Compressed.GetData(), Record.CompressedSize);
+
+		FChunkRecord NewRecord = Record;
+		NewRecord.Offset = NewFileSize + RecordHeaderSize;
+		NewChunks.Add(Id, NewRecord);
+		NewFileSize += RecordHeaderSize + Record.CompressedSize;
+	}
+
+	// Close them before replacing the file
+	Reader.Reset();
+	Writer.Reset();
+
+	if (bSuccess)
+	{
+		bSuccess = PlatformFile.DeleteFile(*Filename) && PlatformFile.MoveFile(*Filename, *TempFilename);
+	}
+
+	if (bSuccess)
+	{
+		UE_LOG(LogVoxel, Log, TEXT("Save journal: Compacted %s from %lld to %lld bytes"), *Filename, FileSize, NewFileSize);
+
+		Chunks = MoveTemp(NewChunks);
+		FileSize = NewFileSize;
+		LiveSize = NewFileSize - HeaderSize;
+	}
+	else
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: Compaction of %s failed"), *Filename);
+		PlatformFile.DeleteFile(*TempFilename);
+	}
+
+	// Keep appending to the old file if the compaction failed
+	File = PlatformFile.OpenWrite(*Filename, true, false);
+
+	return bSuccess && File;
+}
+
+bool FVoxelSaveJournal::GetSave(FVoxelWorldSave& OutSave) const
+{
+	if (!File)
+	{
+		return false;
+	}
+
+	TUniquePtr<IFileHandle> Reader(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*Filename));
+	if (!Reader.IsValid())
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: Can't read %s"), *Filename);
+		return false;
+	}
+
+	TArray<uint64> Ids;
+	Chunks.GetKeys(Ids);
+	Ids.Sort();
+
+	OutSave.Depth = Depth;
+	OutSave.ValueBits = VOXEL_VALUE_BITS;
+	OutSave.Version = Version;
+	OutSave.Data.Reset(LiveSize);
+	OutSave.Records.Reset(Ids.Num());
+
+	for (uint64 Id : Ids)
+	{
+		const FChunkRecord& Record = Chunks[Id];
+
+		FVoxelChunkRecord SaveRecord;
+		SaveRecord.Id = Id;
+		SaveRecord.Offset = OutSave.Data.Num();
+		SaveRecord.CompressedSize = Record.CompressedSize;
+		SaveRecord.UncompressedSize = Record.UncompressedSize;
+
+		OutSave.Data.AddUninitialized(Record.CompressedSize);
+		if (!Reader->Seek(Record.Offset) || !Reader->Read(OutSave.Data.GetData() + SaveRecord.Offset, Record.CompressedSize))
+		{
+			UE_LOG(LogVoxel, Error, TEXT("Save journal: Can't read chunk %llu from %s"), Id, *Filename);
+			return false;
+		}
+
+		OutSave.Records.Add(SaveRecord);
+	}
+
+	return true;
+}
+
+bool FVoxelSaveJournal::ReadRecords()
+{
+	TUniquePtr<IFileHandle> Reader(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*Filename));
+	if (!Reader.IsValid())
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: Can't read %s"), *Filename);
+		return false;
+	}
+
+	const int64 Size = Reader->Size();
+
+	TArray<uint8> Header;
+	Header.SetNumUninitialized(HeaderSize);
+	if (Size < HeaderSize || !Reader->Read(Header.GetData(), HeaderSize))
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: %s is not a save journal"), *Filename);
+		return false;
+	}
+
+	uint32 Magic;
+	int32 JournalVersion;
+	int32 JournalDepth;
+	int32 ValueBits;
+	FMemoryReader HeaderReader(Header);
+	HeaderReader << Magic << JournalVersion << JournalDepth << ValueBits;
+
+	if (Magic != JournalMagic)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: %s is not a save journal"), *Filename);
+		return false;
+	}
+	if (JournalVersion < EVoxelSaveVersion::IndexedChunks || JournalVersion > EVoxelSaveVersion::Latest || ValueBits != VOXEL_VALUE_BITS)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: %s was made by an incompatible version of the plugin"), *Filename);
+		return false;
+	}
+	if (JournalDepth != Depth)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: %s is for a world of depth %d, not %d"), *Filename, JournalDepth, Depth);
+		return false;
+	}
+
+	// Chunks of different versions can't be in the same save: keep appending with the version of the file
+	Version = JournalVersion;
+	FileSize = HeaderSize;
+
+	TArray<uint8> RecordHeader;
+	RecordHeader.SetNumUninitialized(RecordHeaderSize);
+	while (FileSize + RecordHeaderSize <= Size)
+	{
+		if (!Reader->Seek(FileSize) || !Reader->Read(RecordHeader.GetData(), RecordHeaderSize))
+		{
+			break;
+		}
+
+		uint8 Type;
+		uint64 Id;
+		int32 CompressedSize;
+		int32 UncompressedSize;
+		FMemoryReader RecordReader(RecordHeader);
+		RecordReader << Type << Id << CompressedSize << UncompressedSize;
+
+		if (CompressedSize < 0 || FileSize + RecordHeaderSize + CompressedSize > Size)
+		{
+			// Incomplete
+			break;
+		}
+
+		if (Type == (uint8)ERecordType::Reset)
+		{
+			Chunks.Empty();
+			LiveSize = 0;
+		}
+		else if (Type == (uint8)ERecordType::Chunk)
+		{
+			if (const FChunkRecord* OldRecord = Chunks.Find(Id))
+			{
+				LiveSize -= RecordHeaderSize + OldRecord->CompressedSize;
+			}
+
+			FChunkRecord Record;
+			Record.Offset = FileSize + RecordHeaderSize;
+			Record.CompressedSize = CompressedSize;
+			Record.UncompressedSize = UncompressedSize;
+			Chunks.Add(Id, Record);
+			LiveSize += RecordHeaderSize + CompressedSize;
+		}
+		else
+		{
+			break;
+		}
+
+		FileSize += RecordHeaderSize + CompressedSize;
+	}
+
+	return true;
+}
+
+bool FVoxelSaveJournal::WriteHeader(IFileHandle& Handle) const
+{
+	uint32 Magic = JournalMagic;
+	int32 JournalVersion = Version;
+	int32 JournalDepth = Depth;
+	int32 ValueBits = VOXEL_VALUE_BITS;
+
+	FBufferArchive Header;
+	Header << Magic << JournalVersion << JournalDepth << ValueBits;
+	check(Header.Num() == HeaderSize);
+
+	return Handle.Write(Header.GetData(), Header.Num());
+}
+
+bool FVoxelSaveJournal::WriteRecord(ERecordType Type, uint64 Id, const uint8* Data, int32 CompressedSize, int32 UncompressedSize)
+{
+	uint8 RecordType = (uint8)Type;
+
+	FBufferArchive RecordHeader;
+	RecordHeader << RecordType << Id << CompressedSize << UncompressedSize;
+	check(RecordHeader.Num() == RecordHeaderSize);
+
+	if (!File->Write(RecordHeader.GetData(), RecordHeader.Num()) || (CompressedSize > 0 && !File->Write(Data, CompressedSize)))
+	{
+		// The file now ends with an incomplete record: stop writing to it. It is dropped when reopening the journal
+		UE_LOG(LogVoxel, Error, TEXT("Save journal: Write failed in %s"), *Filename);
+		delete File;
+		File = nullptr;
+		return false;
+	}
+
+	FileSize += RecordHeaderSize + CompressedSize;
+	return true;
+}
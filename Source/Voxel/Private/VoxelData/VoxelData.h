@@ -4,11 +4,19 @@
 
 #include "CoreMinimal.h"
 #include "VoxelMaterial.h"
-#include <list>
+#include "VoxelBox.h"
+#include "Misc/ScopeRWLock.h"
+#include "Misc/ScopeLock.h"
 
 class FValueOctree;
+template<typename T> class TOctreeBlockPool;
 class UVoxelWorldGenerator;
-class FEvent;
+class FVoxelDataSnapshot;
+class FVoxelLeafDataPool;
+class FVoxelLeafPager;
+class FVoxelSaveJournal;
+struct FVoxelLeafEdit;
+struct FVoxelChunkSave;
 
 /**
  * Class that handle voxel data. Mainly an interface to FValueOctree
@@ -20,30 +28,94 @@ public:
 	 * Constructor
 	 * @param	Depth			Depth of this world; Width = 16 * 2^Depth
 	 * @param	WorldGenerator	Generator for this world
+	 * @param	bEnablePaging	Allow paging out the idle leaves to disk with PageOutIdleLeaves
 	 */
-	FVoxelData(int Depth, UVoxelWorldGenerator* WorldGenerator, bool bMultiplayer);
+	FVoxelData(int Depth, UVoxelWorldGenerator* WorldGenerator, bool bMultiplayer, bool bEnablePaging = false);
 	~FVoxelData();
 
 	// Depth of the octree
 	const int Depth;
 	const bool bMultiplayer;
 
+	/**
+	 * Record the edited voxels to send them at next network sync. Only the server sends them: clients must disable it,
+	 * else their network dirty data grows forever. Enabled by default if multiplayer
+	 * @param	bRecord		If false, the voxels already recorded are forgotten
+	 */
+	void SetRecordNetworkDiffs(bool bRecord);
+
 	UVoxelWorldGenerator* const WorldGenerator;
 
 	// Size = 16 * 2^Depth
 	FORCEINLINE int Size() const;
+	// Size of the regions locked independently
+	FORCEINLINE int RegionSize() const;
 	FORCEINLINE FIntVector GetMinimalCornerPosition() const;
 	FORCEINLINE FIntVector GetMaximalCornerPosition() const;
 
-	// TODO: Doc
+	/**
+	 * Lock the whole world for writing/reading. Prefer the box versions when the edit or read is localized
+	 */
 	void BeginSet();
 	void EndSet();
 
 	void BeginGet();
 	void EndGet();
 
+	/**
+	 * Lock only the regions overlapping Box. Edits and reads in other regions can run concurrently
+	 * @param	Box		Box in voxel space. Clamped to the world
+	 */
+	void BeginSet(const FVoxelBox& Box);
+	void EndSet(const FVoxelBox& Box);
+
+	void BeginGet(const FVoxelBox& Box);
+	void EndGet(const FVoxelBox& Box);
+
+	/**
+	 * Discard all the edits. The whole world must be locked for writing
+	 */
 	void Reset();
 
+	/**
+	 * Lock the whole world and discard all the edits. Destroys the leaves: only from the game thread
+	 * @param	OutModifiedBoxes	Boxes of the discarded edits
+	 */
+	void ResetAndGetModifiedBoxes(std::forward_list<FVoxelBox>& OutModifiedBoxes);
+
+	// Seconds without edits after which the data of a leaf is shared with the identical leaves
+	static const int32 ShareIdleTime = 2;
+
+	/**
+	 * Share the data of the leaves not edited for ShareIdleTime with the identical leaves, to save memory.
+	 * Data are hashed without any lock, then each region is locked for writing only to swap them
+	 */
+	void ShareIdleLeavesData();
+
+	/**
+	 * Compress the modified voxels of the leaves not read nor modified for IdleTime to disk. They are paged back in when used.
+	 * Data are compressed and written without any lock, then each region is locked for writing only to swap them. Does nothing if paging is disabled
+	 * @param	IdleTime	In seconds
+	 * @return	Number of leaves paged out
+	 */
+	int PageOutIdleLeaves(float IdleTime);
+
+	/**
+	 * Apply edits to a leaf. The leaf must be locked for writing
+	 * @param	LeafMin		Minimal corner of the leaf
+	 * @param	Edits		Edits of voxels of this leaf, applied in order
+	 * @param	bMarkNetworkDirty	Send the edited voxels at next network sync. false if the edit is replicated another way
+	 */
+	void SetLeafValuesAndMaterials(const FIntVector& LeafMin, const TArray<FVoxelLeafEdit>& Edits, bool bMarkNetworkDirty = true);
+
+	/**
+	 * Create a snapshot of the data in Box. Only locks Box while creating it: reading from the snapshot doesn't block edits
+	 * @param	Box			Box in voxel space
+	 * @param	MipDepth	Depth of the nodes whose mips are captured, built if needed, for reads with Step = 2^MipDepth. 0 for none
+	 * @return	Snapshot
+	 */
+	TSharedRef<FVoxelDataSnapshot> CreateSnapshot(const FVoxelBox& Box, int MipDepth = 0);
+
 	/**
 	* Get value and color at position
 	* @param	Position	Position in voxel space
@@ -84,38 +156,151 @@ public:
 	FORCEINLINE void ClampToWorld(int& X, int& Y, int& Z) const;
 
 	/**
-	 * Get save array of this world
+	 * Get save array of this world. Only locks the world while copying the chunks: can be called from any thread
 	 * @return SaveArray
 	 */
 	void GetSave(FVoxelWorldSave& OutSave);
 
 	/**
-	 * Load this world from save array
+	 * Start recording the modified leaves for AppendToJournal. Forgets the ones recorded so far: Journal must be up to date with this world
+	 */
+	void StartJournalTracking();
+
+	/**
+	 * Append the leaves modified since the last call, or since StartJournalTracking, to Journal.
+	 * Only locks one leaf at a time, and doesn't read the leaves that weren't modified
+	 * @return	false if the write failed. The leaves are then appended on the next call
+	 */
+	bool AppendToJournal(FVoxelSaveJournal& Journal);
+
+	/**
+	 * Load this world from save array. Decompresses before locking the world: can be called from any thread if bReset is false
 	 * @param	SaveArray	Array to load from
 	 * @param	World		VoxelWorld
-	 * @param	bReset		Reset all chunks?
+	 * @param	bReset		Reset all chunks? Destroys the leaves: only from the game thread
+	 */
+	void LoadFromSaveAndGetModifiedBoxes(FVoxelWorldSave& Save, std::forward_list<FVoxelBox>& OutModifiedBoxes, bool bReset);
+
+	/**
+	 * Load the chunks of the save overlapping Box, without decompressing the others. Other chunks of the world are kept
+	 * @param	Box		Box in voxel space
+	 */
+	void LoadBoxFromSaveAndGetModifiedBoxes(FVoxelWorldSave& Save, const FVoxelBox& Box, std::forward_list<FVoxelBox>& OutModifiedBoxes);
+
+	/**
+	 * Get the leaves modified since the last call, to allow network transmission. Locks the regions one by one, for reading
+	 * @param	OutDiffs	One diff by leaf, sorted by increasing Id
 	 */
-	void LoadFromSaveAndGetModifiedPositions(FVoxelWorldSave& Save, std::forward_list<FIntVector>& OutModifiedPositions, bool bReset);
+	void GetDiffs(TArray<FVoxelLeafDiff>& OutDiffs);
 
 	/**
-	 * Get sliced diff arrays to allow network transmission
-	 * @param	OutValueDiffPacketsList		Each packet is sorted by Id
-	 * @param	OutColorDiffPacketsList		Each packet is sorted by Id
+	 * Same as GetDiffs, for the leaves overlapping Box only. Box must be locked for reading or writing
+	 * @param	OutDiffs	The diffs of Box are appended to it, sorted by increasing Id
 	 */
-	void GetDiffLists(std::forward_list<FVoxelValueDiff>& OutValueDiffList, std::forward_list<FVoxelMaterialDiff>& OutMaterialDiffList);
+	void GetDiffsInBox(const FVoxelBox& Box, TArray<FVoxelLeafDiff>& OutDiffs);
 
 	/**
-	 * Load values and colors from diff arrays, and queue update of chunks that have changed
-	 * @param	ValueDiffArray	First element has lowest Id
-	 * @param	ColorDiffArray	First element has lowest Id
-	 * @param	World			Voxel world
+	 * Load values and colors from leaf diffs, and queue update of chunks that have changed
+	 * @param	Diffs	Any order: sorted by Id in place when loading. Diffs of the same leaf are applied in order. Move it in
 	 */
-	void LoadFromDiffListsAndGetModifiedPositions(std::forward_list<FVoxelValueDiff> ValueDiffList, std::forward_list<FVoxelMaterialDiff> MaterialDiffList, std::forward_list<FIntVector>& OutModifiedPositions);
+	void LoadFromDiffsAndGetModifiedBoxes(TArray<FVoxelLeafDiff> Diffs, std::forward_list<FVoxelBox>& OutModifiedBoxes);
 
 private:
 	TSharedPtr<FValueOctree> MainOctree;
 
-	FThreadSafeCounter GetCount;
-	FEvent* CanGetEvent;
-	FEvent* CanSetEvent;
+	// Number of octree levels above the regions. There are at most 8^RegionLevels regions
+	static const int RegionLevels = 2;
+
+	// Depth of the octree nodes that are the roots of the regions
+	const int RegionDepth;
+	// Number of regions along each axis
+	const int RegionCount;
+
+	// One reader/writer lock per region, indexed by X + RegionCount * Y + RegionCount * RegionCount * Z
+	FRWLock* RegionLocks;
+
+	// Locked by the readers building the mips of a region, same indexing as RegionLocks. Taken after the region lock
+	FCriticalSection* RegionMipSections;
+
+	// Childs pool of each region, same indexing as RegionLocks and protected by the region lock
+	TOctreeBlockPool<FValueOctree>* RegionBlockPools;
+	// Childs pool of the nodes above the regions. Only used when creating and destroying the octree
+	TOctreeBlockPool<FValueOctree>* TopBlockPool;
+
+	// Depth 0 leaves by minimal corner, for each region. Filled when writing, protected by the region lock
+	TArray<TMap<FIntVector, FValueOctree*>> RegionLeaves;
+
+	// Identical leaves data, shared between all the regions
+	FVoxelLeafDataPool* LeafDataPool;
+
+	// Time origin of the leaves edit times
+	const double StartTime;
+
+	// Null if paging is disabled
+	FVoxelLeafPager* LeafPager;
+
+	// Are the edited voxels recorded for the network?
+	FThreadSafeBool bRecordNetworkDiffs;
+	// Held while clearing the network dirty data of the leaves, which is done under read locks
+	FCriticalSection NetworkSection;
+
+	// Ids of the leaves modified since the last AppendToJournal, and whether the world was reset since. Protected by JournalSection
+	TSet<uint64> JournalLeaves;
+	bool bJournalTracking;
+	bool bJournalReset;
+	FCriticalSection JournalSection;
+
+	/**
+	 * Create the main octree, with all the nodes above the regions already created so that they are never modified afterwards.
+	 * Only called by the constructor: the main octree is never replaced
+	 */
+	void CreateOctree();
+
+	/**
+	 * Load chunks of a save. Must be locked for writing
+	 */
+	void LoadChunksAndGetModifiedBoxes(const TArray<FVoxelChunkSave>& SaveList, std::forward_list<FVoxelBox>& OutModifiedBoxes);
+
+	/**
+	 * Release the write locks of BeginSet
+	 */
+	void WriteUnlock(const FVoxelBox& Box);
+
+	/**
+	 * Lock the mips of the regions overlapping Box, to build them. The regions must be locked for reading
+	 */
+	void LockMips(const FVoxelBox& Box);
+	void UnlockMips(const FVoxelBox& Box);
+
+	/**
+	 * Get the regions overlapping Box
+	 * @param	Box		Box in voxel space
+	 * @return	OutMin	Min region coordinates, inclusive
+	 * @return	OutMax	Max region coordinates, inclusive
+	 */
+	FORCEINLINE void GetRegionsInBox(const FVoxelBox& Box, FIntVector& OutMin, FIntVector& OutMax) const;
+
+	FORCEINLINE FVoxelBox GetWorldBox() const;
+
+	/**
+	 * Get the box of a region
+	 * @param	X, Y, Z		Region coordinates
+	 */
+	FORCEINLINE FVoxelBox GetRegionBox(int X, int Y, int Z) const;
+
+	/**
+	 * Seconds since the creation of this
+	 */
+	FORCEINLINE int32 GetTime() const;
+
+	FORCEINLINE int GetRegionIndex(int X, int Y, int Z) const;
+
+	/**
+	 * Get the leaf at position. Uses the leaves index if possible. Region must be locked for reading
+	 */
+	FORCEINLINE FValueOctree* FindLeaf(int X, int Y, int Z) const;
+	/**
+	 * Get the depth 0 leaf at position, creating and indexing it if needed. Region must be locked for writing
+	 */
+	FORCEINLINE FValueOctree* FindOrCreateLeaf(int X, int Y, int Z);
 };
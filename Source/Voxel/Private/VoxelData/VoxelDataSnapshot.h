@@ -0,0 +1,70 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VoxelMaterial.h"
+#include "VoxelBox.h"
+
+class FVoxelLeafData;
+struct FVoxelMipData;
+class UVoxelWorldGenerator;
+
+/**
+ * Immutable copy of the voxel data in a box. Holds references to the leaves data, which are copied on write by FValueOctree:
+ * reading from a snapshot never blocks edits and always gives consistent values
+ */
+class FVoxelDataSnapshot
+{
+public:
+	/**
+	 * Constructor
+	 * @param	WorldGenerator	Generator of the current world
+	 * @param	Bounds			Box in voxel space that can be read
+	 * @param	MipDepth		Depth of the nodes whose mips are captured. 0 for none
+	 */
+	FVoxelDataSnapshot(UVoxelWorldGenerator* WorldGenerator, const FVoxelBox& Bounds, int MipDepth);
+
+	/**
+	 * Add the data of a dirty leaf. Only called by FValueOctree while the data is locked
+	 * @param	LeafMin		Minimal corner of the leaf
+	 * @param	LeafData	Data of the leaf
+	 */
+	void AddLeaf(const FIntVector& LeafMin, const TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>& LeafData);
+
+	/**
+	 * Add the mip of a modified node of depth MipDepth. Only called by FValueOctree while the data is locked
+	 * @param	NodeMin		Minimal corner of the node
+	 * @param	MipData		Mip of the node
+	 */
+	void AddMip(const FIntVector& NodeMin, const TSharedPtr<FVoxelMipData, ESPMode::ThreadSafe>& MipData);
+
+	FORCEINLINE int GetMipDepth() const;
+
+	/**
+	 * Get values and materials, with the same arguments as FVoxelData::GetValuesAndMaterials. All the positions must be in Bounds
+	 * Reads the mips instead of the leaves when Step and Start are aligned on them
+	 */
+	void GetValuesAndMaterials(float Values[], FVoxelMaterial Materials[], const FIntVector& Start, const FIntVector& StartIndex, const int Step, const FIntVector& Size, const FIntVector& ArraySize) const;
+
+	FORCEINLINE void GetValueAndMaterial(int X, int Y, int Z, float& OutValue, FVoxelMaterial& OutMaterial) const;
+
+	/**
+	 * Conservative bounds of the values in Box, from the world generator bounds and the modified leaves bounds
+	 * @param	Box		Box in voxel space
+	 * @return	false if the world generator bounds are unknown
+	 */
+	bool GetValueRange(const FVoxelBox& Box, float& OutMin, float& OutMax) const;
+
+	FORCEINLINE const FVoxelBox& GetBounds() const;
+
+private:
+	UVoxelWorldGenerator* const WorldGenerator;
+	const FVoxelBox Bounds;
+	const int MipDepth;
+
+	// Dirty leaves data, by leaf minimal corner
+	TMap<FIntVector, TSharedPtr<FVoxelLeafData, ESPMode::ThreadSafe>> Leaves;
+	// Mips of the modified nodes of depth MipDepth, by node minimal corner
+	TMap<FIntVector, TSharedPtr<FVoxelMipData, ESPMode::ThreadSafe>> Mips;
+};
@@ -0,0 +1,65 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VoxelMaterial.h"
+#include "VoxelBox.h"
+#include "VoxelLeafData.h"
+
+class FVoxelData;
+
+/**
+ * Accumulates value and material edits, then applies them leaf by leaf: each leaf is looked up once for all its edits.
+ * Edits computed from the current data must be read and applied under the same BeginSet: see ApplyLocked
+ */
+class FVoxelEditBatch
+{
+public:
+	/**
+	 * @param	bMarkNetworkDirty	Send the edited voxels at next network sync. false if the edit is replicated another way
+	 */
+	FVoxelEditBatch(FVoxelData* Data, bool bMarkNetworkDirty = true);
+
+	/**
+	 * Queue an edit. Position must be in the world. Later edits of the same voxel win
+	 */
+	void SetValue(int X, int Y, int Z, float Value);
+	void SetMaterial(int X, int Y, int Z, const FVoxelMaterial& Material);
+	void SetValueAndMaterial(int X, int Y, int Z, float Value, const FVoxelMaterial& Material);
+
+	/**
+	 * Number of queued edits
+	 */
+	FORCEINLINE int Num() const;
+
+	/**
+	 * Apply the queued edits and clear them. Each leaf is write locked only while its edits are applied
+	 * @param	OutModifiedBoxes	Bounds of the edited voxels of each modified leaf, to update the chunks
+	 */
+	void Apply(TArray<FVoxelBox>& OutModifiedBoxes);
+
+	/**
+	 * Same as Apply, for a caller that already locked a box containing all the edits with BeginSet. Its EndSet finalizes the leaves
+	 */
+	void ApplyLocked(TArray<FVoxelBox>& OutModifiedBoxes);
+
+private:
+	struct FEdit
+	{
+		FIntVector LeafMin;
+		FVoxelLeafEdit Edit;
+	};
+
+	FVoxelData* const Data;
+	const bool bMarkNetworkDirty;
+	TArray<FEdit> Edits;
+
+	/**
+	 * Apply the edits leaf by leaf
+	 * @param	bLock	Lock each leaf, or already locked by the caller
+	 */
+	void ApplyImpl(bool bLock, TArray<FVoxelBox>& OutModifiedBoxes);
+
+	FORCEINLINE void AddEdit(int X, int Y, int Z, bool bSetValue, bool bSetMaterial, float Value, const FVoxelMaterial& Material);
+};
@@ -0,0 +1,65 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VoxelBox.h"
+#include <forward_list>
+
+class FVoxelData;
+struct FVoxelToolOperation;
+struct FVoxelLeafDiff;
+
+namespace EVoxelEditLogEntry
+{
+	enum Type : uint8
+	{
+		// Voxels edited by non deterministic edits: int count, then the leaf diffs
+		Diffs = 0,
+		// Deterministic tool operation, replayed by the clients
+		Operation = 1
+	};
+}
+
+/**
+ * Server side log of the edits since the last sync, in order
+ * Operations are sent by their parameters. The voxels they read must be identical on the clients, so the dirty voxels
+ * inside an operation box are flushed as diffs before it. Everything else is sent as diffs at the end of the log
+ * Not thread safe
+ */
+class FVoxelEditLog
+{
+public:
+	FVoxelEditLog();
+
+	/**
+	 * Apply Operation to Data without marking the voxels it edits network dirty, and log it. Locks the operation box for writing
+	 */
+	void ApplyAndLogOperation(FVoxelData* Data, const FVoxelToolOperation& Operation);
+
+	/**
+	 * Write the log, followed by the remaining network dirty voxels of Data, and clear it
+	 * @param	OutMessages		Messages to replay in order, each one with whole entries. At least one
+	 * @param	MaxMessageSize	Size of the messages, in bytes. Only exceeded by an entry larger than it, alone in its message
+	 */
+	void Flush(FVoxelData* Data, TArray<TArray<uint8>>& OutMessages, int32 MaxMessageSize);
+
+	/**
+	 * Apply a log written by Flush. Stops at the first invalid entry
+	 * @param	OutModifiedBoxes	Boxes to update
+	 * @return	false if the log was invalid
+	 */
+	static bool Replay(FVoxelData* Data, FArchive& Ar, std::forward_list<FVoxelBox>& OutModifiedBoxes);
+
+private:
+	// Serialized entries, appended to
+	TArray<uint8> Entries;
+	// Offset of each entry in Entries
+	TArray<int32> EntryOffsets;
+
+	/**
+	 * Add Diffs entries of bounded size, unless Diffs is empty
+	 * @param	Diffs	Sorted by increasing Id
+	 */
+	void LogDiffs(TArray<FVoxelLeafDiff>& Diffs);
+};
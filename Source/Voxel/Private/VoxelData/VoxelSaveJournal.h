@@ -0,0 +1,107 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct FVoxelChunkSave;
+struct FVoxelWorldSave;
+class IFileHandle;
+
+/**
+ * Append-only file of compressed chunks. A chunk appended again replaces the previous one, which becomes garbage until the next compaction.
+ * Not thread safe
+ */
+class FVoxelSaveJournal
+{
+public:
+	/**
+	 * Open the journal, creating it if it doesn't exist
+	 * @param	Filename	Path of the journal file
+	 * @param	Depth		Depth of the world. An existing journal of another depth is not opened
+	 */
+	FVoxelSaveJournal(const FString& Filename, int Depth);
+	~FVoxelSaveJournal();
+
+	/**
+	 * Can be written to and read from
+	 */
+	bool IsValid() const;
+
+	/**
+	 * EVoxelSaveVersion of the chunks appended
+	 */
+	int GetVersion() const;
+
+	/**
+	 * Write the chunks at the end of the file. They replace the chunks with the same Id
+	 * @return	false if the write failed
+	 */
+	bool AppendChunks(TArray<FVoxelChunkSave>& NewChunks);
+
+	/**
+	 * Discard all the chunks, when the world is reset
+	 */
+	bool AppendReset();
+
+	/**
+	 * Is more than half of the file made of replaced chunks?
+	 */
+	bool NeedsCompaction() const;
+
+	/**
+	 * Rewrite the file with only the latest version of each chunk. Also makes the journal valid again after a failed write
+	 */
+	bool Compact();
+
+	/**
+	 * Build a save from the latest version of each chunk. The chunks are copied without being decompressed
+	 */
+	bool GetSave(FVoxelWorldSave& OutSave) const;
+
+private:
+	enum class ERecordType : uint8
+	{
+		Chunk,
+		Reset
+	};
+
+	struct FChunkRecord
+	{
+		// Offset of the compressed chunk in the file
+		int64 Offset;
+		int32 CompressedSize;
+		int32 UncompressedSize;
+	};
+
+	const FString Filename;
+	const int Depth;
+	// EVoxelSaveVersion of the chunks. Latest for new journals, kept when appending to an older one
+	int Version;
+
+	// Opened for appending. Null if invalid
+	IFileHandle* File;
+	// End of the last complete record
+	int64 FileSize;
+
+	// Latest version of each chunk, by Id
+	TMap<uint64, FChunkRecord> Chunks;
+	// Size of the records in Chunks
+	int64 LiveSize;
+
+	/**
+	 * Rebuild Chunks from the records of an existing file
+	 * @return	false if the file isn't a journal of this world
+	 */
+	bool ReadRecords();
+
+	/**
+	 * Write the file header to a new file
+	 */
+	bool WriteHeader(IFileHandle& Handle) const;
+
+	/**
+	 * Write a record and update FileSize
+	 */
+	bool WriteRecord(ERecordType Type, uint64 Id, const uint8* Data, int32 CompressedSize, int32 UncompressedSize);
+};
@@ -0,0 +1,366 @@
+// Copyright 2017 Phyronnaz
+
+#include "VoxelToolOperation.h"
+#include "VoxelPrivate.h"
+#include "VoxelData.h"
+#include "VoxelEditBatch.h"
+#include "VoxelAsset.h"
+#include "FastNoise/FastNoise.h"
+
+// Operations with a larger extent are not replicated: they would take too long to replay. Also limited to the region size
+#define VOXEL_MAX_OPERATION_SIZE 256
+// Operations with a larger hardness are not replicated
+#define VOXEL_MAX_OPERATION_HARDNESS 100
+// Operations received further away are invalid: their box would overflow
+#define VOXEL_MAX_OPERATION_POSITION (1 << 30)
+
+FVoxelToolOperation::FVoxelToolOperation()
+	: Type(EVoxelToolOperation::ValueSphere)
+	, Position(FIntVector::ZeroValue)
+	, Radius(0)
+	, HardnessMultiplier(1)
+	, bAdd(false)
+	, NoiseScale(0)
+	, MaterialIndex(0)
+	, bUseLayer1(true)
+	, FadeDistance(0)
+{
+
+}
+
+FVoxelToolOperation FVoxelToolOperation::ValueSphere(const FIntVector& Position, float Radius, bool bAdd, float HardnessMultiplier)
+{
+	FVoxelToolOperation Operation;
+	Operation.Type = EVoxelToolOperation::ValueSphere;
+	Operation.Position = Position;
+	Operation.Radius = Radius;
+	Operation.bAdd = bAdd;
+	Operation.HardnessMultiplier = HardnessMultiplier;
+	return Operation;
+}
+
+FVoxelToolOperation FVoxelToolOperation::Crater(const FIntVector& Position, float Radius, float NoiseScale, float HardnessMultiplier)
+{
+	FVoxelToolOperation Operation;
+	Operation.Type = EVoxelToolOperation::Crater;
+	Operation.Position = Position;
+	Operation.Radius = Radius;
+	Operation.NoiseScale = NoiseScale;
+	Operation.HardnessMultiplier = HardnessMultiplier;
+	return Operation;
+}
+
+FVoxelToolOperation FVoxelToolOperation::MaterialSphere(const FIntVector& Position, float Radius, uint8 MaterialIndex, bool bUseLayer1, float FadeDistance)
+{
+	FVoxelToolOperation Operation;
+	Operation.Type = EVoxelToolOperation::MaterialSphere;
+	Operation.Position = Position;
+	Operation.Radius = Radius;
+	Operation.MaterialIndex = MaterialIndex;
+	Operation.bUseLayer1 = bUseLayer1;
+	Operation.FadeDistance = FadeDistance;
+	return Operation;
+}
+
+FVoxelBox FVoxelToolOperation::GetBox() const
+{
+	const int Extent = GetExtent() + 1;
+	return FVoxelBox(Position - FIntVector(1, 1, 1) * Extent, Position + FIntVector(1, 1, 1) * Extent);
+}
+
+void FVoxelToolOperation::Apply(FVoxelData* Data, bool bMarkNetworkDirty) const
+{
+	const FVoxelBox Box = GetBox();
+	Data->BeginSet(Box);
+	ApplyLocked(Data, bMarkNetworkDirty);
+	Data->EndSet(Box);
+}
+
+void FVoxelToolOperation::ApplyLocked(FVoxelData* Data, bool bMarkNetworkDirty) const
+{
+	switch (Type)
+	{
+	case EVoxelToolOperation::ValueSphere:
+		ApplyValueSphere(Data, bMarkNetworkDirty);
+		break;
+	case EVoxelToolOperation::Crater:
+		ApplyCrater(Data, bMarkNetworkDirty);
+		break;
+	case EVoxelToolOperation::MaterialSphere:
+		ApplyMaterialSphere(Data, bMarkNetworkDirty);
+		break;
+	default:
+		check(false);
+	}
+}
+
+bool FVoxelToolOperation::IsValid(const FVoxelData* Data) const
+{
+	const float MaxSize = FMath::Min(VOXEL_MAX_OPERATION_SIZE, Data->RegionSize());
+
+	// Comparisons are false for NaNs
+	if (!(0 <= Radius && Radius <= MaxSize))
+	{
+		return false;
+	}
+
+	switch (Type)
+	{
+	case EVoxelToolOperation::ValueSphere:
+		return FMath::Abs(HardnessMultiplier) <= VOXEL_MAX_OPERATION_HARDNESS;
+	case EVoxelToolOperation::Crater:
+		return FMath::Abs(HardnessMultiplier) <= VOXEL_MAX_OPERATION_HARDNESS && FMath::Abs(NoiseScale) <= MaxSize;
+	case EVoxelToolOperation::MaterialSphere:
+		return 0 <= FadeDistance && Radius + FadeDistance <= MaxSize;
+	default:
+		return false;
+	}
+}
+
+int FVoxelToolOperation::GetExtent() const
+{
+	if (Type == EVoxelToolOperation::MaterialSphere)
+	{
+		const float VoxelDiagonalLength = 1.73205080757f;
+		return FMath::CeilToInt(Radius + FadeDistance + VoxelDiagonalLength);
+	}
+	else
+	{
+		return FMath::CeilToInt(Radius) + 2;
+	}
+}
+
+void FVoxelToolOperation::ApplyValueSphere(FVoxelData* Data, bool bMarkNetworkDirty) const
+{
+	const int IntRadius = GetExtent();
+
+	FVoxelEditBatch Batch(Data, bMarkNetworkDirty);
+
+	for (int X = -IntRadius; X <= IntRadius; X++)
+	{
+		for (int Y = -IntRadius; Y <= IntRadius; Y++)
+		{
+			for (int Z = -IntRadius; Z <= IntRadius; Z++)
+			{
+				const FIntVector CurrentPosition = Position + FIntVector(X, Y, Z);
+				const float Distance = FVector(X, Y, Z).Size();
+
+				if (Distance <= Radius + 2)
+				{
+					// We want (Radius - Distance) != 0
+					const float Noise = (Radius - Distance == 0) ? 0.0001f : 0;
+					float Value = FMath::Clamp(Radius - Distance + Noise, -2.f, 2.f) / 2;
+
+					Value *= HardnessMultiplier;
+					Value *= (bAdd ? -1 : 1);
+
+					float OldValue = Data->GetValue(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z);
+
+					bool bValid;
+					if ((Value <= 0 && bAdd) || (Value > 0 && !bAdd))
+					{
+						bValid = true;
+					}
+					else
+					{
+						bValid = FVoxelType::HaveSameSign(OldValue, Value);
+					}
+					if (bValid)
+					{
+						if (LIKELY(Data->IsInWorld(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z)))
+						{
+							Batch.SetValue(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z, Value);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	TArray<FVoxelBox> ModifiedBoxes;
+	Batch.ApplyLocked(ModifiedBoxes);
+}
+
+void FVoxelToolOperation::ApplyCrater(FVoxelData* Data, bool bMarkNetworkDirty) const
+{
+	const int IntRadius = GetExtent();
+
+	FVoxelEditBatch Batch(Data, bMarkNetworkDirty);
+
+	// Default seed: same noise on all the machines
+	FastNoise Noise;
+
+	for (int X = -IntRadius; X <= IntRadius; X++)
+	{
+		for (int Y = -IntRadius; Y <= IntRadius; Y++)
+		{
+			for (int Z = -IntRadius; Z <= IntRadius; Z++)
+			{
+				const FIntVector CurrentPosition = Position + FIntVector(X, Y, Z);
+
+				float CurrentRadius = FVector(X, Y, Z).Size();
+				float CurrentNoise = Noise.GetValueFractal(X / CurrentRadius * 5, Y / CurrentRadius * 5, Z / CurrentRadius * 5);
+				const float Distance = CurrentRadius + NoiseScale * CurrentNoise;
+
+				if (Distance <= Radius + 2)
+				{
+					// We want (Radius - Distance) != 0
+					const float Noise = (Radius - Distance == 0) ? 0.0001f : 0;
+					float Value = FMath::Clamp(Radius - Distance + Noise, -2.f, 2.f) / 2;
+
+					Value *= HardnessMultiplier;
+
+					float OldValue = Data->GetValue(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z);
+
+					bool bValid;
+					if (Value > 0)
+					{
+						bValid = true;
+					}
+					else
+					{
+						bValid = FVoxelType::HaveSameSign(OldValue, Value);
+					}
+					if (bValid)
+					{
+						if (LIKELY(Data->IsInWorld(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z)))
+						{
+							Batch.SetValue(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z, Value);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	TArray<FVoxelBox> ModifiedBoxes;
+	Batch.ApplyLocked(ModifiedBoxes);
+}
+
+void FVoxelToolOperation::ApplyMaterialSphere(FVoxelData* Data, bool bMarkNetworkDirty) const
+{
+	const float VoxelDiagonalLength = 1.73205080757f;
+	const int Size = GetExtent();
+
+	FVoxelEditBatch Batch(Data, bMarkNetworkDirty);
+
+	for (int X = -Size; X <= Size; X++)
+	{
+		for (int Y = -Size; Y <= Size; Y++)
+		{
+			for (int Z = -Size; Z <= Size; Z++)
+			{
+				const FIntVector CurrentPosition = Position + FIntVector(X, Y, Z);
+				const float Distance = FVector(X, Y, Z).Size();
+
+
+				FVoxelMaterial Material = Data->GetMaterial(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z);
+
+				if (Distance < Radius + FadeDistance + VoxelDiagonalLength)
+				{
+					// Set alpha
+					int8 Alpha = 255 * FMath::Clamp((Radius + FadeDistance - Distance) / FadeDistance, 0.f, 1.f);
+					if (bUseLayer1)
+					{
+						Alpha = 256 - Alpha;
+					}
+					if ((bUseLayer1 ? Material.Index1 : Material.Index2) == MaterialIndex)
+					{
+						// Same color
+						Alpha = bUseLayer1 ? FMath::Min<uint8>(Alpha, Material.Alpha) : FMath::Max<uint8>(Alpha, Material.Alpha);
+					}
+					Material.Alpha = Alpha;
+
+					// Set index
+					if (bUseLayer1)
+					{
+						Material.Index1 = MaterialIndex;
+					}
+					else
+					{
+						Material.Index2 = MaterialIndex;
+					}
+
+					if (LIKELY(Data->IsInWorld(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z)))
+					{
+						// Apply changes
+						Batch.SetMaterial(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z, Material);
+					}
+				}
+				else if (Distance < Radius + FadeDistance + 2 * VoxelDiagonalLength && (bUseLayer1 ? Material.Index1 : Material.Index2) != MaterialIndex)
+				{
+					Material.Alpha = bUseLayer1 ? 255 : 0;
+
+					if (LIKELY(Data->IsInWorld(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z)))
+					{
+						Batch.SetMaterial(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z, Material);
+					}
+				}
+			}
+		}
+	}
+
+	TArray<FVoxelBox> ModifiedBoxes;
+	Batch.ApplyLocked(ModifiedBoxes);
+}
+
+FArchive& operator<<(FArchive& Ar, FVoxelToolOperation& Operation)
+{
+	uint8 Type = Operation.Type;
+	Ar << Type;
+	if (Type >= EVoxelToolOperation::Count)
+	{
+		Ar.SetError();
+		return Ar;
+	}
+	Operation.Type = (EVoxelToolOperation::Type)Type;
+
+	Ar << Operation.Position;
+	Ar << Operation.Radius;
+
+	switch (Operation.Type)
+	{
+	case EVoxelToolOperation::ValueSphere:
+	{
+		uint8 bAdd = Operation.bAdd;
+		Ar << bAdd;
+		Operation.bAdd = bAdd != 0;
+		Ar << Operation.HardnessMultiplier;
+		break;
+	}
+	case EVoxelToolOperation::Crater:
+	{
+		Ar << Operation.NoiseScale;
+		Ar << Operation.HardnessMultiplier;
+		break;
+	}
+	case EVoxelToolOperation::MaterialSphere:
+	{
+		uint8 bUseLayer1 = Operation.bUseLayer1;
+		Ar << Operation.MaterialIndex;
+		Ar << bUseLayer1;
+		Operation.bUseLayer1 = bUseLayer1 != 0;
+		Ar << Operation.FadeDistance;
+		break;
+	}
+	default:
+		check(false);
+	}
+
+	if (Ar.IsLoading())
+	{
+		const int MaxPosition = VOXEL_MAX_OPERATION_POSITION;
+		const FIntVector& P = Operation.Position;
+		const bool bValidPosition =
+			-MaxPosition <= P.X && P.X <= MaxPosition &&
+			-MaxPosition <= P.Y && P.Y <= MaxPosition &&
+			-MaxPosition <= P.Z && P.Z <= MaxPosition;
+		// The parameters are checked by IsValid, which needs the data
+		if (!bValidPosition)
+		{
+			Ar.SetError();
+		}
+	}
+
+	return Ar;
+}
@@ -0,0 +1,93 @@
+// Copyright 2017 Phyronnaz
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "VoxelBox.h"
+
+class FVoxelData;
+
+namespace EVoxelToolOperation
+{
+	enum Type : uint8
+	{
+		ValueSphere = 0,
+		Crater = 1,
+		MaterialSphere = 2,
+
+		Count
+	};
+}
+
+/**
+ * Deterministic brush edit, in voxel space: applied to identical data, it gives identical data
+ * This allows replicating it by its parameters instead of by the voxels it modifies
+ */
+struct FVoxelToolOperation
+{
+	EVoxelToolOperation::Type Type;
+
+	// Center, in voxel space
+	FIntVector Position;
+
+	// In voxels
+	float Radius;
+
+	// ValueSphere and Crater
+	float HardnessMultiplier;
+
+	// ValueSphere
+	bool bAdd;
+
+	// Crater
+	float NoiseScale;
+
+	// MaterialSphere
+	uint8 MaterialIndex;
+	bool bUseLayer1;
+	float FadeDistance;
+
+	FVoxelToolOperation();
+
+	static FVoxelToolOperation ValueSphere(const FIntVector& Position, float Radius, bool bAdd, float HardnessMultiplier);
+	static FVoxelToolOperation Crater(const FIntVector& Position, float Radius, float NoiseScale, float HardnessMultiplier);
+	static FVoxelToolOperation MaterialSphere(const FIntVector& Position, float Radius, uint8 MaterialIndex, bool bUseLayer1, float FadeDistance);
+
+	/**
+	 * Box containing all the voxels read or written by Apply, and the chunks to update
+	 */
+	FVoxelBox GetBox() const;
+
+	/**
+	 * Can it be replicated: are its parameters finite, and small enough for the clients to replay it quickly?
+	 * Operations received are dropped if not, and invalid operations are sent as diffs
+	 * @param	Data	Data it is applied to
+	 */
+	bool IsValid(const FVoxelData* Data) const;
+
+	/**
+	 * Edit Data. Locks GetBox for writing during the whole operation, so that the voxels read can't change before being written
+	 * @param	bMarkNetworkDirty	Send the edited voxels at next network sync. false if the operation itself is replicated
+	 */
+	void Apply(FVoxelData* Data, bool bMarkNetworkDirty) const;
+
+	/**
+	 * Same as Apply, when GetBox is already locked for writing with BeginSet. Its EndSet finalizes the edits
+	 */
+	void ApplyLocked(FVoxelData* Data, bool bMarkNetworkDirty) const;
+
+private:
+	/**
+	 * Size of the cube around Position read by Apply
+	 */
+	int GetExtent() const;
+
+	void ApplyValueSphere(FVoxelData* Data, bool bMarkNetworkDirty) const;
+	void ApplyCrater(FVoxelData* Data, bool bMarkNetworkDirty) const;
+	void ApplyMaterialSphere(FVoxelData* Data, bool bMarkNetworkDirty) const;
+};
+
+/**
+ * Only the parameters used by the operation type. Sets the archive error on an invalid type or position: check IsValid before applying a loaded operation
+ */
+FArchive& operator<<(FArchive& Ar, FVoxelToolOperation& Operation);
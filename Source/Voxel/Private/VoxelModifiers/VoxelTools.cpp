@@ -8,10 +8,11 @@
 #include "Kismet/GameplayStatics.h"
 #include "EmptyWorldGenerator.h"
 #include "VoxelData.h"
+#include "VoxelEditBatch.h"
+#include "VoxelToolOperation.h"
 #include "VoxelPart.h"
 #include "Fluids.h"
 #include "VoxelDataAsset.h"
-#include "FastNoise/FastNoise.h"
 #include <deque>
 
 DECLARE_CYCLE_STAT(TEXT("VoxelTool ~ SetValueSphere"), STAT_SetValueSphere, STATGROUP_Voxel);
@@ -36,64 +37,8 @@ void UVoxelTools::AddCrater(AVoxelWorld* World, const FVector Position, const fl
 		return;
 	}
 
-	const float Radius = WorldRadius / World->GetVoxelSize();
-
-	// Position in voxel space
-	FIntVector LocalPosition = World->GlobalToLocal(Position);
-	int IntRadius = FMath::CeilToInt(Radius) + 2;
-
-	FValueOctree* LastOctree = nullptr;
-	FVoxelData* Data = World->GetData();
-
-	FastNoise Noise;
-
-	{
-		Data->BeginSet();
-		for (int X = -IntRadius; X <= IntRadius; X++)
-		{
-			for (int Y = -IntRadius; Y <= IntRadius; Y++)
-			{
-				for (int Z = -IntRadius; Z <= IntRadius; Z++)
-				{
-					const FIntVector CurrentPosition = LocalPosition + FIntVector(X, Y, Z);
-
-					float CurrentRadius = FVector(X, Y, Z).Size();
-					float CurrentNoise = Noise.GetValueFractal(X / CurrentRadius * 5, Y / CurrentRadius * 5, Z / CurrentRadius * 5);
-					const float Distance = CurrentRadius + NoiseScale * CurrentNoise;
-
-					if (Distance <= Radius + 2)
-					{
-						// We want (Radius - Distance) != 0
-						const float Noise = (Radius - Distance == 0) ? 0.0001f : 0;
-						float Value = FMath::Clamp(Radius - Distance + Noise, -2.f, 2.f) / 2;
-
-						Value *= HardnessMultiplier;
-
-						float OldValue = Data->GetValue(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z);
-
-						bool bValid;
-						if (Value > 0)
-						{
-							bValid = true;
-						}
-						else
-						{
-							bValid = FVoxelType::HaveSameSign(OldValue, Value);
-						}
-						if (bValid)
-						{
-							if (LIKELY(Data->IsInWorld(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z)))
-							{
-								Data->SetValue(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z, Value, LastOctree);
-							}
-						}
-					}
-				}
-			}
-		}
-		Data->EndSet();
-	}
-	World->UpdateChunksOverlappingBox(FVoxelBox(LocalPosition + FIntVector(1, 1, 1) * -(IntRadius + 1), LocalPosition + FIntVector(1, 1, 1) * (IntRadius + 1)), bAsync);
+	// Position and radius in voxel space
+	World->ApplyToolOperation(FVoxelToolOperation::Crater(World->GlobalToLocal(Position), WorldRadius / World->GetVoxelSize(), NoiseScale, HardnessMultiplier), bAsync);
 }
 
 void UVoxelTools::SetValueSphere(AVoxelWorld* World, const FVector Position, const float WorldRadius, const bool bAdd, const bool bAsync, const float HardnessMultiplier)
@@ -105,60 +50,9 @@ void UVoxelTools::SetValueSphere(AVoxelWorld* World, const FVector Position, con
 		UE_LOG(LogVoxel, Error, TEXT("SetValueSphere: World is NULL"));
 		return;
 	}
-	const float Radius = WorldRadius / World->GetVoxelSize();
 
-	// Position in voxel space
-	FIntVector LocalPosition = World->GlobalToLocal(Position);
-	int IntRadius = FMath::CeilToInt(Radius) + 2;
-
-	FValueOctree* LastOctree = nullptr;
-	FVoxelData* Data = World->GetData();
-
-	{
-		Data->BeginSet();
-		for (int X = -IntRadius; X <= IntRadius; X++)
-		{
-			for (int Y = -IntRadius; Y <= IntRadius; Y++)
-			{
-				for (int Z = -IntRadius; Z <= IntRadius; Z++)
-				{
-					const FIntVector CurrentPosition = LocalPosition + FIntVector(X, Y, Z);
-					const float Distance = FVector(X, Y, Z).Size();
-
-					if (Distance <= Radius + 2)
-					{
-						// We want (Radius - Distance) != 0
-						const float Noise = (Radius - Distance == 0) ? 0.0001f : 0;
-						float Value = FMath::Clamp(Radius - Distance + Noise, -2.f, 2.f) / 2;
-
-						Value *= HardnessMultiplier;
-						Value *= (bAdd ? -1 : 1);
-
-						float OldValue = Data->GetValue(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z);
-
-						bool bValid;
-						if ((Value <= 0 && bAdd) || (Value > 0 && !bAdd))
-						{
-							bValid = true;
-						}
-						else
-						{
-							bValid = FVoxelType::HaveSameSign(OldValue, Value);
-						}
-						if (bValid)
-						{
-							if (LIKELY(Data->IsInWorld(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z)))
-							{
-								Data->SetValue(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z, Value, LastOctree);
-							}
-						}
-					}
-				}
-			}
-		}
-		Data->EndSet();
-	}
-	World->UpdateChunksOverlappingBox(FVoxelBox(LocalPosition + FIntVector(1, 1, 1) * -(IntRadius + 1), LocalPosition + FIntVector(1, 1, 1) * (IntRadius + 1)), bAsync);
+	// Position and radius in voxel space
+	World->ApplyToolOperation(FVoxelToolOperation::ValueSphere(World->GlobalToLocal(Position), WorldRadius / World->GetVoxelSize(), bAdd, HardnessMultiplier), bAsync);
 }
 
 //void UVoxelTools::SetValueBox(AVoxelWorld* const World, const FVector Position, const float ExtentXInVoxel, const float ExtentYInVoxel, const float ExtentZInVoxel, const bool bAdd, const bool bAsync, const float HardnessMultiplier)
@@ -204,76 +98,9 @@ void UVoxelTools::SetMaterialSphere(AVoxelWorld* World, const FVector Position,
 		UE_LOG(LogVoxel, Error, TEXT("SetMaterialSphere: World is NULL"));
 		return;
 	}
-	const float Radius = WorldRadius / World->GetVoxelSize();
-
-	FIntVector LocalPosition = World->GlobalToLocal(Position);
-
-	const float VoxelDiagonalLength = 1.73205080757f;
-	const int Size = FMath::CeilToInt(Radius + FadeDistance + VoxelDiagonalLength);
-
-	FValueOctree* LastOctree = nullptr;
-	FVoxelData* Data = World->GetData();
-
-	{
-		Data->BeginSet();
-		for (int X = -Size; X <= Size; X++)
-		{
-			for (int Y = -Size; Y <= Size; Y++)
-			{
-				for (int Z = -Size; Z <= Size; Z++)
-				{
-					const FIntVector CurrentPosition = LocalPosition + FIntVector(X, Y, Z);
-					const float Distance = FVector(X, Y, Z).Size();
-
-
-					FVoxelMaterial Material = Data->GetMaterial(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z);
-
-					if (Distance < Radius + FadeDistance + VoxelDiagonalLength)
-					{
-						// Set alpha
-						int8 Alpha = 255 * FMath::Clamp((Radius + FadeDistance - Distance) / FadeDistance, 0.f, 1.f);
-						if (bUseLayer1)
-						{
-							Alpha = 256 - Alpha;
-						}
-						if ((bUseLayer1 ? Material.Index1 : Material.Index2) == MaterialIndex)
-						{
-							// Same color
-							Alpha = bUseLayer1 ? FMath::Min<uint8>(Alpha, Material.Alpha) : FMath::Max<uint8>(Alpha, Material.Alpha);
-						}
-						Material.Alpha = Alpha;
-
-						// Set index
-						if (bUseLayer1)
-						{
-							Material.Index1 = MaterialIndex;
-						}
-						else
-						{
-							Material.Index2 = MaterialIndex;
-						}
 
-						if (LIKELY(Data->IsInWorld(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z)))
-						{
-							// Apply changes
-							Data->SetMaterial(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z, Material, LastOctree);
-						}
-					}
-					else if (Distance < Radius + FadeDistance + 2 * VoxelDiagonalLength && (bUseLayer1 ? Material.Index1 : Material.Index2) != MaterialIndex)
-					{
-						Material.Alpha = bUseLayer1 ? 255 : 0;
-
-						if (LIKELY(Data->IsInWorld(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z)))
-						{
-							Data->SetMaterial(CurrentPosition.X, CurrentPosition.Y, CurrentPosition.Z, Material, LastOctree);
-						}
-					}
-				}
-			}
-		}
-		Data->EndSet();
-	}
-	World->UpdateChunksOverlappingBox(FVoxelBox(LocalPosition + FIntVector(1, 1, 1) * -(Size + 1), LocalPosition + FIntVector(1, 1, 1) * (Size + 1)), bAsync);
+	// Position and radius in voxel space
+	World->ApplyToolOperation(FVoxelToolOperation::MaterialSphere(World->GlobalToLocal(Position), WorldRadius / World->GetVoxelSize(), MaterialIndex, bUseLayer1, FadeDistance), bAsync);
 }
 
 
@@ -349,6 +176,33 @@ void FindModifiedPositionsForRaycasts(AVoxelWorld* World, const FVector StartPos
 	}
 }
 
+/**
+ * Get the positions in the world, and their bounds
+ * @return	false if there are none
+ */
+bool GetPositionsInWorld(AVoxelWorld* World, const std::deque<TTuple<FIntVector, float>>& PositionsAndDistances, TArray<TTuple<FIntVector, float>>& OutPositionsAndDistances, FVoxelBox& OutBounds)
+{
+	for (auto& Tuple : PositionsAndDistances)
+	{
+		const FIntVector Point = Tuple.Get<0>();
+		if (!World->IsInWorld(Point))
+		{
+			continue;
+		}
+		if (OutPositionsAndDistances.Num() == 0)
+		{
+			OutBounds = FVoxelBox(Point, Point);
+		}
+		else
+		{
+			OutBounds.Min = FIntVector(FMath::Min(OutBounds.Min.X, Point.X), FMath::Min(OutBounds.Min.Y, Point.Y), FMath::Min(OutBounds.Min.Z, Point.Z));
+			OutBounds.Max = FIntVector(FMath::Max(OutBounds.Max.X, Point.X), FMath::Max(OutBounds.Max.Y, Point.Y), FMath::Max(OutBounds.Max.Z, Point.Z));
+		}
+		OutPositionsAndDistances.Add(Tuple);
+	}
+	return OutPositionsAndDistances.Num() > 0;
+}
+
 void UVoxelTools::SetValueProjection(AVoxelWorld* World, const FVector StartPosition, const FVector Direction, const float Radius, const float Strength, const bool bAdd,
 	const float MaxDistance, const float Precision, const bool bAsync, const bool bShowRaycasts, const bool bShowHitPoints, const bool bShowModifiedVoxels, const float MinValue, const float MaxValue)
 {
@@ -363,22 +217,40 @@ void UVoxelTools::SetValueProjection(AVoxelWorld* World, const FVector StartPosi
 	std::deque<TTuple<FIntVector, float>> ModifiedPositionsAndDistances;
 	FindModifiedPositionsForRaycasts(World, StartPosition, Direction, Radius, MaxDistance, Precision, bShowRaycasts, bShowHitPoints, bShowModifiedVoxels, ModifiedPositionsAndDistances);
 
-	for (auto Tuple : ModifiedPositionsAndDistances)
+	TArray<TTuple<FIntVector, float>> Positions;
+	FVoxelBox Bounds;
+	if (!GetPositionsInWorld(World, ModifiedPositionsAndDistances, Positions, Bounds))
 	{
-		const FIntVector Point = Tuple.Get<0>();
-		const float Distance = Tuple.Get<1>();
-		if (World->IsInWorld(Point))
+		return;
+	}
+
+	FVoxelData* Data = World->GetData();
+	FVoxelEditBatch Batch(Data);
+	TArray<FVoxelBox> ModifiedBoxes;
+
+	// Read and write under the same lock, so that concurrent edits are not lost
+	Data->BeginSet(Bounds);
+	{
+		// A voxel hit by several rays gets the sum of their strengths
+		TMap<FIntVector, float> NewValues;
+		for (auto& Tuple : Positions)
 		{
-			if (bAdd)
-			{
-				World->SetValue(Point, FMath::Clamp(World->GetValue(Point) - Strength, MinValue, MaxValue));
-			}
-			else
-			{
-				World->SetValue(Point, FMath::Clamp(World->GetValue(Point) + Strength, MinValue, MaxValue));
-			}
-			World->UpdateChunksAtPosition(Point, bAsync);
+			const FIntVector Point = Tuple.Get<0>();
+			const float* NewValue = NewValues.Find(Point);
+			const float OldValue = NewValue ? *NewValue : Data->GetValue(Point.X, Point.Y, Point.Z);
+			NewValues.Add(Point, FMath::Clamp(OldValue + (bAdd ? -Strength : Strength), MinValue, MaxValue));
 		}
+		for (auto& It : NewValues)
+		{
+			Batch.SetValue(It.Key.X, It.Key.Y, It.Key.Z, It.Value);
+		}
+		Batch.ApplyLocked(ModifiedBoxes);
+	}
+	Data->EndSet(Bounds);
+
+	for (auto& ModifiedBox : ModifiedBoxes)
+	{
+		World->UpdateChunksOverlappingBox(ModifiedBox, bAsync);
 	}
 }
 
@@ -398,54 +270,74 @@ void UVoxelTools::SetMaterialProjection(AVoxelWorld * World, const FVector Start
 	std::deque<TTuple<FIntVector, float>> ModifiedPositionsAndDistances;
 	FindModifiedPositionsForRaycasts(World, StartPosition, Direction, Radius + FadeDistance + 2 * VoxelDiagonalLength, MaxDistance, Precision, bShowRaycasts, bShowHitPoints, bShowModifiedVoxels, ModifiedPositionsAndDistances);
 
-	for (auto Tuple : ModifiedPositionsAndDistances)
+	TArray<TTuple<FIntVector, float>> Positions;
+	FVoxelBox Bounds;
+	if (!GetPositionsInWorld(World, ModifiedPositionsAndDistances, Positions, Bounds))
 	{
-		const FIntVector Point = Tuple.Get<0>();
-		const float Distance = Tuple.Get<1>();
+		return;
+	}
 
-		FVoxelMaterial Material = World->GetMaterial(Point);
+	FVoxelData* Data = World->GetData();
+	FVoxelEditBatch Batch(Data);
+	TArray<FVoxelBox> ModifiedBoxes;
 
-		if (Distance < Radius + FadeDistance + VoxelDiagonalLength)
+	// Read and write under the same lock, so that concurrent edits are not lost
+	Data->BeginSet(Bounds);
+	{
+		// A voxel hit by several rays is painted on top of its previous paint
+		TMap<FIntVector, FVoxelMaterial> NewMaterials;
+		for (auto& Tuple : Positions)
 		{
-			// Set alpha
-			int8 Alpha = 255 * FMath::Clamp((Radius + FadeDistance - Distance) / FadeDistance, 0.f, 1.f);
-			if (bUseLayer1)
-			{
-				Alpha = 256 - Alpha;
-			}
-			if ((bUseLayer1 ? Material.Index1 : Material.Index2) == MaterialIndex)
-			{
-				// Same color
-				Alpha = bUseLayer1 ? FMath::Min<uint8>(Alpha, Material.Alpha) : FMath::Max<uint8>(Alpha, Material.Alpha);
-			}
-			Material.Alpha = Alpha;
+			const FIntVector Point = Tuple.Get<0>();
+			const float Distance = Tuple.Get<1>();
 
-			// Set index
-			if (bUseLayer1)
-			{
-				Material.Index1 = MaterialIndex;
-			}
-			else
+			const FVoxelMaterial* NewMaterial = NewMaterials.Find(Point);
+			FVoxelMaterial Material = NewMaterial ? *NewMaterial : Data->GetMaterial(Point.X, Point.Y, Point.Z);
+
+			if (Distance < Radius + FadeDistance + VoxelDiagonalLength)
 			{
-				Material.Index2 = MaterialIndex;
-			}
+				// Set alpha
+				int8 Alpha = 255 * FMath::Clamp((Radius + FadeDistance - Distance) / FadeDistance, 0.f, 1.f);
+				if (bUseLayer1)
+				{
+					Alpha = 256 - Alpha;
+				}
+				if ((bUseLayer1 ? Material.Index1 : Material.Index2) == MaterialIndex)
+				{
+					// Same color
+					Alpha = bUseLayer1 ? FMath::Min<uint8>(Alpha, Material.Alpha) : FMath::Max<uint8>(Alpha, Material.Alpha);
+				}
+				Material.Alpha = Alpha;
+
+				// Set index
+				if (bUseLayer1)
+				{
+					Material.Index1 = MaterialIndex;
+				}
+				else
+				{
+					Material.Index2 = MaterialIndex;
+				}
 
-			if (World->IsInWorld(Point))
+				NewMaterials.Add(Point, Material);
+			}
+			else if ((bUseLayer1 ? Material.Index1 : Material.Index2) != MaterialIndex)
 			{
-				// Apply changes
-				World->SetMaterial(Point, Material);
-				World->UpdateChunksAtPosition(Point, bAsync);
+				Material.Alpha = bUseLayer1 ? 255 : 0;
+				NewMaterials.Add(Point, Material);
 			}
 		}
-		else if ((bUseLayer1 ? Material.Index1 : Material.Index2) != MaterialIndex)
+		for (auto& It : NewMaterials)
 		{
-			Material.Alpha = bUseLayer1 ? 255 : 0;
-			if (World->IsInWorld(Point))
-			{
-				World->SetMaterial(Point, Material);
-				World->UpdateChunksAtPosition(Point, bAsync);
-			}
+			Batch.SetMaterial(It.Key.X, It.Key.Y, It.Key.Z, It.Value);
 		}
+		Batch.ApplyLocked(ModifiedBoxes);
+	}
+	Data->EndSet(Bounds);
+
+	for (auto& ModifiedBox : ModifiedBoxes)
+	{
+		World->UpdateChunksOverlappingBox(ModifiedBox, bAsync);
 	}
 }
 
@@ -551,13 +443,57 @@ void UVoxelTools::SmoothValue(AVoxelWorld * World, FVector StartPosition, FVecto
 	}
 
 	// Update values
+	TArray<TTuple<FIntVector, float>> Positions;
+	FVoxelBox Bounds;
 	for (int i = 0; i < ModifiedPositions.Num(); i++)
 	{
-		FIntVector Point = ModifiedPositions[i];
-		float Distance = DistancesToTool[i];
-		float Delta = Speed * (MeanDistance - Distance);
-		World->SetValue(Point, FMath::Clamp(Delta + World->GetValue(Point), MinValue, MaxValue));
-		World->UpdateChunksAtPosition(Point, bAsync);
+		if (World->IsInWorld(ModifiedPositions[i]))
+		{
+			if (Positions.Num() == 0)
+			{
+				Bounds = FVoxelBox(ModifiedPositions[i], ModifiedPositions[i]);
+			}
+			else
+			{
+				const FIntVector& Point = ModifiedPositions[i];
+				Bounds.Min = FIntVector(FMath::Min(Bounds.Min.X, Point.X), FMath::Min(Bounds.Min.Y, Point.Y), FMath::Min(Bounds.Min.Z, Point.Z));
+				Bounds.Max = FIntVector(FMath::Max(Bounds.Max.X, Point.X), FMath::Max(Bounds.Max.Y, Point.Y), FMath::Max(Bounds.Max.Z, Point.Z));
+			}
+			Positions.Add(TTuple<FIntVector, float>(ModifiedPositions[i], DistancesToTool[i]));
+		}
+	}
+	if (Positions.Num() == 0)
+	{
+		return;
+	}
+
+	FVoxelData* Data = World->GetData();
+	FVoxelEditBatch Batch(Data);
+	TArray<FVoxelBox> ModifiedBoxes;
+
+	// Read and write under the same lock, so that concurrent edits are not lost
+	Data->BeginSet(Bounds);
+	{
+		TMap<FIntVector, float> NewValues;
+		for (auto& Tuple : Positions)
+		{
+			const FIntVector Point = Tuple.Get<0>();
+			const float Delta = Speed * (MeanDistance - Tuple.Get<1>());
+			const float* NewValue = NewValues.Find(Point);
+			const float OldValue = NewValue ? *NewValue : Data->GetValue(Point.X, Point.Y, Point.Z);
+			NewValues.Add(Point, FMath::Clamp(Delta + OldValue, MinValue, MaxValue));
+		}
+		for (auto& It : NewValues)
+		{
+			Batch.SetValue(It.Key.X, It.Key.Y, It.Key.Z, It.Value);
+		}
+		Batch.ApplyLocked(ModifiedBoxes);
+	}
+	Data->EndSet(Bounds);
+
+	for (auto& ModifiedBox : ModifiedBoxes)
+	{
+		World->UpdateChunksOverlappingBox(ModifiedBox, bAsync);
 	}
 }
 
@@ -581,19 +517,27 @@ void UVoxelTools::ImportAsset(AVoxelWorld* World, UVoxelAsset* Asset, FVector Po
 	FIntVector P = World->GlobalToLocal(Position);
 
 	FDecompressedVoxelAsset* DecompressedAsset;
-	Asset->GetDecompressedAsset(DecompressedAsset, World->GetVoxelSize());
+	if (!Asset->GetDecompressedAsset(DecompressedAsset, World->GetVoxelSize()))
+	{
+		UE_LOG(LogVoxel, Error, TEXT("ImportAsset: Invalid Asset"));
+		return;
+	}
 
 	FVoxelBox Bounds = DecompressedAsset->GetBounds();
 	FVoxelData* Data = World->GetData();
-	FValueOctree* LastOctree = nullptr;
+	FVoxelEditBatch Batch(Data);
 
 	if (bPositionZIsBottom)
 	{
 		P.Z -= Bounds.Min.Z;
 	}
 
+	const FVoxelBox Box(Bounds.Min + P, Bounds.Max + P);
+	TArray<FVoxelBox> ModifiedBoxes;
+
 	{
-		Data->BeginSet();
+		// Read and write under the same lock, so that concurrent edits are not lost
+		Data->BeginSet(Box);
 		for (int X = Bounds.Min.X; X <= Bounds.Max.X; X++)
 		{
 			for (int Y = Bounds.Min.Y; Y <= Bounds.Max.Y; Y++)
@@ -608,7 +552,7 @@ void UVoxelTools::ImportAsset(AVoxelWorld* World, UVoxelAsset* Asset, FVector Po
 					{
 						if (LIKELY(Data->IsInWorld(P.X + X, P.Y + Y, P.Z + Z)))
 						{
-							Data->SetValueAndMaterial(P.X + X, P.Y + Y, P.Z + Z, AssetValue, AssetMaterial, LastOctree);
+							Batch.SetValueAndMaterial(P.X + X, P.Y + Y, P.Z + Z, AssetValue, AssetMaterial);
 						}
 					}
 					else if (VoxelType.GetValueType() != IgnoreValue || VoxelType.GetMaterialType() != IgnoreMaterial)
@@ -641,16 +585,20 @@ void UVoxelTools::ImportAsset(AVoxelWorld* World, UVoxelAsset* Asset, FVector Po
 
 						if (LIKELY(Data->IsInWorld(P.X + X, P.Y + Y, P.Z + Z)))
 						{
-							Data->SetValueAndMaterial(P.X + X, P.Y + Y, P.Z + Z, NewValue, NewMaterial, LastOctree);
+							Batch.SetValueAndMaterial(P.X + X, P.Y + Y, P.Z + Z, NewValue, NewMaterial);
 						}
 					}
 				}
 			}
 		}
-		Data->EndSet();
+		Batch.ApplyLocked(ModifiedBoxes);
+		Data->EndSet(Box);
 	}
 
-	World->UpdateChunksOverlappingBox(FVoxelBox(Bounds.Min + P, Bounds.Max + P), bAsync);
+	for (auto& ModifiedBox : ModifiedBoxes)
+	{
+		World->UpdateChunksOverlappingBox(ModifiedBox, bAsync);
+	}
 
 	delete DecompressedAsset;
 }
@@ -784,21 +732,27 @@ void UVoxelTools::ApplyWaterEffect(AVoxelWorld* World, const int N, const bool b
 		FluidStep(N, Dens0, U0, V0, W0, Visc, Diff, Dt, Dens, U, V, W);
 
 		{
-			Data->BeginSet();
+			// Values don't depend on the current ones: each leaf is only locked while written
+			FVoxelEditBatch Batch(Data);
 			for (int i = 1; i < N + 1; i++)
 			{
 				for (int j = 1; j < N + 1; j++)
 				{
 					for (int k = 1; k < N + 1; k++)
 					{
-						Data->SetValue(i - 1, j - 1, k - 1, 1 - 2 * Dens[i + (N + 2) * j + (N + 2) *(N + 2) *k]);
+						Batch.SetValue(i - 1, j - 1, k - 1, 1 - 2 * Dens[i + (N + 2) * j + (N + 2) *(N + 2) *k]);
 					}
 				}
 			}
-			Data->EndSet();
-		}
 
-		World->UpdateChunksOverlappingBox(FVoxelBox(FIntVector(-1, -1, -1), FIntVector(N + 1, N + 1, N + 1)), false);
+			TArray<FVoxelBox> ModifiedBoxes;
+			Batch.Apply(ModifiedBoxes);
+
+			for (auto& ModifiedBox : ModifiedBoxes)
+			{
+				World->UpdateChunksOverlappingBox(ModifiedBox, false);
+			}
+		}
 
 		for (int i = 1; i < N + 1; i++)
 		{
@@ -1077,7 +1031,11 @@ void UVoxelTools::TransformVoxelAsset(UVoxelAsset* InCompressedAsset, UVoxelAsse
 
 	FDecompressedVoxelAsset* InAsset;
 	FDecompressedVoxelDataAsset OutAsset;
-	InCompressedAsset->GetDecompressedAsset(InAsset, 1);
+	if (!InCompressedAsset->GetDecompressedAsset(InAsset, 1))
+	{
+		UE_LOG(LogVoxel, Error, TEXT("RotateVoxelAsset: Invalid Asset"));
+		return;
+	}
 
 	// Compute new bounds
 	FIntVector Min = InAsset->GetBounds().Min;
@@ -1166,7 +1124,11 @@ void UVoxelTools::DownscaleAsset(UVoxelAsset* InCompressedAsset, UVoxelAsset*& O
 
 	FDecompressedVoxelAsset* InAsset;
 	FDecompressedVoxelDataAsset OutAsset;
-	InCompressedAsset->GetDecompressedAsset(InAsset, 1);
+	if (!InCompressedAsset->GetDecompressedAsset(InAsset, 1))
+	{
+		UE_LOG(LogVoxel, Error, TEXT("DownscaleAsset: Invalid Asset"));
+		return;
+	}
 
 	FVoxelBox InBounds = InAsset->GetBounds();
 
@@ -1230,7 +1192,11 @@ void UVoxelTools::ApplyConvolutionToAsset(UVoxelAsset* InCompressedAsset, UVoxel
 
 	FDecompressedVoxelAsset* InAsset;
 	FDecompressedVoxelDataAsset OutAsset;
-	InCompressedAsset->GetDecompressedAsset(InAsset, 1);
+	if (!InCompressedAsset->GetDecompressedAsset(InAsset, 1))
+	{
+		UE_LOG(LogVoxel, Error, TEXT("DownscaleAsset: Invalid Asset"));
+		return;
+	}
 
 	FVoxelBox InBounds = InAsset->GetBounds();
 
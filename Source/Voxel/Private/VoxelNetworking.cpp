@@ -1,9 +1,15 @@
+#include "VoxelPrivate.h"
 #include "VoxelNetworking.h"
 
 FVoxelTcpConnection::FVoxelTcpConnection(FSocket* const Socket)
 	: Socket(Socket)
+	, bConnected(true)
+	, SendingOffset(0)
+	, ReceiveOffset(0)
+	, NextStateCheckTime(0)
 {
 	check(Socket);
+	Socket->SetNonBlocking(true);
 }
 
 FVoxelTcpConnection::~FVoxelTcpConnection()
@@ -11,54 +17,285 @@ FVoxelTcpConnection::~FVoxelTcpConnection()
 	ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(Socket);
 }
 
-bool FVoxelTcpConnection::SendData(TArray<uint8> Data)
+void FVoxelTcpConnection::SendMessage(const FVoxelMessagePtr& Message)
 {
-	int32 BytesSent = 0;
-	FArrayWriter Writer;
+	check(Message.IsValid() && Message->Num() <= VOXEL_MAX_MESSAGE_SIZE);
+	if (!bConnected)
+	{
+		return;
+	}
 
-	Writer << Data;
+	if (QueuedSize.Add(Message->Num()) + Message->Num() > VOXEL_MAX_QUEUED_SIZE)
+	{
+		// The network thread destroys the connection and its queue
+		UE_LOG(LogVoxel, Error, TEXT("Network: Remote too slow, %lld bytes waiting to be sent. Closing the connection"), QueuedSize.GetValue());
+		bConnected = false;
+		return;
+	}
+	OutgoingMessages.Enqueue(Message);
+}
 
-	bool bSuccess = Socket->Send(Writer.GetData(), Writer.Num(), BytesSent);
+bool FVoxelTcpConnection::ReceiveMessage(TArray<uint8>& OutMessage)
+{
+	FVoxelMessagePtr Message;
+	if (!IncomingMessages.Dequeue(Message))
+	{
+		return false;
+	}
+	OutMessage = MoveTemp(*Message);
+	return true;
+}
+
+bool FVoxelTcpConnection::IsConnected() const
+{
+	return bConnected;
+}
+
+bool FVoxelTcpConnection::Tick()
+{
+	if (!bConnected)
+	{
+		return false;
+	}
 
-	//UE_LOG(LogTemp, Log, TEXT("Bytes sent: %d. Success: %d"), BytesSent, bSuccess);
+	const bool bSent = SendPendingData();
+	const bool bReceived = ReceivePendingData();
 
+	// A connection closed by the remote doesn't always fail the calls above
+	if (bConnected && !bSent && !bReceived && FPlatformTime::Seconds() > NextStateCheckTime)
+	{
+		NextStateCheckTime = FPlatformTime::Seconds() + 1;
+		if (Socket->GetConnectionState() == SCS_ConnectionError)
+		{
+			bConnected = false;
+		}
+	}
 
-	return bSuccess;
+	return bSent || bReceived;
 }
 
-void FVoxelTcpConnection::ReceiveData(TArray<uint8>& OutData)
+bool FVoxelTcpConnection::SendPendingData()
 {
+	const int32 HeaderSize = sizeof(SendingHeader);
+
+	bool bProgress = false;
+	while (bConnected)
+	{
+		if (SendingMessage.IsValid() && SendingOffset == HeaderSize + SendingMessage->Num())
+		{
+			QueuedSize.Subtract(SendingMessage->Num());
+			SendingMessage.Reset();
+		}
+		if (!SendingMessage.IsValid())
+		{
+			if (!OutgoingMessages.Dequeue(SendingMessage))
+			{
+				break;
+			}
+			const uint32 Size = SendingMessage->Num();
+			SendingHeader[0] = Size & 0xFF;
+			SendingHeader[1] = (Size >> 8) & 0xFF;
+			SendingHeader[2] = (Size >> 16) & 0xFF;
+			SendingHeader[3] = (Size >> 24) & 0xFF;
+			SendingOffset = 0;
+		}
+
+		const uint8* Data;
+		int32 Count;
+		if (SendingOffset < HeaderSize)
+		{
+			Data = SendingHeader + SendingOffset;
+			Count = HeaderSize - SendingOffset;
+		}
+		else
+		{
+			Data = SendingMessage->GetData() + SendingOffset - HeaderSize;
+			Count = HeaderSize + SendingMessage->Num() - SendingOffset;
+		}
+
+		int32 BytesSent = 0;
+		if (!Socket->Send(Data, Count, BytesSent))
+		{
+			if (!WouldBlock())
+			{
+				UE_LOG(LogVoxel, Error, TEXT("Network: Send failed. Closing the connection"));
+				bConnected = false;
+			}
+			break;
+		}
+		if (BytesSent <= 0)
+		{
+			// Socket buffer full
+			break;
+		}
+		SendingOffset += BytesSent;
+		bProgress = true;
+	}
+	return bProgress;
+}
+
+bool FVoxelTcpConnection::ReceivePendingData()
+{
+	bool bProgress = false;
 	uint32 PendingDataSize = 0;
-	while (Socket->HasPendingData(PendingDataSize))
+	while (bConnected && Socket->HasPendingData(PendingDataSize))
 	{
-		FArrayReader ReceivedData = FArrayReader(true);
-		ReceivedData.Init(0, FMath::Min(PendingDataSize, 65507u));
+		const int32 Start = ReceiveBuffer.Num();
+		const int32 ReadSize = FMath::Min<uint32>(FMath::Max<uint32>(PendingDataSize, 1), 1024 * 1024);
+		ReceiveBuffer.AddUninitialized(ReadSize);
 
 		int32 BytesRead = 0;
-		Socket->Recv(ReceivedData.GetData(), ReceivedData.Num(), BytesRead);
+		const bool bSuccess = Socket->Recv(ReceiveBuffer.GetData() + Start, ReadSize, BytesRead);
+		ReceiveBuffer.SetNum(Start + FMath::Max(BytesRead, 0), false);
+
+		if (!bSuccess)
+		{
+			if (!WouldBlock())
+			{
+				UE_LOG(LogVoxel, Error, TEXT("Network: Receive failed. Closing the connection"));
+				bConnected = false;
+			}
+			break;
+		}
+		if (BytesRead <= 0)
+		{
+			break;
+		}
+		bProgress = true;
+	}
+
+	if (bProgress)
+	{
+		ExtractMessages();
+	}
+	return bProgress;
+}
+
+void FVoxelTcpConnection::ExtractMessages()
+{
+	const int32 HeaderSize = 4;
+	while (ReceiveBuffer.Num() - ReceiveOffset >= HeaderSize)
+	{
+		const uint8* Header = ReceiveBuffer.GetData() + ReceiveOffset;
+		const uint32 Size = Header[0] | (Header[1] << 8) | (Header[2] << 16) | ((uint32)Header[3] << 24);
+		if (Size > VOXEL_MAX_MESSAGE_SIZE)
+		{
+			UE_LOG(LogVoxel, Error, TEXT("Network: Invalid message size %u. Closing the connection"), Size);
+			bConnected = false;
+			return;
+		}
+		if ((uint32)(ReceiveBuffer.Num() - ReceiveOffset - HeaderSize) < Size)
+		{
+			// Incomplete: wait for the rest
+			break;
+		}
 
-		ReceivedData << OutData;
+		IncomingMessages.Enqueue(MakeShareable(new TArray<uint8>(Header + HeaderSize, Size)));
+		ReceiveOffset += HeaderSize + Size;
+	}
 
-		//GEngine->AddOnScreenDebugMessage(-1, 5.f, FColor::Green, FString::Printf(TEXT("%d bytes received"), BytesRead));
+	// Drop the consumed bytes once they are most of the buffer: each byte is moved at most once on average
+	if (ReceiveOffset > 0 && ReceiveOffset >= ReceiveBuffer.Num() / 2)
+	{
+		ReceiveBuffer.RemoveAt(0, ReceiveOffset, false);
+		ReceiveOffset = 0;
 	}
 }
 
+bool FVoxelTcpConnection::WouldBlock() const
+{
+	return ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->GetLastErrorCode() == SE_EWOULDBLOCK;
+}
 
 
 
 
-FVoxelTcpClient::FVoxelTcpClient()
-	: Connection(nullptr)
+
+FVoxelNetworkThread::FVoxelNetworkThread()
+	: bStopping(false)
+	, WakeUpEvent(FPlatformProcess::GetSynchEventFromPool(false))
+	, Thread(nullptr)
 {
+	Thread = FRunnableThread::Create(this, TEXT("VoxelNetworkThread"), 0, TPri_Normal);
+}
 
+FVoxelNetworkThread::~FVoxelNetworkThread()
+{
+	// Calls Stop and waits for Run to return
+	Thread->Kill(true);
+	delete Thread;
+	FPlatformProcess::ReturnSynchEventToPool(WakeUpEvent);
 }
 
-FVoxelTcpClient::~FVoxelTcpClient()
+void FVoxelNetworkThread::AddConnection(const TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>& Connection)
+{
+	FScopeLock Lock(&Section);
+	Connections.Add(Connection);
+}
+
+void FVoxelNetworkThread::GetConnections(TArray<TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>>& OutConnections) const
+{
+	FScopeLock Lock(&Section);
+	for (auto& Connection : Connections)
+	{
+		if (Connection->IsConnected())
+		{
+			OutConnections.Add(Connection);
+		}
+	}
+}
+
+void FVoxelNetworkThread::WakeUp()
 {
-	if (Connection)
+	WakeUpEvent->Trigger();
+}
+
+uint32 FVoxelNetworkThread::Run()
+{
+	TArray<TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>> CurrentConnections;
+	while (!bStopping)
 	{
-		delete Connection;
+		{
+			FScopeLock Lock(&Section);
+			Connections.RemoveAll([](const TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>& Connection) { return !Connection->IsConnected(); });
+			CurrentConnections = Connections;
+		}
+
+		bool bProgress = false;
+		for (auto& Connection : CurrentConnections)
+		{
+			bProgress |= Connection->Tick();
+		}
+		CurrentConnections.Reset();
+
+		if (!bProgress)
+		{
+			// Poll the sockets every ms when idle. Queued messages wake the thread up
+			WakeUpEvent->Wait(1);
+		}
 	}
+	return 0;
+}
+
+void FVoxelNetworkThread::Stop()
+{
+	bStopping = true;
+	WakeUpEvent->Trigger();
+}
+
+
+
+
+
+FVoxelTcpClient::FVoxelTcpClient()
+{
+
+}
+
+FVoxelTcpClient::~FVoxelTcpClient()
+{
+	// Stop the thread before the connection is released
+	NetworkThread.Reset();
 }
 
 void FVoxelTcpClient::ConnectTcpClient(const FString& Ip, const int32 Port)
@@ -89,30 +326,30 @@ void FVoxelTcpClient::ConnectTcpClient(const FString& Ip, const int32 Port)
 		}
 		else
 		{
-			if (Connection)
-			{
-				delete Connection;
-			}
-			Connection = new FVoxelTcpConnection(Socket);
+			NetworkThread.Reset();
+			Connection = MakeShareable(new FVoxelTcpConnection(Socket));
+			NetworkThread = MakeUnique<FVoxelNetworkThread>();
+			NetworkThread->AddConnection(Connection);
 		}
 	}
 }
 
-void FVoxelTcpClient::ReceiveData(TArray<uint8>& OutData)
+bool FVoxelTcpClient::ReceiveMessage(TArray<uint8>& OutMessage)
 {
-	if (Connection)
+	if (Connection.IsValid())
 	{
-		Connection->ReceiveData(OutData);
+		return Connection->ReceiveMessage(OutMessage);
 	}
 	else
 	{
 		UE_LOG(LogTemp, Error, TEXT("Client not connected"));
+		return false;
 	}
 }
 
 bool FVoxelTcpClient::IsValid()
 {
-	return Connection != nullptr;
+	return Connection.IsValid() && Connection->IsConnected();
 }
 
 
@@ -127,11 +364,9 @@ FVoxelTcpServer::FVoxelTcpServer()
 
 FVoxelTcpServer::~FVoxelTcpServer()
 {
-	for (auto Connection : Connections)
-	{
-		delete Connection;
-	}
+	// No more connections accepted once the listener is deleted
 	delete TcpListener;
+	NetworkThread.Reset();
 }
 
 void FVoxelTcpServer::StartTcpServer(const FString& Ip, const int32 Port)
@@ -140,6 +375,8 @@ void FVoxelTcpServer::StartTcpServer(const FString& Ip, const int32 Port)
 	{
 		delete TcpListener;
 	}
+	NetworkThread.Reset();
+	NetworkThread = MakeUnique<FVoxelNetworkThread>();
 
 	FIPv4Address Addr;
 	FIPv4Address::Parse(Ip, Addr);
@@ -153,23 +390,50 @@ void FVoxelTcpServer::StartTcpServer(const FString& Ip, const int32 Port)
 
 bool FVoxelTcpServer::Accept(FSocket* NewSocket, const FIPv4Endpoint& Endpoint)
 {
-	Connections.Add(new FVoxelTcpConnection(NewSocket));
+	NetworkThread->AddConnection(MakeShareable(new FVoxelTcpConnection(NewSocket)));
 
-	GEngine->AddOnScreenDebugMessage(-1, 5.f, FColor::Green, TEXT("Connected!"));
+	UE_LOG(LogVoxel, Log, TEXT("Network: Client %s connected"), *Endpoint.ToString());
 	return true;
 }
 
-bool FVoxelTcpServer::SendData(TArray<uint8> Data)
+bool FVoxelTcpServer::SendMessage(TArray<uint8>&& Message)
 {
-	bool bSuccess = true;
-	for (auto Socket : Connections)
+	if (Message.Num() > VOXEL_MAX_MESSAGE_SIZE)
 	{
-		bSuccess = bSuccess && Socket->SendData(Data);
+		UE_LOG(LogVoxel, Error, TEXT("Network: Message of %d bytes is too large to be sent. Dropping it"), Message.Num());
+		return false;
 	}
-	return bSuccess;
+
+	TArray<TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>> Connections;
+	if (NetworkThread)
+	{
+		NetworkThread->GetConnections(Connections);
+	}
+	if (Connections.Num() == 0)
+	{
+		return false;
+	}
+
+	FVoxelMessagePtr SharedMessage = MakeShareable(new TArray<uint8>(MoveTemp(Message)));
+	for (auto& Connection : Connections)
+	{
+		Connection->SendMessage(SharedMessage);
+	}
+	NetworkThread->WakeUp();
+	return true;
 }
 
-bool FVoxelTcpServer::IsValid()
+bool FVoxelTcpServer::HasConnectedClients()
 {
+	TArray<TSharedPtr<FVoxelTcpConnection, ESPMode::ThreadSafe>> Connections;
+	if (NetworkThread)
+	{
+		NetworkThread->GetConnections(Connections);
+	}
 	return Connections.Num() > 0;
 }
+
+bool FVoxelTcpServer::IsValid()
+{
+	return HasConnectedClients();
+}
@@ -3,6 +3,7 @@
 #include "VoxelPolygonizer.h"
 #include "Transvoxel.h"
 #include "VoxelData.h"
+#include "VoxelDataSnapshot.h"
 #include "VoxelMaterial.h"
 #include <deque>
 
@@ -48,9 +49,19 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 		SCOPE_CYCLE_COUNTER(STAT_CACHE);
 
 		FIntVector Size(CHUNKSIZE + 3, CHUNKSIZE + 3, CHUNKSIZE + 3);
-		Data->BeginGet();
-		Data->GetValuesAndMaterials(CachedValues, CachedMaterials, ChunkPosition - FIntVector(1, 1, 1) * Step(), FIntVector::ZeroValue, Step(), Size, Size);
-		Data->EndGet();
+		Snapshot = Data->CreateSnapshot(GetSnapshotBox(), Depth);
+
+		// If all the cached values have the same sign there is no surface: skip fetching them
+		float MinValue, MaxValue;
+		const FVoxelBox CacheBox(ChunkPosition - FIntVector(1, 1, 1) * Step(), ChunkPosition + FIntVector(1, 1, 1) * (CHUNKSIZE + 1) * Step());
+		if (Snapshot->GetValueRange(CacheBox, MinValue, MaxValue) && (MinValue > 0 || MaxValue <= 0))
+		{
+			OutSection.Reset();
+			Snapshot.Reset();
+			return;
+		}
+
+		Snapshot->GetValuesAndMaterials(CachedValues, CachedMaterials, ChunkPosition - FIntVector(1, 1, 1) * Step(), FIntVector::ZeroValue, Step(), Size, Size);
 
 		// Cache signs
 		for (int CubeX = 0; CubeX < 6; CubeX++)
@@ -112,7 +123,6 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 					{
 						continue;
 					}
-					Data->BeginGet();
 					for (int LocalX = 0; LocalX < 3; LocalX++)
 					{
 						for (int LocalY = 0; LocalY < 3; LocalY++)
@@ -334,7 +344,6 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 							}
 						}
 					}
-					Data->EndGet();
 				}
 			}
 		}
@@ -345,6 +354,7 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 	{
 		// Early exit
 		OutSection.Reset();
+		Snapshot.Reset();
 		return;
 	}
 
@@ -680,7 +690,6 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 		const int OldVerticesSize = VerticesSize;
 		const int OldTrianglesSize = TrianglesSize;
 
-		Data->BeginGet();
 		{
 			SCOPE_CYCLE_COUNTER(STAT_TRANSITIONS_ITER);
 
@@ -830,7 +839,6 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 				}
 			}
 		}
-		Data->EndGet();
 
 		{
 			SCOPE_CYCLE_COUNTER(STAT_ADD_TRANSITIONS_TO_SECTION);
@@ -934,7 +942,6 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 		SCOPE_CYCLE_COUNTER(STAT_AMBIENT_OCCLUSION);
 
 		{
-			Data->BeginGet();
 			for (auto& Vertex : OutSection.ProcVertexBuffer)
 			{
 				int HitCount = 0;
@@ -978,7 +985,6 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 				}
 				Vertex.Color.A = FMath::Clamp<int>(255.f * (1.f - HitCount / (float)TotalRays), 0, 255);
 			}
-			Data->EndGet();
 		}
 	}
 
@@ -987,6 +993,9 @@ void FVoxelPolygonizer::CreateSection(FVoxelProcMeshSection& OutSection)
 		// Else physics thread crash
 		OutSection.Reset();
 	}
+
+	// Release the leaves data
+	Snapshot.Reset();
 }
 
 int FVoxelPolygonizer::Size()
@@ -999,6 +1008,13 @@ int FVoxelPolygonizer::Step()
 	return 1 << Depth;
 }
 
+FVoxelBox FVoxelPolygonizer::GetSnapshotBox()
+{
+	// -1/+2: normals. Ambient occlusion rays can go up to RayMaxDistance steps further
+	const int Margin = bEnableAmbientOcclusion ? RayMaxDistance + 1 : 0;
+	return FVoxelBox(ChunkPosition - FIntVector(1, 1, 1) * (1 + Margin) * Step(), ChunkPosition + FIntVector(1, 1, 1) * (CHUNKSIZE + 2 + Margin) * Step());
+}
+
 
 void FVoxelPolygonizer::GetValueAndMaterial(int X, int Y, int Z, float& OutValue, FVoxelMaterial& OutMaterial)
 {
@@ -1020,7 +1036,7 @@ void FVoxelPolygonizer::GetValueAndMaterial(int X, int Y, int Z, float& OutValue
 
 void FVoxelPolygonizer::GetValueAndMaterialNoCache(int X, int Y, int Z, float& OutValue, FVoxelMaterial& OutMaterial)
 {
-	Data->GetValueAndMaterial(X + ChunkPosition.X, Y + ChunkPosition.Y, Z + ChunkPosition.Z, OutValue, OutMaterial);
+	Snapshot->GetValueAndMaterial(X + ChunkPosition.X, Y + ChunkPosition.Y, Z + ChunkPosition.Z, OutValue, OutMaterial);
 }
 
 void FVoxelPolygonizer::GetValueAndMaterialFromCache(int X, int Y, int Z, float& OutValue, FVoxelMaterial& OutMaterial)
@@ -5,10 +5,12 @@
 #include "CoreMinimal.h"
 #include "VoxelProceduralMeshComponent.h"
 #include "TransitionDirection.h"
+#include "VoxelBox.h"
 
 #define CHUNKSIZE 16
 
 class FVoxelData;
+class FVoxelDataSnapshot;
 struct FVoxelMaterial;
 
 class FVoxelPolygonizer
@@ -34,7 +36,10 @@ private:
 	const float NormalThresholdForSimplification;
 
 
-	// Cache of the sign of the values. Can lead to crash if value changed between cache and 2nd access
+	// Data read by CreateSection. Immutable, so that values can't change between cache and 2nd access
+	TSharedPtr<FVoxelDataSnapshot> Snapshot;
+
+	// Cache of the sign of the values
 	uint64 CachedSigns[216];
 
 	// +3: 2 for normal + one for end edge
@@ -52,6 +57,8 @@ private:
 	FORCEINLINE int Size();
 	// Step between cubes
 	FORCEINLINE int Step();
+	// Box read by this polygonizer
+	FORCEINLINE FVoxelBox GetSnapshotBox();
 
 	FORCEINLINE void GetValueAndMaterial(int X, int Y, int Z, float& OutValue, FVoxelMaterial& OutMaterial);
 	FORCEINLINE void GetValueAndMaterialNoCache(int X, int Y, int Z, float& OutValue, FVoxelMaterial& OutMaterial);
@@ -75,15 +75,16 @@ void FChunkOctree::CreateChilds()
 
     AssignMeshId();
 
-    FOctree::GetIDsAt(Id, LOD, IDs);
-	Childs.Add(new FChunkOctree(Render, Position+FIntVector(-d,-d,-d), LOD, IDs[0], MeshId));
-	Childs.Add(new FChunkOctree(Render, Position+FIntVector(+d,-d,-d), LOD, IDs[1], MeshId));
-	Childs.Add(new FChunkOctree(Render, Position+FIntVector(-d,+d,-d), LOD, IDs[2], MeshId));
-	Childs.Add(new FChunkOctree(Render, Position+FIntVector(+d,+d,-d), LOD, IDs[3], MeshId));
-	Childs.Add(new FChunkOctree(Render, Position+FIntVector(-d,-d,+d), LOD, IDs[4], MeshId));
-	Childs.Add(new FChunkOctree(Render, Position+FIntVector(+d,-d,+d), LOD, IDs[5], MeshId));
-	Childs.Add(new FChunkOctree(Render, Position+FIntVector(-d,+d,+d), LOD, IDs[6], MeshId));
-	Childs.Add(new FChunkOctree(Render, Position+FIntVector(+d,+d,+d), LOD, IDs[7], MeshId));
+    FOctree::GetIDsAt(Id, IDs);
+	FChunkOctree* Block = Childs.Allocate(Render->GetChunkBlockPool());
+	new (&Block[0]) FChunkOctree(Render, Position+FIntVector(-d,-d,-d), LOD, IDs[0], MeshId);
+	new (&Block[1]) FChunkOctree(Render, Position+FIntVector(+d,-d,-d), LOD, IDs[1], MeshId);
+	new (&Block[2]) FChunkOctree(Render, Position+FIntVector(-d,+d,-d), LOD, IDs[2], MeshId);
+	new (&Block[3]) FChunkOctree(Render, Position+FIntVector(+d,+d,-d), LOD, IDs[3], MeshId);
+	new (&Block[4]) FChunkOctree(Render, Position+FIntVector(-d,-d,+d), LOD, IDs[4], MeshId);
+	new (&Block[5]) FChunkOctree(Render, Position+FIntVector(+d,-d,+d), LOD, IDs[5], MeshId);
+	new (&Block[6]) FChunkOctree(Render, Position+FIntVector(-d,+d,+d), LOD, IDs[6], MeshId);
+	new (&Block[7]) FChunkOctree(Render, Position+FIntVector(+d,+d,+d), LOD, IDs[7], MeshId);
 
 	bHasChilds = true;
 }
@@ -94,11 +95,7 @@ void FChunkOctree::DestroyChilds()
 	check(bHasChilds);
 	check(Childs.Num() == 8);
 
-	for (FChunkOctree* Child : Childs)
-	{
-        delete Child;
-	}
-
+	// Destroys the childs and gives their block back to the pool
 	Childs.Reset();
 	bHasChilds = false;
 }
@@ -249,9 +246,12 @@ FChunkOctree* FChunkOctree::GetChild(FIntVector PointPosition)
 
 void FChunkOctree::GetLeafsOverlappingBox(FVoxelBox Box, std::forward_list<FChunkOctree*>& Octrees)
 {
-	FVoxelBox OctreeBox(GetMinimalCornerPosition(), GetMaximalCornerPosition());
+	// Voxels read by the polygonizer: one step before for the normals, two after for the normals and the transitions.
+	// Also contains the footprints of the childs, whose steps are smaller
+	const int Step = Size() / 16;
+	FVoxelBox Footprint(GetMinimalCornerPosition() - FIntVector(1, 1, 1) * Step, GetMaximalCornerPosition() + FIntVector(2, 2, 2) * Step);
 
-	if (OctreeBox.Intersect(Box))
+	if (Footprint.Intersect(Box))
 	{
 		if (IsLeaf())
 		{
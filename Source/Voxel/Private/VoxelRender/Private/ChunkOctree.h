@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "Octree.h"
+#include "OctreeChilds.h"
 #include "VoxelBox.h"
 
 class FVoxelChunkNode;
@@ -64,6 +65,10 @@ public:
 	*/
 	FChunkOctree* GetChild(FIntVector PointPosition);
 
+	/**
+	 * Get the leaves whose meshes read voxels in Box
+	 * @param	Box		Box in voxel space
+	 */
 	void GetLeafsOverlappingBox(FVoxelBox Box, std::forward_list<FChunkOctree*>& Octrees);
 
 private:
@@ -77,7 +82,7 @@ private:
 	 *  v 1 | 3    5 | 7
 	 *  x
 	 */
-	TArray<FChunkOctree*, TFixedAllocator<8>> Childs;
+	TOctreeChilds<FChunkOctree> Childs;
 
 	// Whether chunk contains a mesh chunk node
 	bool bHasChunk;
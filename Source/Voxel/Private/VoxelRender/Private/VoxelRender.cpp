@@ -534,8 +534,6 @@ void FVoxelRender::UpdateChunksAtPosition(FIntVector Position, bool bAsync)
 
 void FVoxelRender::UpdateChunksOverlappingBox(FVoxelBox Box, bool bAsync)
 {
-	Box.Min -= FIntVector(2, 2, 2); // For normals
-	Box.Max += FIntVector(2, 2, 2); // For normals
 	std::forward_list<FChunkOctree*> OverlappingLeafs;
 	MainOctree->GetLeafsOverlappingBox(Box, OverlappingLeafs);
 
@@ -680,6 +678,11 @@ FVector FVoxelRender::GetGlobalPosition(FIntVector LocalPosition)
 	return World->LocalToGlobal(LocalPosition) + ChunksParent->GetActorLocation() - World->GetActorLocation();
 }
 
+TOctreeBlockPool<FChunkOctree>& FVoxelRender::GetChunkBlockPool()
+{
+	return ChunkBlockPool;
+}
+
 FQueuedThreadPool* const FVoxelRender::GetRenderThreadPool()
 {
     check(RenderThreadPool.IsValid());
@@ -6,6 +6,7 @@
 #include "VoxelBox.h"
 #include "VoxelProceduralMeshTypes.h"
 #include "VoxelThreadPool.h"
+#include "OctreeChilds.h"
 #include "Containers/Queue.h"
 #include <list>
 
@@ -63,6 +64,9 @@ public:
 	FORCEINLINE FChunkOctree* GetOctree();
 	FChunkOctree* GetChunkOctreeAt(FIntVector Position) const;
 
+	// Pool of the chunk octree childs. Game thread only
+	FORCEINLINE TOctreeBlockPool<FChunkOctree>& GetChunkBlockPool();
+
 	int GetDepthAt(FIntVector Position) const;
 	void SetVisibleLOD(int32 NewVisibleLOD);
 
@@ -102,6 +106,8 @@ private:
 	TQueue<FChunkOctree*> ChunksToUpdate;
 	// Ids of the chunks that need to be updated synchronously
 	TSet<FChunkOctree*> SynchronouslyUpdatingChunks;
+	// Pool of the chunk octree childs. Declared before MainOctree so that it is destroyed after it
+	TOctreeBlockPool<FChunkOctree> ChunkBlockPool;
 	// Main octree reference
 	TSharedPtr<FChunkOctree> MainOctree;
 
@@ -3,9 +3,14 @@
 #include "VoxelWorld.h"
 #include "Components/CapsuleComponent.h"
 #include "VoxelData.h"
+#include "VoxelSaveJournal.h"
+#include "VoxelEditLog.h"
+#include "VoxelToolOperation.h"
 #include "VoxelRender.h"
 #include "VoxelInvokerComponent.h"
 #include "FlatWorldGenerator.h"
+#include "Misc/Paths.h"
+#include "Async/Async.h"
 #include <forward_list>
 
 #include "DrawDebugHelpers.h"
@@ -29,6 +34,11 @@ AVoxelWorld::AVoxelWorld()
 	, Seed(100)
 	, bMultiplayer(false)
 	, MultiplayerSyncRate(10)
+	, bEnablePaging(false)
+	, PagingIdleTime(60)
+	, bEnableSaveJournal(false)
+	, SaveJournalFilename(TEXT("VoxelJournal.bin"))
+	, SaveJournalInterval(30)
 	, Render(nullptr)
 	, Data(nullptr)
 	, InstancedWorldGenerator(nullptr)
@@ -44,6 +54,9 @@ AVoxelWorld::AVoxelWorld()
 	, MeshCompressionLevel(7)
 	, NormalThresholdForSimplification(1.f)
 	, TimeSinceSync(0)
+	, TimeSincePaging(0)
+	, TimeSinceSharing(0)
+	, TimeSinceJournalSave(0)
 {
 	PrimaryActorTick.bCanEverTick = true;
 
@@ -90,7 +103,71 @@ void AVoxelWorld::Tick(float DeltaTime)
 
 	if (IsCreated())
 	{
+		if (SaveFuture.IsValid() && SaveFuture.IsReady())
+		{
+			TSharedPtr<FVoxelWorldSave, ESPMode::ThreadSafe> Save = SaveFuture.Get();
+			SaveFuture = TFuture<TSharedPtr<FVoxelWorldSave, ESPMode::ThreadSafe>>();
+			OnSaveCompleted.Broadcast(*Save);
+		}
+
+		if (LoadFuture.IsValid() && LoadFuture.IsReady())
+		{
+			TSharedPtr<std::forward_list<FVoxelBox>, ESPMode::ThreadSafe> ModifiedBoxes = LoadFuture.Get();
+			LoadFuture = TFuture<TSharedPtr<std::forward_list<FVoxelBox>, ESPMode::ThreadSafe>>();
+			for (auto& Box : *ModifiedBoxes)
+			{
+				UpdateChunksOverlappingBox(Box, true);
+			}
+			OnLoadCompleted.Broadcast();
+		}
+
 		Render->Tick(DeltaTime);
+
+		if (IdleLeavesFuture.IsValid() && IdleLeavesFuture.IsReady())
+		{
+			IdleLeavesFuture = TFuture<void>();
+		}
+
+		TimeSinceSharing += DeltaTime;
+		TimeSincePaging += DeltaTime;
+		// Leaves are idle for at most 1.25 * PagingIdleTime before being paged out
+		const bool bPageOut = bEnablePaging && TimeSincePaging > PagingIdleTime / 4;
+		if ((bPageOut || TimeSinceSharing > FVoxelData::ShareIdleTime) && !IdleLeavesFuture.IsValid())
+		{
+			TimeSinceSharing = 0;
+			if (bPageOut)
+			{
+				TimeSincePaging = 0;
+			}
+
+			// Paging compresses and writes to disk: never on the game thread
+			FVoxelData* const VoxelData = Data.Get();
+			const float IdleTime = PagingIdleTime;
+			IdleLeavesFuture = Async<void>(EAsyncExecution::ThreadPool, [VoxelData, bPageOut, IdleTime]()
+			{
+				// Shared first: only the leaves already shared are paged out
+				VoxelData->ShareIdleLeavesData();
+				if (bPageOut)
+				{
+					VoxelData->PageOutIdleLeaves(IdleTime);
+				}
+			});
+		}
+
+		if (JournalFuture.IsValid() && JournalFuture.IsReady())
+		{
+			JournalFuture = TFuture<bool>();
+		}
+
+		if (SaveJournal.IsValid() && SaveJournalInterval > 0)
+		{
+			TimeSinceJournalSave += DeltaTime;
+			if (TimeSinceJournalSave > SaveJournalInterval && !JournalFuture.IsValid())
+			{
+				TimeSinceJournalSave = 0;
+				SaveToJournal();
+			}
+		}
 	}
 
 	if (bMultiplayer && (TcpClient.IsValid() || TcpServer.IsValid()))
@@ -146,7 +223,14 @@ void AVoxelWorld::CreateWorld()
 	}
 
 	// Create Data
-	Data = MakeShareable( new FVoxelData(Depth, InstancedWorldGenerator, bMultiplayer) );
+	Data = MakeShareable( new FVoxelData(Depth, InstancedWorldGenerator, bMultiplayer, bEnablePaging) );
+	if (TcpClient.IsValid())
+	{
+		// Clients never send their edits
+		Data->SetRecordNetworkDiffs(false);
+	}
+
+	EditLog = MakeShareable(new FVoxelEditLog());
 
 	// Create Render
 	Render = MakeShareable( new FVoxelRender(this, this, Data.Get()) );
@@ -159,6 +243,26 @@ void AVoxelWorld::CreateWorld()
     }
 
 	bIsCreated = true;
+
+	if (bEnableSaveJournal)
+	{
+		SaveJournal = MakeShareable(new FVoxelSaveJournal(FPaths::GameSavedDir() / SaveJournalFilename, Depth));
+		if (SaveJournal->IsValid())
+		{
+			FVoxelWorldSave Save;
+			if (SaveJournal->GetSave(Save) && Save.Records.Num() > 0)
+			{
+				LoadFromSave(Save, true);
+			}
+			// The journal already contains everything loaded
+			Data->StartJournalTracking();
+			TimeSinceJournalSave = 0;
+		}
+		else
+		{
+			SaveJournal.Reset();
+		}
+	}
 }
 
 void AVoxelWorld::DestroyWorld()
@@ -167,10 +271,21 @@ void AVoxelWorld::DestroyWorld()
 
 	UE_LOG(LogVoxel, Warning, TEXT("Destroying world"));
 
+	// They use Data
+	WaitForAsyncTasks();
+
+	if (SaveJournal.IsValid())
+	{
+		// Don't lose the edits since the last save
+		WriteToJournal(*Data, *SaveJournal);
+		SaveJournal.Reset();
+	}
+
 	check(Render.IsValid());
 	check(Data.IsValid());
 	Render->Destroy();
 	Render.Reset();
+	EditLog.Reset();
 	Data.Reset(); // Data must be deleted AFTER Render
 
 	bIsCreated = false;
@@ -216,84 +331,69 @@ void AVoxelWorld::StartServer(const FString& Ip, const int32 Port)
 void AVoxelWorld::ConnectClient(const FString& Ip, const int32 Port)
 {
 	TcpClient.ConnectTcpClient(Ip, Port);
+
+	if (Data.IsValid())
+	{
+		// Clients never send their edits
+		Data->SetRecordNetworkDiffs(false);
+	}
 }
 
-void AVoxelWorld::Sync()
+void AVoxelWorld::ApplyToolOperation(const FVoxelToolOperation& Operation, bool bAsync)
 {
-	if (TcpServer.IsValid())
-	{
-		FBufferArchive ToBinary;
+	check(IsCreated());
 
-		std::forward_list<FVoxelValueDiff> ValueDiffList;
-		std::forward_list<FVoxelMaterialDiff> MaterialDiffList;
-		Data->GetDiffLists(ValueDiffList, MaterialDiffList);
+	if (bMultiplayer && TcpServer.HasConnectedClients() && Operation.IsValid(Data.Get()))
+	{
+		EditLog->ApplyAndLogOperation(Data.Get(), Operation);
+	}
+	else
+	{
+		// Nobody to send the operation to: log nothing, so that the log doesn't grow until a client connects.
+		// Operations the clients would reject are sent as diffs
+		Operation.Apply(Data.Get(), true);
+	}
 
-		int ValueDiffCount = 0;
-		int MaterialDiffCount = 0;
-		for (auto ValueDiff : ValueDiffList)
-		{
-			ValueDiffCount++;
-		}
-		for (auto MaterialDiff : MaterialDiffList)
-		{
-			MaterialDiffCount++;
-		}
+	UpdateChunksOverlappingBox(Operation.GetBox(), bAsync);
+}
 
-		ToBinary << ValueDiffCount;
-		ToBinary << MaterialDiffCount;
-		for (auto ValueDiff : ValueDiffList)
-		{
-			ToBinary << ValueDiff;
-		}
-		for (auto MaterialDiff : MaterialDiffList)
-		{
-			ToBinary << MaterialDiff;
-		}
+void AVoxelWorld::Sync()
+{
+	if (TcpServer.IsValid())
+	{
+		TArray<TArray<uint8>> Messages;
+		EditLog->Flush(Data.Get(), Messages, VOXEL_MAX_MESSAGE_SIZE);
 
-		bool bSuccess = TcpServer.SendData(ToBinary);
-		if (!bSuccess)
+		// Sent by the network thread
+		for (auto& Message : Messages)
 		{
-			UE_LOG(LogTemp, Error, TEXT("SendData failed"));
+			bool bSuccess = TcpServer.SendMessage(MoveTemp(Message));
+			if (!bSuccess)
+			{
+				UE_LOG(LogVoxel, Warning, TEXT("Sync: All the clients disconnected"));
+				break;
+			}
 		}
 	}
 	else if (TcpClient.IsValid())
 	{
+		// Complete messages reassembled by the network thread, in sending order
 		TArray<uint8> BinaryData;
-		TcpClient.ReceiveData(BinaryData);
-
-		if (BinaryData.Num())
+		while (TcpClient.ReceiveMessage(BinaryData))
 		{
 			FMemoryReader FromBinary(BinaryData);
 			FromBinary.Seek(0);
 
-			std::forward_list<FVoxelValueDiff> ValueDiffList;
-			std::forward_list<FVoxelMaterialDiff> MaterialDiffList;
+			// Entries before an invalid one are applied
+			std::forward_list<FVoxelBox> ModifiedBoxes;
+			FVoxelEditLog::Replay(Data.Get(), FromBinary, ModifiedBoxes);
 
-			int ValueDiffCount = 0;
-			int MaterialDiffCount = 0;
-			FromBinary << ValueDiffCount;
-			FromBinary << MaterialDiffCount;
-
-			for (int i = 0; i < ValueDiffCount; i++)
+			for (auto& Box : ModifiedBoxes)
 			{
-				FVoxelValueDiff ValueDiff;
-				FromBinary << ValueDiff;
-				ValueDiffList.push_front(ValueDiff);
-			}
-			for (int i = 0; i < MaterialDiffCount; i++)
-			{
-				FVoxelMaterialDiff MaterialDiff;
-				FromBinary << MaterialDiff;
-				MaterialDiffList.push_front(MaterialDiff);
-			}
-
-			std::forward_list<FIntVector> ModifiedPositions;
-			Data->LoadFromDiffListsAndGetModifiedPositions(ValueDiffList, MaterialDiffList, ModifiedPositions);
-
-			for (auto Position : ModifiedPositions)
-			{
-				UpdateChunksAtPosition(Position, true);
-				DrawDebugPoint(GetWorld(), LocalToGlobal(Position), 10, FColor::Magenta, false, 1.1f / MultiplayerSyncRate);
+				UpdateChunksOverlappingBox(Box, true);
+				const FVector Min = LocalToGlobal(Box.Min);
+				const FVector Max = LocalToGlobal(Box.Max);
+				DrawDebugBox(GetWorld(), (Min + Max) / 2, (Max - Min) / 2 + FVector::OneVector * GetVoxelSize() / 2, FColor::Magenta, false, 1.1f / MultiplayerSyncRate);
 			}
 		}
 	}
@@ -310,9 +410,9 @@ float AVoxelWorld::GetValue(const FIntVector& Position) const
 		FVoxelMaterial Material;
 		float Value;
 
-		Data->BeginGet();
+		Data->BeginGet(FVoxelBox(Position, Position));
 		Data->GetValueAndMaterial(Position.X, Position.Y, Position.Z, Value, Material);
-		Data->EndGet();
+		Data->EndGet(FVoxelBox(Position, Position));
 
 		return Value;
 	}
@@ -330,9 +430,9 @@ FVoxelMaterial AVoxelWorld::GetMaterial(const FIntVector& Position) const
 		FVoxelMaterial Material;
 		float Value;
 
-		Data->BeginGet();
+		Data->BeginGet(FVoxelBox(Position, Position));
 		Data->GetValueAndMaterial(Position.X, Position.Y, Position.Z, Value, Material);
-		Data->EndGet();
+		Data->EndGet(FVoxelBox(Position, Position));
 
 		return Material;
 	}
@@ -347,9 +447,9 @@ void AVoxelWorld::SetValue(const FIntVector& Position, float Value)
 {
 	if (IsInWorld(Position))
 	{
-		Data->BeginSet();
+		Data->BeginSet(FVoxelBox(Position, Position));
 		Data->SetValue(Position.X, Position.Y, Position.Z, Value);
-		Data->EndSet();
+		Data->EndSet(FVoxelBox(Position, Position));
 	}
 	else
 	{
@@ -361,9 +461,9 @@ void AVoxelWorld::SetMaterial(const FIntVector& Position, const FVoxelMaterial&
 {
 	if (IsInWorld(Position))
 	{
-		Data->BeginSet();
+		Data->BeginSet(FVoxelBox(Position, Position));
 		Data->SetMaterial(Position.X, Position.Y, Position.Z, Material);
-		Data->EndSet();
+		Data->EndSet(FVoxelBox(Position, Position));
 	}
 	else
 	{
@@ -392,18 +492,143 @@ void AVoxelWorld::SaveWorldMesh()
     //Render->GetMeshSaveData();
 }
 
+bool AVoxelWorld::SaveToJournal()
+{
+	if (!SaveJournal.IsValid())
+	{
+		UE_LOG(LogVoxel, Error, TEXT("SaveToJournal: The save journal is disabled"));
+		return false;
+	}
+	if (JournalFuture.IsValid())
+	{
+		UE_LOG(LogVoxel, Warning, TEXT("SaveToJournal: A journal save is already running"));
+		return false;
+	}
+
+	// Compressing, writing and compacting read the whole journal: never on the game thread
+	FVoxelData* const VoxelData = Data.Get();
+	FVoxelSaveJournal* const Journal = SaveJournal.Get();
+	JournalFuture = Async<bool>(EAsyncExecution::ThreadPool, [VoxelData, Journal]()
+	{
+		return WriteToJournal(*VoxelData, *Journal);
+	});
+
+	return true;
+}
+
+bool AVoxelWorld::WriteToJournal(FVoxelData& VoxelData, FVoxelSaveJournal& Journal)
+{
+	const double StartTime = FPlatformTime::Seconds();
+
+	if (!Journal.IsValid() && !Journal.Compact())
+	{
+		// A previous write failed
+		return false;
+	}
+
+	const bool bSuccess = VoxelData.AppendToJournal(Journal);
+	if (bSuccess && Journal.NeedsCompaction())
+	{
+		Journal.Compact();
+	}
+
+	UE_LOG(LogVoxel, Verbose, TEXT("SaveToJournal took %fms"), (FPlatformTime::Seconds() - StartTime) * 1000);
+
+	return bSuccess;
+}
+
+bool AVoxelWorld::GetSaveAsync()
+{
+	if (SaveFuture.IsValid())
+	{
+		UE_LOG(LogVoxel, Warning, TEXT("GetSaveAsync: A save is already running"));
+		return false;
+	}
+
+	FVoxelData* const VoxelData = Data.Get();
+	SaveFuture = Async<TSharedPtr<FVoxelWorldSave, ESPMode::ThreadSafe>>(EAsyncExecution::ThreadPool, [VoxelData]()
+	{
+		TSharedPtr<FVoxelWorldSave, ESPMode::ThreadSafe> Save = MakeShareable(new FVoxelWorldSave());
+		VoxelData->GetSave(*Save);
+		return Save;
+	});
+
+	return true;
+}
+
+bool AVoxelWorld::LoadFromSaveAsync(const FVoxelWorldSave& Save, bool bReset)
+{
+	if (LoadFuture.IsValid())
+	{
+		UE_LOG(LogVoxel, Warning, TEXT("LoadFromSaveAsync: A load is already running"));
+		return false;
+	}
+	if (Save.ValueBits != VOXEL_VALUE_BITS)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("LoadFromSaveAsync: Current VOXEL_VALUE_BITS is %d while Save one is %d"), VOXEL_VALUE_BITS, Save.ValueBits);
+		return false;
+	}
+	if (Save.Depth != Depth)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("LoadFromSaveAsync: Current Depth is %d while Save one is %d"), Depth, Save.Depth);
+		return false;
+	}
+
+	TSharedPtr<std::forward_list<FVoxelBox>, ESPMode::ThreadSafe> ModifiedBoxes = MakeShareable(new std::forward_list<FVoxelBox>());
+	if (bReset)
+	{
+		// The reset destroys the leaves: done here, on the game thread. Its chunks are updated with the loaded ones
+		Data->ResetAndGetModifiedBoxes(*ModifiedBoxes);
+	}
+
+	FVoxelData* const VoxelData = Data.Get();
+	TSharedPtr<FVoxelWorldSave, ESPMode::ThreadSafe> SaveCopy = MakeShareable(new FVoxelWorldSave(Save));
+	LoadFuture = Async<TSharedPtr<std::forward_list<FVoxelBox>, ESPMode::ThreadSafe>>(EAsyncExecution::ThreadPool, [VoxelData, SaveCopy, ModifiedBoxes]()
+	{
+		VoxelData->LoadFromSaveAndGetModifiedBoxes(*SaveCopy, *ModifiedBoxes, false);
+		return ModifiedBoxes;
+	});
+
+	return true;
+}
+
+void AVoxelWorld::WaitForAsyncTasks()
+{
+	if (SaveFuture.IsValid())
+	{
+		SaveFuture.Wait();
+		SaveFuture = TFuture<TSharedPtr<FVoxelWorldSave, ESPMode::ThreadSafe>>();
+	}
+	if (LoadFuture.IsValid())
+	{
+		LoadFuture.Wait();
+		LoadFuture = TFuture<TSharedPtr<std::forward_list<FVoxelBox>, ESPMode::ThreadSafe>>();
+	}
+	if (IdleLeavesFuture.IsValid())
+	{
+		IdleLeavesFuture.Wait();
+		IdleLeavesFuture = TFuture<void>();
+	}
+	if (JournalFuture.IsValid())
+	{
+		JournalFuture.Wait();
+		JournalFuture = TFuture<bool>();
+	}
+}
+
 void AVoxelWorld::LoadFromSave(FVoxelWorldSave& Save, bool bReset)
 {
-	if (Save.Depth == Depth)
+	if (Save.ValueBits != VOXEL_VALUE_BITS)
 	{
-		std::forward_list<FIntVector> ModifiedPositions;
-		Data->LoadFromSaveAndGetModifiedPositions(Save, ModifiedPositions, bReset);
-		for (auto Position : ModifiedPositions)
+		UE_LOG(LogVoxel, Error, TEXT("LoadFromSave: Current VOXEL_VALUE_BITS is %d while Save one is %d"), VOXEL_VALUE_BITS, Save.ValueBits);
+	}
+	else if (Save.Depth == Depth)
+	{
+		std::forward_list<FVoxelBox> ModifiedBoxes;
+		Data->LoadFromSaveAndGetModifiedBoxes(Save, ModifiedBoxes, bReset);
+		for (auto& Box : ModifiedBoxes)
 		{
-			if (IsInWorld(Position))
-			{
-				UpdateChunksAtPosition(Position, true);
-			}
+			UpdateChunksOverlappingBox(Box, true);
 		}
 		//Render->RegisterChunkUpdates();
 	}
@@ -413,6 +638,27 @@ void AVoxelWorld::LoadFromSave(FVoxelWorldSave& Save, bool bReset)
 	}
 }
 
+void AVoxelWorld::LoadBoxFromSave(FVoxelWorldSave& Save, const FVoxelBox& Box)
+{
+	if (Save.ValueBits != VOXEL_VALUE_BITS)
+	{
+		UE_LOG(LogVoxel, Error, TEXT("LoadBoxFromSave: Current VOXEL_VALUE_BITS is %d while Save one is %d"), VOXEL_VALUE_BITS, Save.ValueBits);
+	}
+	else if (Save.Depth == Depth)
+	{
+		std::forward_list<FVoxelBox> ModifiedBoxes;
+		Data->LoadBoxFromSaveAndGetModifiedBoxes(Save, Box, ModifiedBoxes);
+		for (auto& ModifiedBox : ModifiedBoxes)
+		{
+			UpdateChunksOverlappingBox(ModifiedBox, true);
+		}
+	}
+	else
+	{
+		UE_LOG(LogVoxel, Error, TEXT("LoadBoxFromSave: Current Depth is %d while Save one is %d"), Depth, Save.Depth);
+	}
+}
+
 FVoxelData* AVoxelWorld::GetData() const
 {
 	return Data.Get();
@@ -23,3 +23,10 @@ void UEmptyWorldGenerator::GetValuesAndMaterials(float Values[], FVoxelMaterial
 		}
 	}
 }
+
+bool UEmptyWorldGenerator::GetValueRange(const FVoxelBox& Box, float& OutMin, float& OutMax) const
+{
+	OutMin = 1;
+	OutMax = 1;
+	return true;
+}
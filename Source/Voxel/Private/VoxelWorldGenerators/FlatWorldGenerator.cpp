@@ -73,6 +73,27 @@ void UFlatWorldGenerator::GetValuesAndMaterials(float Values[], FVoxelMaterial M
 	}
 }
 
+bool UFlatWorldGenerator::GetValueRange(const FVoxelBox& Box, float& OutMin, float& OutMax) const
+{
+	const float Above = HardnessMultiplier;
+	const float Below = -HardnessMultiplier;
+
+	if (Box.Min.Z >= TerrainHeight)
+	{
+		OutMin = OutMax = Above;
+	}
+	else if (Box.Max.Z < TerrainHeight)
+	{
+		OutMin = OutMax = Below;
+	}
+	else
+	{
+		OutMin = FMath::Min(Above, Below);
+		OutMax = FMath::Max(Above, Below);
+	}
+	return true;
+}
+
 void UFlatWorldGenerator::SetVoxelWorld(AVoxelWorld* VoxelWorld)
 {
 	TerrainLayers.Sort([](const FFlatWorldLayer& Left, const FFlatWorldLayer& Right) { return Left.Start < Right.Start; });
@@ -47,6 +47,29 @@ void USphereWorldGenerator::GetValuesAndMaterials(float Values[], FVoxelMaterial
 	}
 }
 
+bool USphereWorldGenerator::GetValueRange(const FVoxelBox& Box, float& OutMin, float& OutMax) const
+{
+	// Closest and farthest points of the box from the center
+	FVector Closest;
+	FVector Farthest;
+	for (int Axis = 0; Axis < 3; Axis++)
+	{
+		const float Min = Box.Min[Axis];
+		const float Max = Box.Max[Axis];
+		Closest[Axis] = FMath::Clamp(0.f, Min, Max);
+		Farthest[Axis] = FMath::Max(FMath::Abs(Min), FMath::Abs(Max));
+	}
+
+	// Value is monotonic with the distance
+	const float Sign = HardnessMultiplier * (InverseOutsideInside ? -1 : 1);
+	const float ClosestValue = FMath::Clamp(Closest.Size() - LocalRadius, -2.f, 2.f) / 2 * Sign;
+	const float FarthestValue = FMath::Clamp(Farthest.Size() - LocalRadius, -2.f, 2.f) / 2 * Sign;
+
+	OutMin = FMath::Min(ClosestValue, FarthestValue);
+	OutMax = FMath::Max(ClosestValue, FarthestValue);
+	return true;
+}
+
 void USphereWorldGenerator::SetVoxelWorld(AVoxelWorld* VoxelWorld)
 {
 	LocalRadius = Radius / VoxelWorld->GetVoxelSize();